@@ -0,0 +1,285 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Load test for the cgminer API
+ *
+ * Runs a number of clients in parallel, each sending the same command as
+ * fast as the API answers it, and reports the requests per second and the
+ * latency percentiles over the run. By default each request opens its own
+ * connection like api-example.c does, with -k every client keeps one
+ * connection open and sends {"command":"...","keepalive":true} requests on it.
+ *
+ * Compile:
+ *   gcc -O2 -pthread api-bench.c -o api-bench
+ *
+ * Run:
+ *   ./api-bench -c 32 -t 10 -C summary
+ *   ./api-bench -c 32 -t 10 -C stats -k
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define RECVSIZE 65536
+/* Latencies kept per client, later ones are counted but not kept */
+#define MAXSAMPLES 1000000
+
+static const char *host = "127.0.0.1";
+static const char *port = "4028";
+static const char *command = "summary";
+static int clients = 8;
+static int seconds = 10;
+static bool keepalive;
+
+static volatile bool stop;
+
+struct client {
+	pthread_t pth;
+	struct addrinfo *addr;
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t bytes;
+	uint32_t *samples;
+	int nsamples;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_api(struct addrinfo *addr)
+{
+	int fd, one = 1;
+
+	fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Read one reply, which ends with a '\0' or when the API closes */
+static ssize_t read_reply(int fd, char *buf, bool tillnul)
+{
+	ssize_t n, len = 0;
+
+	while (len < RECVSIZE) {
+		n = recv(fd, buf + len, RECVSIZE - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return tillnul ? -1 : len;
+		len += n;
+		if (tillnul && buf[len - 1] == '\0')
+			return len;
+	}
+	return -1;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *cl = arg;
+	char req[256], *buf;
+	uint64_t start;
+	ssize_t n;
+	int fd = -1, reqlen;
+
+	buf = malloc(RECVSIZE);
+	if (!buf)
+		return NULL;
+
+	if (keepalive)
+		reqlen = snprintf(req, sizeof(req), "{\"command\":\"%s\",\"keepalive\":true}\n", command);
+	else
+		reqlen = snprintf(req, sizeof(req), "%s", command);
+
+	while (!stop) {
+		start = now_us();
+
+		if (fd < 0) {
+			fd = connect_api(cl->addr);
+			if (fd < 0) {
+				cl->errors++;
+				usleep(1000);
+				continue;
+			}
+		}
+
+		if (!send_all(fd, req, reqlen) || (n = read_reply(fd, buf, keepalive)) <= 0) {
+			cl->errors++;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		if (!keepalive) {
+			close(fd);
+			fd = -1;
+		}
+
+		cl->requests++;
+		cl->bytes += n;
+		if (cl->nsamples < MAXSAMPLES)
+			cl->samples[cl->nsamples++] = now_us() - start;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-t seconds] [-C command] [-k]\n"
+			"  -h  API host (default 127.0.0.1)\n"
+			"  -p  API port (default 4028)\n"
+			"  -c  parallel clients (default 8)\n"
+			"  -t  seconds to run (default 10)\n"
+			"  -C  command to send (default summary)\n"
+			"  -k  keep each client's connection open between requests\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints, *addr;
+	struct client *cl;
+	uint64_t requests = 0, errors = 0, bytes = 0, start, elapsed;
+	uint32_t *all;
+	size_t total = 0;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "h:p:c:t:C:k")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'C':
+				command = optarg;
+				break;
+			case 'k':
+				keepalive = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (clients < 1 || seconds < 1)
+		usage(argv[0]);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addr)) {
+		fprintf(stderr, "Can't resolve %s:%s\n", host, port);
+		return 1;
+	}
+
+	cl = calloc(clients, sizeof(*cl));
+	if (!cl)
+		return 1;
+	for (i = 0; i < clients; i++) {
+		cl[i].addr = addr;
+		cl[i].samples = malloc(MAXSAMPLES * sizeof(uint32_t));
+		if (!cl[i].samples || pthread_create(&cl[i].pth, NULL, client_thread, &cl[i])) {
+			fprintf(stderr, "Failed to start client %d\n", i);
+			return 1;
+		}
+	}
+
+	start = now_us();
+	sleep(seconds);
+	stop = true;
+	for (i = 0; i < clients; i++) {
+		pthread_join(cl[i].pth, NULL);
+		requests += cl[i].requests;
+		errors += cl[i].errors;
+		bytes += cl[i].bytes;
+		total += cl[i].nsamples;
+	}
+	elapsed = now_us() - start;
+
+	all = malloc((total ? total : 1) * sizeof(uint32_t));
+	if (!all)
+		return 1;
+	total = 0;
+	for (i = 0; i < clients; i++) {
+		memcpy(all + total, cl[i].samples, cl[i].nsamples * sizeof(uint32_t));
+		total += cl[i].nsamples;
+	}
+	qsort(all, total, sizeof(uint32_t), cmp_u32);
+
+	printf("%s: %d clients%s for %.1fs\n", command, clients,
+		keepalive ? " (keepalive)" : "", elapsed / 1e6);
+	printf("requests %llu errors %llu  %.0f req/s  %.1f MB/s\n",
+		(unsigned long long)requests, (unsigned long long)errors,
+		requests * 1e6 / elapsed, bytes / (double)elapsed);
+	if (total)
+		printf("latency us  p50 %u  p90 %u  p99 %u  max %u\n",
+			all[total / 2], all[total * 90 / 100],
+			all[total * 99 / 100], all[total - 1]);
+
+	return 0;
+}
@@ -28,6 +28,12 @@
 #include "miner.h"
 #include "util.h"
 
+#ifdef __linux
+#include <fcntl.h>
+#include <sys/epoll.h>
+#define API_EPOLL 1
+#endif
+
 #if defined(USE_BFLSC) || defined(USE_AVALON)
 #define HAVE_AN_ASIC 1
 #endif
@@ -232,6 +238,7 @@ static const char *OSINFO =
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
+#define _METRICS	"METRICS"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -269,11 +276,13 @@ static const char ISJSON = '{';
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
+#define JSON_METRICS	JSON1 _METRICS JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -388,6 +397,7 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_DISHPLG 101
 #define MSG_NOHPLG 102
 #define MSG_MISHPLG 103
+#define MSG_METRICS 104
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -455,6 +465,7 @@ struct CODES {
 #if (defined(HAVE_OPENCL) || defined(HAVE_AN_ASIC) || defined(HAVE_AN_FPGA))
 						" - "
 #endif
+						"%d CPU(s)"
  },
 
  { SEVERITY_ERR,   MSG_NODEVS,	PARAM_NONE,	"No GPUs"
@@ -464,6 +475,7 @@ struct CODES {
 #ifdef HAVE_AN_FPGA
 						"/PGAs"
 #endif
+						"/CPUs"
  },
 
  { SEVERITY_SUCC,  MSG_SUMM,	PARAM_NONE,	"Summary" },
@@ -569,12 +581,15 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_DISHPLG,	PARAM_NONE,	"Hotplug disabled" },
  { SEVERITY_WARN,  MSG_NOHPLG,	PARAM_NONE,	"Hotplug is not available" },
  { SEVERITY_ERR,   MSG_MISHPLG,	PARAM_NONE,	"Missing hotplug parameter" },
+ { SEVERITY_SUCC,  MSG_METRICS,	PARAM_NONE,	"Metrics" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
 static int my_thr_id = 0;
 static bool bye;
 
+static const char *localaddr = "127.0.0.1";
+
 // Used to control quit restart access to shutdown variables
 static pthread_mutex_t quit_restart_lock;
 
@@ -1253,6 +1268,42 @@ foundit:
 }
 #endif
 
+static int numcpus()
+{
+	int count = 0;
+	int i;
+
+	rd_lock(&devices_lock);
+	for (i = 0; i < total_devices; i++) {
+		if (devices[i]->drv->drv_id == DRIVER_CPU)
+			count++;
+	}
+	rd_unlock(&devices_lock);
+	return count;
+}
+
+static int cpudevice(int cpuid)
+{
+	int count = 0;
+	int i;
+
+	rd_lock(&devices_lock);
+	for (i = 0; i < total_devices; i++) {
+		if (devices[i]->drv->drv_id == DRIVER_CPU)
+			count++;
+		if (count == (cpuid + 1))
+			goto foundit;
+	}
+
+	rd_unlock(&devices_lock);
+	return -1;
+
+foundit:
+
+	rd_unlock(&devices_lock);
+	return i;
+}
+
 // All replies (except BYE and RESTART) start with a message
 //  thus for JSON, message() inserts JSON_START at the front
 //  and send_result() adds JSON_END at the end
@@ -1339,7 +1390,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 #ifdef HAVE_AN_FPGA
 						, pga
 #endif
-						);
+						, numcpus());
 					break;
 				case PARAM_CMD:
 					sprintf(buf, codes[i].description, JSON_COMMAND);
@@ -1415,6 +1466,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	int gpucount = 0;
 	int asccount = 0;
 	int pgacount = 0;
+	int cpucount = numcpus();
 	char *adlinuse = (char *)NO;
 #ifdef HAVE_ADL
 	const char *adl = YES;
@@ -1448,6 +1500,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	root = api_add_int(root, "GPU Count", &gpucount, false);
 	root = api_add_int(root, "ASC Count", &asccount, false);
 	root = api_add_int(root, "PGA Count", &pgacount, false);
+	root = api_add_int(root, "CPU Count", &cpucount, false);
 	root = api_add_int(root, "Pool Count", &total_pools, false);
 	root = api_add_const(root, "ADL", (char *)adl, false);
 	root = api_add_string(root, "ADL in use", adlinuse, false);
@@ -1502,6 +1555,7 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
+	double latency;
 	float gt, gv;
 	int ga, gf, gp, gc, gm, pt;
 
@@ -1557,6 +1611,11 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
 		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
 		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_int(root, "Stale", &(cgpu->stale), false);
+		root = api_add_diff(root, "Difficulty Stale", &(cgpu->diff_stale), false);
+		latency = cgpu->notify_latency_count ? cgpu->notify_latency_total / cgpu->notify_latency_count : 0;
+		root = api_add_double(root, "Notify Latency Avg", &latency, true);
+		root = api_add_double(root, "Notify Latency Max", &(cgpu->notify_latency_max), false);
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
 
 		root = print_data(root, buf, isjson, precom);
@@ -1572,6 +1631,7 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
+	double latency;
 	int numasc = numascs();
 
 	if (numasc > 0 && asc >= 0 && asc < numasc) {
@@ -1615,6 +1675,11 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
 		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
 		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_int(root, "Stale", &(cgpu->stale), false);
+		root = api_add_diff(root, "Difficulty Stale", &(cgpu->diff_stale), false);
+		latency = cgpu->notify_latency_count ? cgpu->notify_latency_total / cgpu->notify_latency_count : 0;
+		root = api_add_double(root, "Notify Latency Avg", &latency, true);
+		root = api_add_double(root, "Notify Latency Max", &(cgpu->notify_latency_max), false);
 #ifdef USE_USBUTILS
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
@@ -1633,6 +1698,7 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
+	double latency;
 	int numpga = numpgas();
 
 	if (numpga > 0 && pga >= 0 && pga < numpga) {
@@ -1687,6 +1753,11 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
 		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
 		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_int(root, "Stale", &(cgpu->stale), false);
+		root = api_add_diff(root, "Difficulty Stale", &(cgpu->diff_stale), false);
+		latency = cgpu->notify_latency_count ? cgpu->notify_latency_total / cgpu->notify_latency_count : 0;
+		root = api_add_double(root, "Notify Latency Avg", &latency, true);
+		root = api_add_double(root, "Notify Latency Max", &(cgpu->notify_latency_max), false);
 #ifdef USE_USBUTILS
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
@@ -1698,6 +1769,67 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 }
 #endif
 
+static void cpustatus(struct io_data *io_data, int cpu, bool isjson, bool precom)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+	char *enabled;
+	char *status;
+	double latency;
+	int numcpu = numcpus();
+
+	if (numcpu > 0 && cpu >= 0 && cpu < numcpu) {
+		int dev = cpudevice(cpu);
+		if (dev < 0) // Should never happen
+			return;
+
+		struct cgpu_info *cgpu = get_devices(dev);
+
+		cgpu->utility = cgpu->accepted / ( total_secs ? total_secs : 1 ) * 60;
+
+		if (cgpu->deven != DEV_DISABLED)
+			enabled = (char *)YES;
+		else
+			enabled = (char *)NO;
+
+		status = (char *)status2str(cgpu->status);
+
+		root = api_add_int(root, "CPU", &cpu, false);
+		root = api_add_string(root, "Name", cgpu->drv->name, false);
+		root = api_add_int(root, "ID", &(cgpu->device_id), false);
+		root = api_add_string(root, "Enabled", enabled, false);
+		root = api_add_string(root, "Status", status, false);
+		root = api_add_int(root, "Threads", &(cgpu->threads), false);
+		double mhs = cgpu->total_mhashes / total_secs;
+		root = api_add_mhs(root, "MHS av", &mhs, false);
+		char mhsname[27];
+		sprintf(mhsname, "MHS %ds", opt_log_interval);
+		root = api_add_mhs(root, mhsname, &(cgpu->rolling), false);
+		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
+		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
+		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
+		int last_share_pool = cgpu->last_share_pool_time > 0 ?
+					cgpu->last_share_pool : -1;
+		root = api_add_int(root, "Last Share Pool", &last_share_pool, false);
+		root = api_add_time(root, "Last Share Time", &(cgpu->last_share_pool_time), false);
+		root = api_add_mhtotal(root, "Total MH", &(cgpu->total_mhashes), false);
+		root = api_add_int(root, "Diff1 Work", &(cgpu->diff1), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(cgpu->diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(cgpu->diff_rejected), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(cgpu->last_share_diff), false);
+		root = api_add_int(root, "Stale", &(cgpu->stale), false);
+		root = api_add_diff(root, "Difficulty Stale", &(cgpu->diff_stale), false);
+		latency = cgpu->notify_latency_count ? cgpu->notify_latency_total / cgpu->notify_latency_count : 0;
+		root = api_add_double(root, "Notify Latency Avg", &latency, true);
+		root = api_add_double(root, "Notify Latency Max", &(cgpu->notify_latency_max), false);
+		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+
+		root = print_data(root, buf, isjson, precom);
+		io_add(io_data, buf);
+	}
+}
+
 static void devstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	bool io_open = false;
@@ -1705,6 +1837,7 @@ static void devstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 	int numgpu = 0;
 	int numasc = 0;
 	int numpga = 0;
+	int numcpu = numcpus();
 	int i;
 
 #ifdef HAVE_OPENCL
@@ -1719,7 +1852,7 @@ static void devstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 	numpga = numpgas();
 #endif
 
-	if (numgpu == 0 && numpga == 0 && numasc == 0) {
+	if (numgpu == 0 && numpga == 0 && numasc == 0 && numcpu == 0) {
 		message(io_data, MSG_NODEVS, 0, NULL, isjson);
 		return;
 	}
@@ -1756,6 +1889,12 @@ static void devstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 	}
 #endif
 
+	for (i = 0; i < numcpu; i++) {
+		cpustatus(io_data, i, isjson, isjson && devcount > 0);
+
+		devcount++;
+	}
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1986,6 +2125,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
+	double latency;
 	int i;
 
 	if (total_pools == 0) {
@@ -2037,6 +2177,10 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_int(root, "Rejected", &(pool->rejected), false);
 		root = api_add_uint(root, "Discarded", &(pool->discarded_work), false);
 		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
+		root = api_add_uint64(root, "Stale Job", &(pool->stale_reasons[STALE_JOB]), false);
+		root = api_add_uint64(root, "Stale Block", &(pool->stale_reasons[STALE_BLOCK]), false);
+		root = api_add_uint64(root, "Stale Expiry", &(pool->stale_reasons[STALE_EXPIRY]), false);
+		root = api_add_uint64(root, "Stale Switch", &(pool->stale_reasons[STALE_SWITCH]), false);
 		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
 		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
@@ -2061,6 +2205,10 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			root = api_add_const(root, "Stratum URL", BLANK, false);
 		root = api_add_bool(root, "Has GBT", &(pool->has_gbt), false);
 		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_int(root, "Submit Queue", &(pool->submit_queued), false);
+		latency = pool->submit_latency_count ? pool->submit_latency_total / pool->submit_latency_count : 0;
+		root = api_add_double(root, "Submit Latency Avg", &latency, true);
+		root = api_add_double(root, "Submit Latency Max", &(pool->submit_latency_max), false);
 
 		root = print_data(root, buf, isjson, isjson && (i > 0));
 		io_add(io_data, buf);
@@ -2956,6 +3104,55 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 	return ++i;
 }
 
+static int workstats(struct io_data *io_data, int i, bool isjson)
+{
+	struct work_alloc_stats stats;
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+
+	get_work_alloc_stats(&stats);
+
+	root = api_add_int(root, "STATS", &i, false);
+	root = api_add_const(root, "ID", "WORK", false);
+	root = api_add_elapsed(root, "Elapsed", &(total_secs), false);
+	root = api_add_uint64(root, "Work Allocs", &(stats.allocs), true);
+	root = api_add_uint64(root, "Work Frees", &(stats.frees), true);
+	root = api_add_uint64(root, "Cache Hits", &(stats.cache_hits), true);
+	root = api_add_uint64(root, "Depot Gets", &(stats.depot_gets), true);
+	root = api_add_uint64(root, "Depot Puts", &(stats.depot_puts), true);
+	root = api_add_uint64(root, "Slabs", &(stats.slabs), true);
+	root = api_add_uint64(root, "Inline Strings", &(stats.str_inline), true);
+	root = api_add_uint64(root, "Heap Strings", &(stats.str_heap), true);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+
+	return ++i;
+}
+
+static int logstats(struct io_data *io_data, int i, bool isjson)
+{
+	struct log_stats stats;
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+
+	get_log_stats(&stats);
+
+	root = api_add_int(root, "STATS", &i, false);
+	root = api_add_const(root, "ID", "LOG", false);
+	root = api_add_elapsed(root, "Elapsed", &(total_secs), false);
+	root = api_add_uint64(root, "Log Messages", &(stats.logged), true);
+	root = api_add_uint64(root, "Log Dropped", &(stats.dropped), true);
+	root = api_add_uint64(root, "Log Rate Limited", &(stats.limited), true);
+	root = api_add_uint64(root, "Log Oversize", &(stats.oversize), true);
+	root = api_add_uint64(root, "Log Queued", &(stats.queued), true);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+
+	return ++i;
+}
+
 static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct cgpu_info *cgpu;
@@ -2991,6 +3188,107 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		i = itemstats(io_data, i, id, &(pool->cgminer_stats), &(pool->cgminer_pool_stats), NULL, isjson);
 	}
 
+	i = workstats(io_data, i, isjson);
+	i = logstats(io_data, i, isjson);
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+// Upper bounds of the cumulative latency buckets and their name suffixes
+static const double hist_bounds[] = { 0.0001, 0.001, 0.01, 0.1, 1, 10 };
+static const char *hist_bound_names[] = { "100us", "1ms", "10ms", "100ms", "1s", "10s" };
+
+static struct api_data *api_add_hist(struct api_data *root, char *name, struct cg_histogram *hist)
+{
+	char buf[64];
+	uint64_t count;
+	double value;
+	unsigned int i;
+
+	count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	sprintf(buf, "%s Count", name);
+	root = api_add_uint64(root, buf, &count, true);
+	value = hist_mean(hist);
+	sprintf(buf, "%s Mean", name);
+	root = api_add_double(root, buf, &value, true);
+	value = hist_percentile(hist, 50);
+	sprintf(buf, "%s P50", name);
+	root = api_add_double(root, buf, &value, true);
+	value = hist_percentile(hist, 90);
+	sprintf(buf, "%s P90", name);
+	root = api_add_double(root, buf, &value, true);
+	value = hist_percentile(hist, 99);
+	sprintf(buf, "%s P99", name);
+	root = api_add_double(root, buf, &value, true);
+
+	for (i = 0; i < sizeof(hist_bounds) / sizeof(hist_bounds[0]); i++) {
+		count = hist_count_upto(hist, hist_bounds[i]);
+		sprintf(buf, "%s %s", name, hist_bound_names[i]);
+		root = api_add_uint64(root, buf, &count, true);
+	}
+
+	return root;
+}
+
+static void metrics(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+	bool io_open = false;
+	char id[20];
+	int i = 0, j;
+
+	message(io_data, MSG_METRICS, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_METRICS);
+
+	for (j = 0; j < total_devices; j++) {
+		struct cgpu_info *cgpu = get_devices(j);
+
+		if (!cgpu || !cgpu->drv)
+			continue;
+
+		sprintf(id, "%s%d", cgpu->drv->name, cgpu->device_id);
+		root = api_add_int(root, "METRICS", &i, true);
+		root = api_add_string(root, "ID", id, true);
+		root = api_add_elapsed(root, "Elapsed", &(total_secs), false);
+		root = api_add_mhtotal(root, "Total MH", &(cgpu->total_mhashes), false);
+		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
+		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
+		root = api_add_int(root, "Stale", &(cgpu->stale), false);
+		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+		root = api_add_int(root, "Diff1 Work", &(cgpu->diff1), false);
+		root = api_add_hist(root, "Notify Work", &cgpu->notify_work_hist);
+		root = api_add_hist(root, "Work Write", &cgpu->work_write_hist);
+		root = api_add_hist(root, "Nonce Verify", &cgpu->nonce_verify_hist);
+
+		root = print_data(root, buf, isjson, isjson && (i > 0));
+		io_add(io_data, buf);
+		i++;
+	}
+
+	for (j = 0; j < total_pools; j++) {
+		struct pool *pool = pools[j];
+
+		sprintf(id, "POOL%d", j);
+		root = api_add_int(root, "METRICS", &i, true);
+		root = api_add_string(root, "ID", id, true);
+		root = api_add_elapsed(root, "Elapsed", &(total_secs), false);
+		root = api_add_int(root, "Accepted", &(pool->accepted), false);
+		root = api_add_int(root, "Rejected", &(pool->rejected), false);
+		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
+		root = api_add_int(root, "Diff1 Shares", &(pool->diff1), false);
+		root = api_add_int(root, "Submit Queue", &(pool->submit_queued), false);
+		root = api_add_hist(root, "Verify Submit", &pool->verify_submit_hist);
+		root = api_add_hist(root, "Submit Result", &pool->submit_result_hist);
+
+		root = print_data(root, buf, isjson, isjson && (i > 0));
+		io_add(io_data, buf);
+		i++;
+	}
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3401,6 +3699,7 @@ struct CMDS {
 #endif
 	{ "zero",		dozero,		true },
 	{ "hotplug",		dohotplug,	true },
+	{ "metrics",		metrics,	false },
 	{ NULL,			NULL,		false }
 };
 
@@ -3444,25 +3743,58 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 		io_close(io_data);
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+// A finished reply ready to send. Replies to read only commands are kept
+// in the cache and shared by every client asking for them until they expire,
+// so nothing may change one once it is made
+struct api_reply {
+	int refs;
+	int len;		// to send, including the terminating null
+	struct timeval tv_made;
+	char data[];
+};
+
+static struct api_reply *reply_new(struct io_data *io_data, bool isjson)
 {
-	char buf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
-	int count, res, tosend, len, n;
+	struct api_reply *reply;
+	size_t siz;
+
+	siz = strlen(io_data->ptr) + sizeof(JSON_CLOSE) + sizeof(JSON_END_TRUNCATED);
+	reply = malloc(sizeof(*reply) + siz);
+	if (unlikely(!reply))
+		quit(1, "Failed to malloc api_reply");
 
-	strcpy(buf, io_data->ptr);
+	strcpy(reply->data, io_data->ptr);
 
 	if (io_data->close)
-		strcat(buf, JSON_CLOSE);
+		strcat(reply->data, JSON_CLOSE);
 
 	if (isjson) {
 		if (io_data->full)
-			strcat(buf, JSON_END_TRUNCATED);
+			strcat(reply->data, JSON_END_TRUNCATED);
 		else
-			strcat(buf, JSON_END);
+			strcat(reply->data, JSON_END);
 	}
 
-	len = strlen(buf);
-	tosend = len+1;
+	reply->refs = 1;
+	reply->len = strlen(reply->data) + 1;
+	cgtime(&reply->tv_made);
+
+	return reply;
+}
+
+static void reply_put(struct api_reply *reply)
+{
+	if (--reply->refs == 0)
+		free(reply);
+}
+
+static void send_result(struct api_reply *reply, SOCKETTYPE c)
+{
+	char *buf = reply->data;
+	int count, res, tosend, len, n;
+
+	len = reply->len - 1;
+	tosend = reply->len;
 
 	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, buf, len > 10 ? "..." : BLANK);
 
@@ -3501,6 +3833,7 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 					applog(LOG_DEBUG, "API: sent %d of remaining %d (count=%d)", n, tosend, count);
 			}
 
+			buf += n;
 			tosend -= n;
 		}
 	}
@@ -3806,13 +4139,454 @@ static void *restart_thread(__maybe_unused void *userdata)
 	return NULL;
 }
 
+// Read only commands whose replies are shared from the cache for up to
+// --api-cache milliseconds
+static const char *cachecmds = "|version|config|devs|pools|summary|stats|coin|devdetails|notify|usbstats|gpucount|pgacount|metrics|";
+
+static struct api_reply **cached;
+static int ncmds;
+
+static void cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < ncmds * 2; i++) {
+		if (cached[i]) {
+			reply_put(cached[i]);
+			cached[i] = NULL;
+		}
+	}
+}
+
+// Run one request and return its reply. *keepalive is set if the request
+// asks for the connection to be kept open for more requests
+static struct api_reply *process_request(struct io_data *io_data, SOCKETTYPE c, char *buf, int n, char group, char *connectaddr, bool *keepalive)
+{
+	struct api_reply *reply, **slot = NULL;
+	char param_buf[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	bool isjson;
+	bool did;
+	int i;
+
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			did = true;
+		}
+		else {
+			if (json_is_true(json_object_get(json_config, JSON_KEEPALIVE)))
+				*keepalive = true;
+
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did)
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmd, cmds[i].name) == 0) {
+				sprintf(cmdbuf, "|%s|", cmd);
+				if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf)) {
+					if (opt_api_cache && !param && strstr(cachecmds, cmdbuf)) {
+						struct timeval now;
+
+						slot = &cached[i * 2 + isjson];
+						cgtime(&now);
+						if (*slot && tdiff(&now, &(*slot)->tv_made) * 1000 < opt_api_cache) {
+							reply = *slot;
+							reply->refs++;
+							goto out;
+						}
+					}
+
+					/* Bring the device and pool totals up to date with the mining threads */
+					stats_fold();
+					(cmds[i].func)(io_data, c, param, isjson, group);
+
+					// Anything cached may now be out of date
+					if (cmds[i].iswritemode)
+						cache_clear();
+				} else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+				}
+
+				did = true;
+				break;
+			}
+		}
+
+	if (!did)
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+
+	reply = reply_new(io_data, isjson);
+	if (slot) {
+		if (*slot)
+			reply_put(*slot);
+		reply->refs++;
+		*slot = reply;
+	}
+out:
+	if (json_config)
+		json_decref(json_config);
+
+	return reply;
+}
+
+// Decide if the client may connect and with which group
+static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *group)
+{
+	bool addrok = false;
+	int i;
+
+	*connectaddr = inet_ntoa(cli->sin_addr);
+
+	*group = NOPRIVGROUP;
+	if (opt_api_allow) {
+		int client_ip = htonl(cli->sin_addr.s_addr);
+		for (i = 0; i < ips; i++) {
+			if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
+				addrok = true;
+				*group = ipaccess[i].group;
+				break;
+			}
+		}
+	} else {
+		if (opt_api_network)
+			addrok = true;
+		else
+			addrok = (strcmp(*connectaddr, localaddr) == 0);
+	}
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: connection from %s - %s", *connectaddr, addrok ? "Accepted" : "Ignored");
+
+	return addrok;
+}
+
+#ifdef API_EPOLL
+// Every client is non-blocking and served from one epoll loop, so a slow
+// client only holds up itself. A client that sends {"keepalive":true} in a
+// JSON request keeps its connection open after the reply and may send more
+// requests, each ending with a newline. Any other client is closed after its
+// first reply as before.
+#define API_CLIENTS 256
+#define API_EVENTS 64
+// Seconds a client may sit idle before it is closed
+#define API_IDLE 10
+#define API_KEEPALIVE_IDLE 120
+
+struct api_client {
+	SOCKETTYPE fd;
+	char group;
+	char addr[INET_ADDRSTRLEN];
+	bool keepalive;
+	time_t last;
+
+	char in[TMPBUFSIZ];
+	int in_len;
+
+	struct api_reply *reply;
+	int sent;
+
+	struct list_head list;
+};
+
+static LIST_HEAD(api_clients);
+static int api_client_count;
+
+static void client_close(int epfd, struct api_client *cl)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+	CLOSESOCKET(cl->fd);
+	if (cl->reply)
+		reply_put(cl->reply);
+	list_del(&cl->list);
+	free(cl);
+	api_client_count--;
+}
+
+static void client_want(int epfd, struct api_client *cl, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = cl;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+// Returns false once the client has been closed
+static bool client_send(int epfd, struct api_client *cl)
+{
+	int n;
+
+	while (cl->sent < cl->reply->len) {
+		n = send(cl->fd, cl->reply->data + cl->sent, cl->reply->len - cl->sent, MSG_NOSIGNAL);
+		if (SOCKETFAIL(n)) {
+			if (sock_blocks()) {
+				client_want(epfd, cl, EPOLLOUT);
+				return true;
+			}
+			applog(LOG_DEBUG, "API: send to %s failed: %s", cl->addr, SOCKERRMSG);
+			client_close(epfd, cl);
+			return false;
+		}
+		cl->sent += n;
+	}
+
+	reply_put(cl->reply);
+	cl->reply = NULL;
+
+	if (!cl->keepalive) {
+		client_close(epfd, cl);
+		return false;
+	}
+
+	client_want(epfd, cl, EPOLLIN);
+	return true;
+}
+
+// Answer whatever requests the client has sent in full
+static void client_process(int epfd, struct api_client *cl, struct io_data *io_data)
+{
+	char buf[TMPBUFSIZ];
+	char *end;
+	int n, used;
+
+	while (!cl->reply && cl->in_len) {
+		if (cl->keepalive) {
+			end = memchr(cl->in, '\n', cl->in_len);
+			if (!end)
+				end = memchr(cl->in, '\0', cl->in_len);
+			if (!end) {
+				if (cl->in_len >= (int)sizeof(cl->in) - 1) {
+					applog(LOG_DEBUG, "API: request from %s too long", cl->addr);
+					client_close(epfd, cl);
+				}
+				return;
+			}
+			n = end - cl->in;
+			used = n + 1;
+		} else {
+			// Like before, the first read is the whole request
+			n = cl->in_len;
+			used = n;
+		}
+
+		memcpy(buf, cl->in, n);
+		buf[n] = '\0';
+		cl->in_len -= used;
+		memmove(cl->in, cl->in + used, cl->in_len);
+		if (!n)
+			continue;
+
+		if (opt_debug)
+			applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+
+		cl->reply = process_request(io_data, cl->fd, buf, n, cl->group, cl->addr, &cl->keepalive);
+		cl->sent = 0;
+		if (!client_send(epfd, cl))
+			return;
+	}
+}
+
+static void client_accept(int epfd, SOCKETTYPE apisock)
+{
+	struct api_client *cl;
+	struct epoll_event ev;
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	char group;
+	SOCKETTYPE c;
+
+	while (42) {
+		clisiz = sizeof(cli);
+		c = accept4(apisock, (struct sockaddr *)(&cli), &clisiz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (SOCKETFAIL(c)) {
+			if (!sock_blocks() && errno != EINTR && errno != ECONNABORTED)
+				applog(LOG_ERR, "API accept failed (%s)", SOCKERRMSG);
+			return;
+		}
+
+		if (!check_connect(&cli, &connectaddr, &group)) {
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		if (api_client_count >= API_CLIENTS) {
+			applog(LOG_WARNING, "API: too many clients, dropping %s", connectaddr);
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		cl = calloc(1, sizeof(*cl));
+		if (unlikely(!cl))
+			quit(1, "Failed to calloc api_client");
+		cl->fd = c;
+		cl->group = group;
+		strncpy(cl->addr, connectaddr, sizeof(cl->addr) - 1);
+		cl->last = time(NULL);
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = cl;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c, &ev)) {
+			applog(LOG_ERR, "API: epoll_ctl failed (%s)", SOCKERRMSG);
+			CLOSESOCKET(c);
+			free(cl);
+			continue;
+		}
+		list_add_tail(&cl->list, &api_clients);
+		api_client_count++;
+	}
+}
+
+static void client_read(int epfd, struct api_client *cl, struct io_data *io_data)
+{
+	int n;
+
+	n = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - 1 - cl->in_len, 0);
+	if (n == 0 || (SOCKETFAIL(n) && !sock_blocks())) {
+		if (SOCKETFAIL(n))
+			applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		client_close(epfd, cl);
+		return;
+	}
+	if (SOCKETFAIL(n))
+		return;
+
+	cl->in_len += n;
+	cl->last = time(NULL);
+	client_process(epfd, cl, io_data);
+}
+
+static void close_idle_clients(int epfd, bool all)
+{
+	struct api_client *cl, *tmp;
+	time_t now = time(NULL);
+
+	list_for_each_entry_safe(cl, tmp, &api_clients, list) {
+		if (all || now - cl->last > (cl->keepalive ? API_KEEPALIVE_IDLE : API_IDLE))
+			client_close(epfd, cl);
+	}
+}
+
+static void api_serve(SOCKETTYPE apisock, struct io_data *io_data)
+{
+	struct epoll_event ev, events[API_EVENTS];
+	time_t last_sweep = time(NULL);
+	int epfd, n, i;
+
+	if (fcntl(apisock, F_SETFL, fcntl(apisock, F_GETFL) | O_NONBLOCK) == -1) {
+		applog(LOG_ERR, "API failed to set non-blocking (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		applog(LOG_ERR, "API epoll_create failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, apisock, &ev);
+
+	while (!bye) {
+		n = epoll_wait(epfd, events, API_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			applog(LOG_ERR, "API epoll_wait failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+			break;
+		}
+
+		for (i = 0; i < n && !bye; i++) {
+			struct api_client *cl = events[i].data.ptr;
+
+			if (!cl) {
+				client_accept(epfd, apisock);
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+				client_close(epfd, cl);
+				continue;
+			}
+			if (cl->reply) {
+				if (events[i].events & EPOLLOUT && client_send(epfd, cl))
+					client_process(epfd, cl, io_data);
+			} else if (events[i].events & EPOLLIN)
+				client_read(epfd, cl, io_data);
+		}
+
+		if (time(NULL) != last_sweep) {
+			close_idle_clients(epfd, false);
+			last_sweep = time(NULL);
+		}
+	}
+
+	close_idle_clients(epfd, true);
+	close(epfd);
+}
+#endif
+
 void api(int api_thr_id)
 {
 	struct io_data *io_data;
 	struct thr_info bye_thr;
 	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	const char *localaddr = "127.0.0.1";
 	SOCKETTYPE c;
 	int n, bound;
 	char *connectaddr;
@@ -3822,17 +4596,8 @@ void api(int api_thr_id)
 	struct sockaddr_in serv;
 	struct sockaddr_in cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd;
-	char *param;
-	bool addrok;
+	bool keepalive;
 	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did;
-	int i;
 
 	SOCKETTYPE *apisock;
 
@@ -3846,6 +4611,12 @@ void api(int api_thr_id)
 
 	io_data = sock_io_new();
 
+	for (ncmds = 0; cmds[ncmds].name != NULL; ncmds++)
+		;
+	cached = calloc(ncmds * 2, sizeof(*cached));
+	if (unlikely(!cached))
+		quit(1, "Failed to calloc api reply cache");
+
 	mutex_init(&quit_restart_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
@@ -3936,6 +4707,9 @@ void api(int api_thr_id)
 			applog(LOG_WARNING, "API running in local read access mode on port %d (%d)", port, (int)*apisock);
 	}
 
+#ifdef API_EPOLL
+	api_serve(*apisock, io_data);
+#else
 	while (!bye) {
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
@@ -3943,30 +4717,7 @@ void api(int api_thr_id)
 			goto die;
 		}
 
-		connectaddr = inet_ntoa(cli.sin_addr);
-
-		addrok = false;
-		group = NOPRIVGROUP;
-		if (opt_api_allow) {
-			int client_ip = htonl(cli.sin_addr.s_addr);
-			for (i = 0; i < ips; i++) {
-				if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
-					addrok = true;
-					group = ipaccess[i].group;
-					break;
-				}
-			}
-		} else {
-			if (opt_api_network)
-				addrok = true;
-			else
-				addrok = (strcmp(connectaddr, localaddr) == 0);
-		}
-
-		if (opt_debug)
-			applog(LOG_DEBUG, "API: connection from %s - %s", connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
+		if (check_connect(&cli, &connectaddr, &group)) {
 			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
 			if (SOCKETFAIL(n))
 				buf[0] = '\0';
@@ -3981,94 +4732,16 @@ void api(int api_thr_id)
 			}
 
 			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
+				struct api_reply *reply;
 
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did)
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
-
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
+				reply = process_request(io_data, c, buf, n, group, connectaddr, &keepalive);
+				send_result(reply, c);
+				reply_put(reply);
 			}
 		}
 		CLOSESOCKET(c);
 	}
+#endif
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
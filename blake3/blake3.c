@@ -614,3 +614,80 @@ void blake3_hasher_reset(blake3_hasher *self) {
   chunk_state_reset(&self->chunk, self->key, 0);
   self->cv_stack_len = 0;
 }
+
+void blake3_hash_many_chunk_split(const uint8_t *const *blocks,
+                                  const uint8_t *const *last_blocks,
+                                  size_t num_inputs, size_t input_len,
+                                  uint8_t *out) {
+  assert(input_len > 0 && input_len <= BLAKE3_CHUNK_LEN);
+  size_t full_blocks = (input_len - 1) / BLAKE3_BLOCK_LEN;
+  size_t last_len = input_len - full_blocks * BLAKE3_BLOCK_LEN;
+  uint8_t last_flags = CHUNK_END | ROOT;
+
+  // The full blocks of every message share the key, so they go through the
+  // hash_many kernels, leaving one chaining value per message in out.
+  if (full_blocks > 0) {
+    blake3_hash_many(blocks, num_inputs, full_blocks, IV, 0, false, 0,
+                     CHUNK_START, 0, out);
+  } else {
+    last_flags |= CHUNK_START;
+  }
+
+  for (size_t i = 0; i < num_inputs; i++) {
+    uint32_t cv[8];
+    if (full_blocks > 0) {
+      load_key_words(&out[i * BLAKE3_OUT_LEN], cv);
+    } else {
+      memcpy(cv, IV, BLAKE3_KEY_LEN);
+    }
+    blake3_compress_in_place(cv, last_blocks[i], (uint8_t)last_len, 0,
+                             last_flags);
+    store_cv_words(&out[i * BLAKE3_OUT_LEN], cv);
+  }
+}
+
+void blake3_hash_many_chunks(const uint8_t *const *inputs, size_t num_inputs,
+                             size_t input_len, uint8_t *out) {
+  assert(input_len > 0 && input_len <= BLAKE3_CHUNK_LEN);
+  size_t last_offset = ((input_len - 1) / BLAKE3_BLOCK_LEN) * BLAKE3_BLOCK_LEN;
+  uint8_t padded[MAX_SIMD_DEGREE_OR_2][BLAKE3_BLOCK_LEN];
+  const uint8_t *last_blocks[MAX_SIMD_DEGREE_OR_2];
+
+  while (num_inputs > 0) {
+    size_t n = num_inputs;
+    if (n > MAX_SIMD_DEGREE_OR_2) {
+      n = MAX_SIMD_DEGREE_OR_2;
+    }
+    for (size_t i = 0; i < n; i++) {
+      memset(padded[i], 0, BLAKE3_BLOCK_LEN);
+      memcpy(padded[i], &inputs[i][last_offset], input_len - last_offset);
+      last_blocks[i] = padded[i];
+    }
+    blake3_hash_many_chunk_split(inputs, last_blocks, n, input_len, out);
+    inputs += n;
+    num_inputs -= n;
+    out += n * BLAKE3_OUT_LEN;
+  }
+}
+
+void blake3_hash_chunk_split(const uint8_t *blocks,
+                             const uint8_t last_block[BLAKE3_BLOCK_LEN],
+                             size_t input_len, uint8_t out[BLAKE3_OUT_LEN]) {
+  assert(input_len > 0 && input_len <= BLAKE3_CHUNK_LEN);
+  size_t full_blocks = (input_len - 1) / BLAKE3_BLOCK_LEN;
+  size_t last_len = input_len - full_blocks * BLAKE3_BLOCK_LEN;
+  uint8_t start_flag = CHUNK_START;
+  uint32_t cv[8];
+
+  memcpy(cv, IV, BLAKE3_KEY_LEN);
+  for (size_t i = 0; i < full_blocks; i++) {
+    blake3_compress_in_place(cv, &blocks[i * BLAKE3_BLOCK_LEN],
+                             BLAKE3_BLOCK_LEN, 0, start_flag);
+    start_flag = 0;
+  }
+  blake3_compress_in_place(cv, last_block, (uint8_t)last_len, 0,
+                           start_flag | CHUNK_END | ROOT);
+  store_cv_words(out, cv);
+}
+
+size_t blake3_hash_many_degree(void) { return blake3_simd_degree(); }
@@ -53,6 +53,29 @@ void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t seek,
                                  uint8_t *out, size_t out_len);
 void blake3_hasher_reset(blake3_hasher *self);
 
+// Hashes num_inputs independent messages of the same length, each no longer
+// than one chunk, writing BLAKE3_OUT_LEN bytes per message to out. Every
+// block but the last is compressed across messages in SIMD lanes.
+void blake3_hash_many_chunks(const uint8_t *const *inputs, size_t num_inputs,
+                             size_t input_len, uint8_t *out);
+// As above, but each message is split into its full blocks and its final
+// block, already zero padded to BLAKE3_BLOCK_LEN, so a final block shared by
+// several messages need only be prepared once.
+void blake3_hash_many_chunk_split(const uint8_t *const *blocks,
+                                  const uint8_t *const *last_blocks,
+                                  size_t num_inputs, size_t input_len,
+                                  uint8_t *out);
+// Hashes one message of at most one chunk by compressing its blocks in
+// order straight from the caller's buffers: (input_len - 1) / BLAKE3_BLOCK_LEN
+// full blocks followed by the zero padded final block. Gives the same result
+// as blake3_hasher_update() and blake3_hasher_finalize() with none of the
+// hasher's buffering.
+void blake3_hash_chunk_split(const uint8_t *blocks,
+                             const uint8_t last_block[BLAKE3_BLOCK_LEN],
+                             size_t input_len, uint8_t out[BLAKE3_OUT_LEN]);
+// The number of messages blake3_hash_many_chunks() compresses at once.
+size_t blake3_hash_many_degree(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -46,8 +46,8 @@
 #include "findnonce.h"
 #include "adl.h"
 #include "driver-opencl.h"
-#include "bench_block.h"
 #include "scrypt.h"
+#include "journal.h"
 
 #ifdef USE_AVALON
 #include "driver-avalon.h"
@@ -80,6 +80,10 @@ static char packagename[256];
 
 bool opt_protocol;
 static bool opt_benchmark;
+static double opt_benchmark_diff = 1.0;
+static unsigned int opt_benchmark_seed;
+static int opt_benchmark_time;
+static char *opt_benchmark_report;
 bool have_longpoll;
 bool want_per_device_stats;
 bool use_syslog;
@@ -117,12 +121,14 @@ struct cgpu_info **devices;
 bool have_opencl;
 int mining_threads;
 int num_processors;
+int opt_cpu_threads;
 #ifdef HAVE_CURSES
 bool use_curses = true;
 #else
 bool use_curses;
 #endif
 static bool opt_submit_stale = true;
+static int opt_submit_threads = 4;
 static int opt_shares;
 bool opt_fail_only;
 static bool opt_fix_protocol;
@@ -130,6 +136,7 @@ bool opt_autofan;
 bool opt_autoengine;
 bool opt_noadl;
 char *opt_api_allow = NULL;
+int opt_api_cache = 1000;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
 int opt_api_port = 4028;
@@ -139,6 +146,8 @@ bool opt_delaynet;
 bool opt_disable_pool;
 char *opt_icarus_options = NULL;
 char *opt_icarus_timing = NULL;
+int opt_icarus_halflife = 5;
+int opt_icarus_queue = 2;
 char *opt_cainsmore_clock = NULL;	
 char *opt_ztex_clock = NULL;		
 
@@ -171,6 +180,7 @@ static int gwsched_thr_id;
 static int stage_thr_id;
 static int watchpool_thr_id;
 static int watchdog_thr_id;
+static int verify_thr_id;
 #ifdef HAVE_CURSES
 static int input_thr_id;
 #endif
@@ -274,6 +284,7 @@ struct stratum_share {
 	struct work *work;
 	int id;
 	time_t sshare_time;
+	struct timeval tv_sent;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -302,7 +313,37 @@ struct sigaction termhandler, inthandler;
 struct thread_q *getq;
 
 static int total_work;
-struct work *staged_work = NULL;
+/* Staged work that can't be rolled, which is all of it on stratum, is kept in
+ * a lock free queue that mining threads pop without touching stgd_lock. Only
+ * rollable work, which clone_available() needs to walk, and any overflow of
+ * the queue are kept on lists under stgd_lock, one lane each so neither pop
+ * has to search. Each lane is in the order it was staged. */
+static struct lfq *staged_lfq;
+static LIST_HEAD(staged_rollable_list);
+static LIST_HEAD(staged_overflow);
+/* Shares waiting for a submit thread */
+static struct thread_q *submit_q;
+#define SUBMIT_BATCH_MAX 32
+/* Shares queued, being sent or waiting to be retried are limited so a pool
+ * that can't keep up holds back the verify thread instead of growing the
+ * queue without bound */
+#define SUBMIT_QUEUE_MAX 1024
+#define SUBMIT_RETRY_SECS 5
+static int submit_outstanding;
+static pthread_mutex_t submit_lock;
+static pthread_cond_t submit_cond;
+/* Stratum shares that failed to send, in the order they're due to be
+ * retried, under submit_lock */
+static LIST_HEAD(submit_retry_list);
+/* Time from a nonce being found to its share being sent to the pool */
+static struct cg_histogram submit_hist;
+/* Total work staged in both, kept atomically */
+static int staged_count;
+/* Number of hash_pop callers sleeping on getq->cond, and whether the getwork
+ * scheduler is sleeping on gws_cond, so wakers only take stgd_lock when there
+ * is someone to wake */
+static int stgd_waiters;
+static bool gws_waiting;
 
 struct schedtime {
 	bool enable;
@@ -431,7 +472,9 @@ struct cgpu_info *get_devices(int id)
 
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char *target, *hash, *data;
+	char target[sizeof(work->target) * 2 + 1];
+	char hash[sizeof(work->hash) * 2 + 1];
+	char data[sizeof(work->data) * 2 + 1];
 	struct cgpu_info *cgpu;
 	unsigned long int t;
 	struct pool *pool;
@@ -446,15 +489,12 @@ static void sharelog(const char*disposition, const struct work*work)
 	cgpu = get_thr_cgpu(thr_id);
 	pool = work->pool;
 	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
+	__bin2hex(target, work->target, sizeof(work->target));
+	__bin2hex(hash, work->hash, sizeof(work->hash));
+	__bin2hex(data, work->data, sizeof(work->data));
 
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
 	if (rv >= (int)(sizeof(s)))
 		s[sizeof(s) - 1] = '\0';
 	else if (rv < 0) {
@@ -557,6 +597,20 @@ static char *set_int_0_to_9999(const char *arg, int *i)
 	return set_int_range(arg, i, 0, 9999);
 }
 
+static char *set_benchmark_diff(const char *arg, double *diff)
+{
+	char *end;
+	double d;
+
+	d = strtod(arg, &end);
+	/* Devices only return nonces of at least difficulty 1 */
+	if (end == arg || *end || d < 1)
+		return "Invalid value passed to benchmark-diff";
+	*diff = d;
+
+	return NULL;
+}
+
 static char *set_int_1_to_65535(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 1, 65535);
@@ -897,6 +951,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-allow",
 		     set_api_allow, NULL, NULL,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
+	OPT_WITH_ARG("--api-cache",
+		     set_int_0_to_9999, opt_show_intval, &opt_api_cache,
+		     "Milliseconds to reuse replies to read only API commands, 0 to disable"),
 	OPT_WITH_ARG("--api-description",
 		     set_api_description, NULL, NULL,
 		     "Description placed in the API status header, default: cgminer version"),
@@ -926,6 +983,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run cgminer in benchmark mode - produces no shares"),
+	OPT_WITH_ARG("--benchmark-diff",
+		     set_benchmark_diff, NULL, &opt_benchmark_diff,
+		     "Share difficulty of the generated work in benchmark mode (default: 1)"),
+	OPT_WITH_ARG("--benchmark-report",
+		     opt_set_charp, NULL, &opt_benchmark_report,
+		     "File to write the JSON benchmark report to (default: stdout)"),
+	OPT_WITH_ARG("--benchmark-seed",
+		     opt_set_uintval, opt_show_uintval, &opt_benchmark_seed,
+		     "Seed for the headers generated in benchmark mode"),
+	OPT_WITH_ARG("--benchmark-time",
+		     set_int_0_to_9999, opt_show_intval, &opt_benchmark_time,
+		     "Seconds to run in benchmark mode before reporting and exiting (0 = no limit)"),
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
@@ -936,6 +1005,9 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_compact,
 			"Use compact display without per device statistics"),
 #endif
+	OPT_WITH_ARG("--cpu-threads",
+		     set_int_0_to_9999, opt_show_intval, &opt_cpu_threads,
+		     "Number of threads mining on the CPU (0 to disable)"),
 	OPT_WITHOUT_ARG("--debug|-D",
 		     enable_debug, &opt_debug,
 		     "Enable debug output"),
@@ -1032,6 +1104,12 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--icarus-timing",
 		     set_icarus_timing, NULL, NULL,
 		     opt_hidden),
+	OPT_WITH_ARG("--icarus-halflife",
+		     set_int_1_to_65535, opt_show_intval, &opt_icarus_halflife,
+		     opt_hidden),
+	OPT_WITH_ARG("--icarus-queue",
+		     set_int_1_to_10, opt_show_intval, &opt_icarus_queue,
+		     opt_hidden),
 	OPT_WITH_ARG("--cainsmore-clock",			
 		     set_cainsmore_clock, NULL, NULL,
 		     opt_hidden),
@@ -1052,6 +1130,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+	OPT_WITH_ARG("--log-rate",
+		     set_int_0_to_9999, opt_show_intval, &opt_log_rate,
+		     "Most log messages written per second, 0 for no limit"),
 #if defined(unix)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -1140,12 +1221,21 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
+	OPT_WITH_ARG("--share-journal",
+		     opt_set_charp, NULL, &opt_share_journal,
+		     "Record every share in a binary journal file, read it with journal-dump"),
+	OPT_WITH_ARG("--share-journal-size",
+		     set_int_1_to_65535, opt_show_intval, &opt_share_journal_size,
+		     "Size in MB of each share journal file before it is rotated"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--submit-threads",
+		     set_int_1_to_10, opt_show_intval, &opt_submit_threads,
+		     "Number of threads submitting shares to pools"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1506,12 +1596,158 @@ static void calc_midstate(struct work *work)
 	endian_flip32(work->midstate, work->midstate);
 }
 
-static struct work *make_work(void)
+/* Work structs are recycled through a small cache kept per thread instead of
+ * going back to the heap. A cache growing past WORK_CACHE_MAX hands a batch
+ * of WORK_CACHE_BATCH structs to the shared depot and an empty cache takes a
+ * batch back from it, a new slab of WORK_CACHE_BATCH structs only being
+ * allocated when the depot is empty too. Slabs are never returned to the
+ * heap so memory use stays at the peak amount of work in flight. */
+#define WORK_CACHE_BATCH 32
+#define WORK_CACHE_MAX (WORK_CACHE_BATCH * 2)
+
+struct work_cache {
+	struct work *head;
+	int count;
+	struct work_alloc_stats stats;
+	struct work_cache *next;
+};
+
+static pthread_key_t work_cache_key;
+static pthread_mutex_t work_depot_lock;
+static struct work *work_depot;
+/* All live thread caches, and the stats of those already retired */
+static struct work_cache *work_caches;
+static struct work_alloc_stats work_stats_retired;
+
+static void add_work_alloc_stats(struct work_alloc_stats *stats, struct work_alloc_stats *add)
+{
+	stats->allocs += add->allocs;
+	stats->frees += add->frees;
+	stats->cache_hits += add->cache_hits;
+	stats->depot_gets += add->depot_gets;
+	stats->depot_puts += add->depot_puts;
+	stats->slabs += add->slabs;
+	stats->str_inline += add->str_inline;
+	stats->str_heap += add->str_heap;
+}
+
+void get_work_alloc_stats(struct work_alloc_stats *stats)
+{
+	struct work_cache *cache;
+
+	mutex_lock(&work_depot_lock);
+	*stats = work_stats_retired;
+	for (cache = work_caches; cache; cache = cache->next)
+		add_work_alloc_stats(stats, &cache->stats);
+	mutex_unlock(&work_depot_lock);
+}
+
+/* Called as each thread exits to give its cached work back to the depot */
+static void retire_work_cache(void *userdata)
+{
+	struct work_cache *cache = userdata, **prev;
+	struct work *work;
+
+	mutex_lock(&work_depot_lock);
+	while ((work = cache->head)) {
+		cache->head = work->slab_next;
+		work->slab_next = work_depot;
+		work_depot = work;
+	}
+	add_work_alloc_stats(&work_stats_retired, &cache->stats);
+	for (prev = &work_caches; *prev; prev = &(*prev)->next) {
+		if (*prev == cache) {
+			*prev = cache->next;
+			break;
+		}
+	}
+	mutex_unlock(&work_depot_lock);
+
+	free(cache);
+}
+
+static struct work_cache *get_work_cache(void)
+{
+	struct work_cache *cache = pthread_getspecific(work_cache_key);
+
+	if (unlikely(!cache)) {
+		cache = calloc(1, sizeof(*cache));
+		if (unlikely(!cache))
+			quit(1, "Failed to calloc work_cache in get_work_cache");
+		if (unlikely(pthread_setspecific(work_cache_key, cache)))
+			quit(1, "Failed to pthread_setspecific in get_work_cache");
+
+		mutex_lock(&work_depot_lock);
+		cache->next = work_caches;
+		work_caches = cache;
+		mutex_unlock(&work_depot_lock);
+	}
+
+	return cache;
+}
+
+static void refill_work_cache(struct work_cache *cache)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work *work;
+	int i;
+
+	mutex_lock(&work_depot_lock);
+	if (work_depot) {
+		for (i = 0; i < WORK_CACHE_BATCH && (work = work_depot); i++) {
+			work_depot = work->slab_next;
+			work->slab_next = cache->head;
+			cache->head = work;
+			cache->count++;
+		}
+		cache->stats.depot_gets++;
+		mutex_unlock(&work_depot_lock);
+		return;
+	}
+	mutex_unlock(&work_depot_lock);
 
+	work = calloc(WORK_CACHE_BATCH, sizeof(struct work));
 	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+		quit(1, "Failed to calloc work slab in refill_work_cache");
+	for (i = 0; i < WORK_CACHE_BATCH; i++) {
+		work[i].slab_next = cache->head;
+		cache->head = &work[i];
+	}
+	cache->count += WORK_CACHE_BATCH;
+	cache->stats.slabs++;
+}
+
+static void drain_work_cache(struct work_cache *cache)
+{
+	struct work *head, *tail;
+	int i;
+
+	head = tail = cache->head;
+	for (i = 1; i < WORK_CACHE_BATCH; i++)
+		tail = tail->slab_next;
+	cache->head = tail->slab_next;
+	cache->count -= WORK_CACHE_BATCH;
+
+	mutex_lock(&work_depot_lock);
+	tail->slab_next = work_depot;
+	work_depot = head;
+	mutex_unlock(&work_depot_lock);
+	cache->stats.depot_puts++;
+}
+
+static struct work *make_work(void)
+{
+	struct work_cache *cache = get_work_cache();
+	struct work *work;
+
+	if (unlikely(!cache->head))
+		refill_work_cache(cache);
+	else
+		cache->stats.cache_hits++;
+	work = cache->head;
+	cache->head = work->slab_next;
+	cache->count--;
+	cache->stats.allocs++;
+	work->slab_next = NULL;
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -1520,24 +1756,65 @@ static struct work *make_work(void)
 	return work;
 }
 
+static bool work_str_inline(struct work *work, char *s)
+{
+	return (s >= work->strbuf && s < work->strbuf + sizeof(work->strbuf));
+}
+
+/* Strings attached to work are copied into its inline strbuf when they fit
+ * and only go to the heap when they don't */
+char *work_strdup(struct work *work, const char *s)
+{
+	struct work_cache *cache = get_work_cache();
+	size_t len = strlen(s) + 1;
+	char *ret;
+
+	if (len <= sizeof(work->strbuf) - work->strbuf_used) {
+		ret = work->strbuf + work->strbuf_used;
+		memcpy(ret, s, len);
+		work->strbuf_used += len;
+		cache->stats.str_inline++;
+	} else {
+		ret = strdup(s);
+		if (unlikely(!ret))
+			quit(1, "Failed to strdup in work_strdup");
+		cache->stats.str_heap++;
+	}
+
+	return ret;
+}
+
+static void free_work_str(struct work *work, char *s)
+{
+	if (!work_str_inline(work, s))
+		free(s);
+}
+
 /* This is the central place all work that is about to be retired should be
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->nonce2);
-	free(work->ntime);
-	free(work->gbt_coinbase);
-	free(work->nonce1);
+	free_work_str(work, work->job_id);
+	free_work_str(work, work->nonce2);
+	free_work_str(work, work->ntime);
+	free_work_str(work, work->gbt_coinbase);
+	free_work_str(work, work->nonce1);
 	memset(work, 0, sizeof(struct work));
 }
 
-/* All dynamically allocated work structs should be freed here to not leak any
- * ram from arrays allocated within the work struct */
+/* All work structs from make_work should be freed here to not leak any
+ * ram from arrays allocated within the work struct, and return the struct
+ * itself to this thread's cache */
 void free_work(struct work *work)
 {
+	struct work_cache *cache = get_work_cache();
+
 	clean_work(work);
-	free(work);
+	work->slab_next = cache->head;
+	cache->head = work;
+	cache->stats.frees++;
+	if (unlikely(++cache->count > WORK_CACHE_MAX))
+		drain_work_cache(cache);
 }
 
 /* Generate a GBT coinbase from the existing GBT variables stored. Must be
@@ -1650,7 +1927,7 @@ static unsigned char *__gbt_merkleroot(struct pool *pool)
 	return merkle_hash;
 }
 
-static void calc_diff(struct work *work, int known);
+static void calc_diff(struct work *work, double known);
 static bool work_decode(struct pool *pool, struct work *work, json_t *val);
 
 static void update_gbt(struct pool *pool)
@@ -1718,7 +1995,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	work->gbt_txns = pool->gbt_txns + 1;
 
 	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+		work->job_id = work_strdup(work, pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	memcpy(work->data + 4 + 32, merkleroot, 32);
@@ -1906,18 +2183,12 @@ void decay_time(double *f, double fadd)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return __atomic_load_n(&staged_count, __ATOMIC_SEQ_CST);
 }
 
 static int total_staged(void)
 {
-	int ret;
-
-	mutex_lock(stgd_lock);
-	ret = __total_staged();
-	mutex_unlock(stgd_lock);
-
-	return ret;
+	return __total_staged();
 }
 
 #ifdef HAVE_CURSES
@@ -2388,6 +2659,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 				applog(LOG_NOTICE, "Accepted %s %s %d %s%s",
 				       hashshow, cgpu->drv->name, cgpu->device_id, resubmit ? "(resubmit)" : "", worktime);
 		}
+		journal_share(JOURNAL_ACCEPT, work);
 		sharelog("accept", work);
 		if (opt_shares && total_accepted >= opt_shares) {
 			applog(LOG_WARNING, "Successfully mined %d accepted shares as requested and exiting.", opt_shares);
@@ -2419,6 +2691,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
 
+		journal_share(JOURNAL_REJECT, work);
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
 			char where[20];
@@ -2723,7 +2996,7 @@ static const uint64_t diffone = 0xFFFF000000000000ull;
 /*
  * Calculate the work share difficulty
  */
-static void calc_diff(struct work *work, int known)
+static void calc_diff(struct work *work, double known)
 {
 	struct cgminer_pool_stats *pool_stats = &(work->pool->cgminer_pool_stats);
 	double difficulty;
@@ -2770,22 +3043,58 @@ static void calc_diff(struct work *work, int known)
 	}
 }
 
+/* xorshift64* so a --benchmark-seed always generates the same headers */
+static uint64_t benchmark_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Generate work laid out like that from a stratum job. The 180 byte header
+ * is made once from --benchmark-seed with the target for --benchmark-diff
+ * ahead of the timestamp, and every work gets the next 3 byte prefix in
+ * front of the nonce the way nonce2 is handed out. */
 static void get_benchmark_work(struct work *work)
 {
-	// Use a random work block pulled from a pool
-	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+	static unsigned char header[180];
+	static unsigned char target[32];
+	static uint32_t prefix;
+	static bool generated;
+
+	if (unlikely(!generated)) {
+		uint64_t state = ((uint64_t)opt_benchmark_seed << 1) | 1;
+		unsigned char le_target[32];
+		int i;
 
-	size_t bench_size = sizeof(*work);
-	size_t work_size = sizeof(bench_block);
-	size_t min_size = (work_size < bench_size ? work_size : bench_size);
-	memset(work, 0, sizeof(*work));
-	memcpy(work, &bench_block, min_size);
+		for (i = 8; i < 180; i++)
+			header[i] = benchmark_rand(&state) >> 56;
+		/* Shares are checked against the target from the first byte */
+		set_target(le_target, opt_benchmark_diff);
+		swab256(target, le_target);
+		memcpy(&header[108], target, 32);
+		generated = true;
+		applog(LOG_NOTICE, "Benchmarking with seed %u at difficulty %g",
+		       opt_benchmark_seed, opt_benchmark_diff);
+	}
+
+	memcpy(work->data, header, 180);
+	*(uint32_t *)work->data = htole32(prefix++ & 0xffffff);
+	memcpy(work->target, target, 32);
+	work->hash_tail_set = false;
 	work->mandatory = true;
 	work->pool = pools[0];
+	work->blk.nonce = 0;
+	work->work_block = work_block;
 	cgtime(&work->tv_getwork);
 	copy_time(&work->tv_getwork_reply, &work->tv_getwork);
+	copy_time(&work->tv_staged, &work->tv_getwork);
 	work->getwork_mode = GETWORK_MODE_BENCHMARK;
-	calc_diff(work, 0);
+	calc_diff(work, opt_benchmark_diff);
 }
 
 static bool get_upstream_work(struct work *work, CURL *curl)
@@ -2931,6 +3240,10 @@ static void __kill_work(void)
 	thr = &control_thr[api_thr_id];
 	thr_info_cancel(thr);
 
+	applog(LOG_DEBUG, "Killing off verify thread");
+	thr = &control_thr[verify_thr_id];
+	thr_info_cancel(thr);
+
 #ifdef USE_USBUTILS
 	/* Release USB resources in case it's a restart
 	 * and not a QUIT */
@@ -2963,6 +3276,8 @@ void app_restart(void)
 	applog(LOG_WARNING, "Attempting to restart %s", packagename);
 
 	__kill_work();
+	journal_close();
+	logging_stop();
 	clean_up();
 
 #if defined(unix)
@@ -3044,8 +3359,6 @@ static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
 	mutex_unlock(&pool->pool_lock);
 }
 
-static bool stale_work(struct work *work, bool share);
-
 static inline bool should_roll(struct work *work)
 {
 	struct timeval now;
@@ -3107,16 +3420,18 @@ void __copy_work(struct work *work, struct work *base_work)
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
+	work->slab_next = NULL;
+	work->strbuf_used = 0;
 	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
+		work->job_id = work_strdup(work, base_work->job_id);
 	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
+		work->nonce1 = work_strdup(work, base_work->nonce1);
 	if (base_work->nonce2)
-		work->nonce2 = strdup(base_work->nonce2);
+		work->nonce2 = work_strdup(work, base_work->nonce2);
 	if (base_work->ntime)
-		work->ntime = strdup(base_work->ntime);
+		work->ntime = work_strdup(work, base_work->ntime);
 	if (base_work->gbt_coinbase)
-		work->gbt_coinbase = strdup(base_work->gbt_coinbase);
+		work->gbt_coinbase = work_strdup(work, base_work->gbt_coinbase);
 }
 
 /* Generates a copy of an existing work struct, creating fresh heap allocations
@@ -3149,14 +3464,14 @@ static void stage_work(struct work *work);
 
 static bool clone_available(void)
 {
-	struct work *work_clone = NULL, *work, *tmp;
+	struct work *work_clone = NULL, *work;
 	bool cloned = false;
 
 	mutex_lock(stgd_lock);
 	if (!staged_rollable)
 		goto out_unlock;
 
-	HASH_ITER(hh, staged_work, work, tmp) {
+	list_for_each_entry(work, &staged_rollable_list, stage_list) {
 		if (can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
@@ -3188,7 +3503,15 @@ static void pool_died(struct pool *pool)
 	}
 }
 
-static bool stale_work(struct work *work, bool share)
+static inline bool stale_reason(struct pool *pool, enum stale_reason reason)
+{
+	__atomic_add_fetch(&pool->stale_reasons[reason], 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Called for every work item handed out and every share submitted so it
+ * takes no locks, stratum jobs being checked by their generation */
+bool stale_work(struct work *work, bool share)
 {
 	struct timeval now;
 	time_t work_expiry;
@@ -3198,9 +3521,16 @@ static bool stale_work(struct work *work, bool share)
 	if (opt_benchmark)
 		return false;
 
+	pool = work->pool;
+
 	if (work->work_block != work_block) {
 		applog(LOG_DEBUG, "Work stale due to block mismatch");
-		return true;
+		return stale_reason(pool, STALE_BLOCK);
+	}
+
+	if (work->stratum && work->clean_gen != __atomic_load_n(&pool->clean_gen, __ATOMIC_ACQUIRE)) {
+		applog(LOG_DEBUG, "Work stale due to stratum clean job");
+		return stale_reason(pool, STALE_BLOCK);
 	}
 
 	/* Technically the rolltime should be correct but some pools
@@ -3211,26 +3541,15 @@ static bool stale_work(struct work *work, bool share)
 	else
 		work_expiry = opt_expiry;
 
-	pool = work->pool;
-
 	if (!share && pool->has_stratum) {
-		bool same_job;
-
 		if (!pool->stratum_active || !pool->stratum_notify) {
 			applog(LOG_DEBUG, "Work stale due to stratum inactive");
-			return true;
+			return stale_reason(pool, STALE_SWITCH);
 		}
 
-		same_job = true;
-
-		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		cg_runlock(&pool->data_lock);
-
-		if (!same_job) {
-			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
-			return true;
+		if (work->job_gen != __atomic_load_n(&pool->job_gen, __ATOMIC_ACQUIRE)) {
+			applog(LOG_DEBUG, "Work stale due to stratum job mismatch");
+			return stale_reason(pool, STALE_JOB);
 		}
 	}
 
@@ -3244,13 +3563,13 @@ static bool stale_work(struct work *work, bool share)
 	cgtime(&now);
 	if ((now.tv_sec - work->tv_staged.tv_sec) >= work_expiry) {
 		applog(LOG_DEBUG, "Work stale due to expiry");
-		return true;
+		return stale_reason(pool, STALE_EXPIRY);
 	}
 
 	if (opt_fail_only && !share && pool != current_pool() && !work->mandatory &&
 	    pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 		applog(LOG_DEBUG, "Work stale due to fail only pool mismatch");
-		return true;
+		return stale_reason(pool, STALE_SWITCH);
 	}
 
 	return false;
@@ -3763,6 +4082,15 @@ void sha512_256_32(unsigned char *in, unsigned char *out)
 }
 // *** /DM/ ***
 
+/* Work that didn't come from a stratum job has its final hash block padded
+ * on first use */
+void set_hash_tail(struct work *work)
+{
+	memset(work->hash_tail, 0, sizeof(work->hash_tail));
+	memcpy(work->hash_tail, &work->data[HEADER_TAIL_OFFSET], HEADER_TAIL_LEN);
+	work->hash_tail_set = true;
+}
+
 static void regen_hash(struct work *work)
 {
 	uint32_t *data32 = (uint32_t *)(work->data);
@@ -3775,15 +4103,13 @@ static void regen_hash(struct work *work)
 	unsigned char hash2[32];	
 	unsigned char buf[180];
 
-	memcpy(buf, work->data, 180);
+	/* Only the first block differs per nonce, the final block comes
+	 * ready padded with the work */
+	if (unlikely(!work->hash_tail_set))
+		set_hash_tail(work);
+	memcpy(buf, work->data, HEADER_TAIL_OFFSET);
 	memcpy(buf, &work->res_nonce, sizeof(work->res_nonce));
-	blake3_hasher hasher;
-	blake3_hasher_init(&hasher);
-	blake3_hasher_update(&hasher, buf, 180);
-	// Finalize the hash. BLAKE3_OUT_LEN is the default output length, 32 bytes.
-	uint8_t output[BLAKE3_OUT_LEN];
-	blake3_hasher_finalize(&hasher, output, BLAKE3_OUT_LEN);
-	memcpy(work->hash, output, 32);
+	blake3_hash_chunk_split(buf, work->hash_tail, 180, work->hash);
 
 	/*
 	
@@ -3861,20 +4187,40 @@ static void rebuild_hash(struct work *work)
 	}
 }
 
-static bool cnx_needed(struct pool *pool);
+/* The most nonces the verify thread hashes in one pass */
+#define VERIFY_BATCH_MAX 16
 
-static void *submit_work_thread(void *userdata)
+/* Hash a batch of nonces at once, each block but the last of every header
+ * going through the SIMD lanes of the BLAKE3 hash_many kernels */
+static void regen_hash_many(struct work **works, int count)
 {
-	struct work *work = (struct work *)userdata;
-	struct pool *pool = work->pool;
-	bool resubmit = false;
-	struct curl_ent *ce;
+	unsigned char bufs[VERIFY_BATCH_MAX][HEADER_TAIL_OFFSET];
+	const uint8_t *inputs[VERIFY_BATCH_MAX], *tails[VERIFY_BATCH_MAX];
+	uint8_t out[VERIFY_BATCH_MAX * BLAKE3_OUT_LEN];
+	int i;
 
-	pthread_detach(pthread_self());
+	for (i = 0; i < count; i++) {
+		struct work *work = works[i];
+
+		if (unlikely(!work->hash_tail_set))
+			set_hash_tail(work);
+		memcpy(bufs[i], work->data, HEADER_TAIL_OFFSET);
+		memcpy(bufs[i], &work->res_nonce, sizeof(work->res_nonce));
+		inputs[i] = bufs[i];
+		tails[i] = work->hash_tail;
+	}
+	blake3_hash_many_chunk_split(inputs, tails, count, 180, out);
+	for (i = 0; i < count; i++)
+		memcpy(works[i]->hash, &out[i * BLAKE3_OUT_LEN], 32);
+}
 
-	RenameThread("submit_work");
+static bool cnx_needed(struct pool *pool);
 
-	applog(LOG_DEBUG, "Creating extra submit work thread");
+/* Returns false if the share was discarded as stale, freeing the work */
+static bool submit_stale_check(struct work *work)
+{
+	struct pool *pool = work->pool;
+	struct cgpu_info *cgpu;
 
 	if (stale_work(work, true)) {
 		if (opt_submit_stale)
@@ -3883,94 +4229,207 @@ static void *submit_work_thread(void *userdata)
 			applog(LOG_NOTICE, "Pool %d stale share detected, submitting as pool requested", pool->pool_no);
 		else {
 			applog(LOG_NOTICE, "Pool %d stale share detected, discarding", pool->pool_no);
+			journal_share(JOURNAL_DISCARD, work);
 			sharelog("discard", work);
 
+			cgpu = get_thr_cgpu(work->thr_id);
 			mutex_lock(&stats_lock);
 			total_stale++;
 			pool->stale_shares++;
+			cgpu->stale++;
 			total_diff_stale += work->work_difficulty;
 			pool->diff_stale += work->work_difficulty;
+			cgpu->diff_stale += work->work_difficulty;
 			mutex_unlock(&stats_lock);
 
-			goto out;
+			free_work(work);
+			return false;
 		}
 		work->stale = true;
 	}
 
-	if (work->stratum) {
+	return true;
+}
+
+/* There is no pool to submit to while benchmarking so shares are accepted
+ * here, accounting them like any other */
+static void submit_benchmark_share(struct work *work)
+{
+	struct cgpu_info *cgpu = get_thr_cgpu(work->thr_id);
+	struct pool *pool = work->pool;
+	struct timeval now;
+
+	cgtime(&now);
+	hist_add(&submit_hist, tdiff(&now, &work->tv_work_found));
+
+	mutex_lock(&stats_lock);
+	cgpu->accepted++;
+	total_accepted++;
+	pool->accepted++;
+	cgpu->diff_accepted += work->work_difficulty;
+	total_diff_accepted += work->work_difficulty;
+	pool->diff_accepted += work->work_difficulty;
+	mutex_unlock(&stats_lock);
+
+	applog(LOG_DEBUG, "Benchmark share accepted from %s %d",
+	       cgpu->drv->name, cgpu->device_id);
+	journal_share(JOURNAL_ACCEPT, work);
+	free_work(work);
+}
+
+/* Submit a batch of shares to one stratum pool as a single write of one
+ * mining.submit line per share */
+/* Append one mining.submit line to the batch, growing the buffer to fit */
+static void add_submit_line(char **s, size_t *size, size_t *len, struct work *work,
+			    const char *noncehex, int id)
+{
+	static const char *fmt = "%s{\"body\": {\"miningRequestId\": %s, \"randomness\":\"%s\"}, \"id\": %d, \"method\": \"mining.submit\"}";
+	const char *sep = *len ? "\n" : "";
+	int n;
+
+	n = snprintf(NULL, 0, fmt, sep, work->job_id, noncehex, id);
+	if (*len + n + 1 > *size) {
+		*size = *len + n + 1 + 1024;
+		*s = realloc(*s, *size);
+		if (unlikely(!*s))
+			quit(1, "Failed to realloc submit buffer in add_submit_line");
+	}
+	*len += snprintf(*s + *len, *size - *len, fmt, sep, work->job_id, noncehex, id);
+}
+
+/* Put shares that failed to send back for a submit thread to retry. The
+ * thread calling this looks at the retry list again before it next waits,
+ * so there is always one waiting for the earliest retry. */
+static void submit_retry(struct work **works, int count)
+{
+	struct timeval now;
+	int i;
+
+	cgtime(&now);
+	now.tv_sec += SUBMIT_RETRY_SECS;
+	mutex_lock(&submit_lock);
+	for (i = 0; i < count; i++) {
+		copy_time(&works[i]->tv_submit_retry, &now);
+		list_add_tail(&works[i]->submit_list, &submit_retry_list);
+		__atomic_add_fetch(&works[i]->pool->submit_queued, 1, __ATOMIC_RELAXED);
+	}
+	mutex_unlock(&submit_lock);
+}
+
+/* Returns false if the shares were handed to submit_retry() to try again
+ * later, otherwise they have been sent or discarded */
+static bool submit_stratum_shares(struct pool *pool, struct work **works, int count)
+{
+	struct stratum_share *sshares[SUBMIT_BATCH_MAX];
+	size_t len = 0, size = 0;
+	bool sessionid_match;
+	struct timeval now;
+	char *s = NULL;
+	time_t start;
+	int i;
+
+	start = time(NULL);
+	for (i = 0; i < count; i++) {
+		struct work *work = works[i];
 		struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
 		uint32_t *hash32 = (uint32_t *)work->hash;
 		uint64_t nonce;
-		bool submitted = false;
-		char *noncehex;
-		char s[1024];
+		char noncehex[17];
 
-		sshare->sshare_time = time(NULL);
+		if (unlikely(!sshare))
+			quit(1, "Failed to calloc sshare in submit_stratum_shares");
+		if (!work->submit_start)
+			work->submit_start = start;
+		sshare->sshare_time = start;
 		/* This work item is freed in parse_stratum_response */
 		sshare->work = work;
 		nonce = work->res_nonce;
-		noncehex = bin2hex((const unsigned char *)&nonce, 8);
-		memset(s, 0, 1024);
+		__bin2hex(noncehex, (const unsigned char *)&nonce, 8);
 
 		mutex_lock(&sshare_lock);
 		/* Give the stratum share a unique id */
 		sshare->id = swork_id++;
 		mutex_unlock(&sshare_lock);
 
-		sprintf(s, "{\"body\": {\"miningRequestId\": %s, \"randomness\":\"%s\"}, \"id\": %d, \"method\": \"mining.submit\"}",
-			work->job_id, noncehex, sshare->id);
-		free(noncehex);
+		add_submit_line(&s, &size, &len, work, noncehex, sshare->id);
+		sshares[i] = sshare;
 
 		applog(LOG_INFO, "Submitting share %08lx to pool %d",
 					(long unsigned int)htole32(hash32[6]), pool->pool_no);
+	}
 
-		/* Try resubmitting for up to 2 minutes if we fail to submit
-		 * once and the stratum pool nonce1 still matches suggesting
-		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
-			bool sessionid_match;
+	if (likely(stratum_send(pool, s, len))) {
+		free(s);
+		/* Account for the latency while the works are still
+		 * ours, a response may free them once they're added
+		 * to the stratum_shares db */
+		cgtime(&now);
+		mutex_lock(&stats_lock);
+		for (i = 0; i < count; i++) {
+			double latency = tdiff(&now, &works[i]->tv_work_found);
+
+			hist_add(&submit_hist, latency);
+			hist_add(&pool->verify_submit_hist, tdiff(&now, &works[i]->tv_verified));
+			copy_time(&sshares[i]->tv_sent, &now);
+			pool->submit_latency_total += latency;
+			if (latency > pool->submit_latency_max)
+				pool->submit_latency_max = latency;
+		}
+		pool->submit_latency_count += count;
+		mutex_unlock(&stats_lock);
 
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				if (pool_tclear(pool, &pool->submit_fail))
-						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+		if (pool_tclear(pool, &pool->submit_fail))
+				applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
+		mutex_lock(&sshare_lock);
+		for (i = 0; i < count; i++)
+			HASH_ADD_INT(stratum_shares, id, sshares[i]);
+		pool->sshares += count;
+		mutex_unlock(&sshare_lock);
 
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				submitted = true;
-				break;
-			}
-			if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
+		applog(LOG_DEBUG, "Successfully submitted %d, adding to stratum_shares db", count);
+		return true;
+	}
+	free(s);
+	for (i = 0; i < count; i++)
+		free(sshares[i]);
 
-			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
-			cg_runlock(&pool->data_lock);
+	if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+		applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+		total_ro++;
+		pool->remotefail_occasions++;
+	}
 
-			if (!sessionid_match) {
-				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
-				break;
-			}
-			/* Retry every 5 seconds */
-			sleep(5);
-		}
+	/* Keep retrying for up to 2 minutes from the first attempt as long
+	 * as the stratum pool nonce1 still matches suggesting we may be able
+	 * to resume. The batch shares a session so the first share tells. */
+	cg_rlock(&pool->data_lock);
+	sessionid_match = (pool->nonce1 && works[0]->nonce1 && !strcmp(works[0]->nonce1, pool->nonce1));
+	cg_runlock(&pool->data_lock);
 
-		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
-		}
-		goto out;
+	if (!sessionid_match)
+		applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+	else if (time(NULL) + SUBMIT_RETRY_SECS < works[0]->submit_start + 120) {
+		submit_retry(works, count);
+		return false;
 	}
 
+	applog(LOG_DEBUG, "Failed to submit %d stratum shares, discarding", count);
+	for (i = 0; i < count; i++)
+		free_work(works[i]);
+	mutex_lock(&stats_lock);
+	pool->stale_shares += count;
+	total_stale += count;
+	mutex_unlock(&stats_lock);
+	return true;
+}
+
+static void submit_getwork_share(struct work *work)
+{
+	struct pool *pool = work->pool;
+	bool resubmit = false;
+	struct curl_ent *ce;
+
 	ce = pop_curl_entry(pool);
 	/* submit solution to bitcoin via JSON-RPC */
 	while (!submit_upstream_work(work, ce->curl, resubmit)) {
@@ -3992,7 +4451,109 @@ static void *submit_work_thread(void *userdata)
 		applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
 	}
 	push_curl_entry(ce, pool);
-out:
+}
+
+/* Take up to max retries that are due. If none are, the time the next is
+ * due is set in abstime and returned to wait until, otherwise NULL. */
+static int submit_retry_due(struct work **works, int max, struct timespec *abstime,
+			    struct timespec **wait)
+{
+	struct work *work, *tmp;
+	struct timeval now;
+	int count = 0;
+
+	*wait = NULL;
+	cgtime(&now);
+	mutex_lock(&submit_lock);
+	list_for_each_entry_safe(work, tmp, &submit_retry_list, submit_list) {
+		if (count >= max)
+			break;
+		if (timercmp(&work->tv_submit_retry, &now, >)) {
+			if (!count) {
+				abstime->tv_sec = work->tv_submit_retry.tv_sec;
+				abstime->tv_nsec = work->tv_submit_retry.tv_usec * 1000;
+				*wait = abstime;
+			}
+			break;
+		}
+		list_del(&work->submit_list);
+		works[count++] = work;
+	}
+	mutex_unlock(&submit_lock);
+
+	return count;
+}
+
+/* Give back the queue slots of shares that have been dealt with */
+static void submit_done(int count)
+{
+	if (!count)
+		return;
+	mutex_lock(&submit_lock);
+	submit_outstanding -= count;
+	pthread_cond_broadcast(&submit_cond);
+	mutex_unlock(&submit_lock);
+}
+
+/* A fixed number of submit threads share the submit_q. Each takes whatever
+ * shares are waiting, up to SUBMIT_BATCH_MAX, and sends those for the same
+ * stratum pool together in one write. Shares that fail to send wait on the
+ * retry list rather than holding up a submit thread. */
+static void *submit_work_thread(void *userdata)
+{
+	struct work *works[SUBMIT_BATCH_MAX], *batch[SUBMIT_BATCH_MAX];
+	struct timespec abstime, *wait;
+	char threadname[16];
+	int count, done, i, j, n;
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "submit/%d", (int)(intptr_t)userdata);
+	RenameThread(threadname);
+
+	while (42) {
+		count = submit_retry_due(works, SUBMIT_BATCH_MAX, &abstime, &wait);
+		if (!count)
+			count = tq_pop_many(submit_q, (void **)works, SUBMIT_BATCH_MAX, wait);
+		if (!count)
+			continue;
+		done = count;
+
+		for (i = 0; i < count; i++) {
+			__atomic_sub_fetch(&works[i]->pool->submit_queued, 1, __ATOMIC_RELAXED);
+			if (!submit_stale_check(works[i]))
+				works[i] = NULL;
+		}
+
+		for (i = 0; i < count; i++) {
+			struct pool *pool;
+
+			if (!works[i])
+				continue;
+			if (opt_benchmark) {
+				submit_benchmark_share(works[i]);
+				works[i] = NULL;
+				continue;
+			}
+			if (!works[i]->stratum) {
+				submit_getwork_share(works[i]);
+				works[i] = NULL;
+				continue;
+			}
+
+			pool = works[i]->pool;
+			for (j = i, n = 0; j < count; j++) {
+				if (works[j] && works[j]->stratum && works[j]->pool == pool) {
+					batch[n++] = works[j];
+					works[j] = NULL;
+				}
+			}
+			if (!submit_stratum_shares(pool, batch, n))
+				done -= n;
+		}
+		submit_done(done);
+	}
+
 	return NULL;
 }
 
@@ -4129,23 +4690,92 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
-static void discard_stale(void)
+static bool work_rollable(struct work *work)
 {
-	struct work *work, *tmp;
-	int stale = 0;
-
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-		}
-	}
-	pthread_cond_signal(&gws_cond);
-	mutex_unlock(stgd_lock);
+	return (!work->clone && work->rolltime);
+}
 
-	if (stale)
+/* Must be called with stgd_lock held */
+static void __hash_add_staged(struct work *work)
+{
+	if (work_rollable(work)) {
+		staged_rollable++;
+		list_add_tail(&work->stage_list, &staged_rollable_list);
+	} else
+		list_add_tail(&work->stage_list, &staged_overflow);
+}
+
+/* Must be called with stgd_lock held */
+static void __hash_del_staged(struct work *work)
+{
+	list_del(&work->stage_list);
+	if (work_rollable(work))
+		staged_rollable--;
+}
+
+/* Pass all staged work to the claim function, removing whatever it claims
+ * and keeping the rest in the order it was staged. Must be called with
+ * stgd_lock held so that only one sift runs at a time. Mining threads may
+ * still pop work from the queue while it is being sifted. */
+static int __sift_staged(bool (*claim)(struct work *, void *), void *arg)
+{
+	struct work *work, *tmp;
+	LIST_HEAD(keep);
+	int claimed = 0;
+
+	/* The claim function may free the work so it's unlinked first */
+	list_for_each_entry_safe(work, tmp, &staged_overflow, stage_list) {
+		list_del(&work->stage_list);
+		if (claim(work, arg))
+			claimed++;
+		else
+			list_add_tail(&work->stage_list, &keep);
+	}
+	list_splice_init(&keep, &staged_overflow);
+	list_for_each_entry_safe(work, tmp, &staged_rollable_list, stage_list) {
+		list_del(&work->stage_list);
+		if (claim(work, arg)) {
+			staged_rollable--;
+			claimed++;
+		} else
+			list_add_tail(&work->stage_list, &keep);
+	}
+	list_splice_init(&keep, &staged_rollable_list);
+
+	while ((work = lfq_pop(staged_lfq))) {
+		if (claim(work, arg))
+			claimed++;
+		else
+			list_add_tail(&work->stage_list, &keep);
+	}
+	list_for_each_entry_safe(work, tmp, &keep, stage_list) {
+		list_del(&work->stage_list);
+		if (unlikely(!lfq_push(staged_lfq, work)))
+			__hash_add_staged(work);
+	}
+
+	__atomic_sub_fetch(&staged_count, claimed, __ATOMIC_SEQ_CST);
+	return claimed;
+}
+
+static bool claim_stale(struct work *work, void __maybe_unused *arg)
+{
+	if (!stale_work(work, false))
+		return false;
+	discard_work(work);
+	return true;
+}
+
+static void discard_stale(void)
+{
+	int stale;
+
+	mutex_lock(stgd_lock);
+	stale = __sift_staged(claim_stale, NULL);
+	pthread_cond_signal(&gws_cond);
+	mutex_unlock(stgd_lock);
+
+	if (stale)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 }
 
@@ -4187,8 +4817,14 @@ static void restart_threads(void)
 	discard_stale();
 
 	rd_lock(&mining_thr_lock);
-	for (i = 0; i < mining_threads; i++)
-		mining_thr[i]->work_restart = true;
+	for (i = 0; i < mining_threads; i++) {
+		struct thr_info *thr = mining_thr[i];
+
+		thr->work_restart = true;
+		/* A stratum job can arrive before the threads are set up */
+		if (likely(thr->cgpu))
+			thr->cgpu->drv->thread_restart(thr);
+	}
 	rd_unlock(&mining_thr_lock);
 
 	mutex_lock(&restart_lock);
@@ -4234,12 +4870,10 @@ static bool block_exists(char *hexstr)
 /* Tests if this work is from a block that has been seen before */
 static inline bool from_existing_block(struct work *work)
 {
-	char *hexstr = bin2hex(work->data + 8, 18);
-	bool ret;
+	char hexstr[37];
 
-	ret = block_exists(hexstr);
-	free(hexstr);
-	return ret;
+	__bin2hex(hexstr, work->data + 8, 18);
+	return block_exists(hexstr);
 }
 
 static int block_sort(struct block *blocka, struct block *blockb)
@@ -4294,18 +4928,41 @@ static void set_blockdiff(const struct work *work)
 		applog(LOG_NOTICE, "Network diff set to %s", block_diff);
 }
 
+static void gen_stratum_work(struct pool *pool, struct work *work);
+
+/* Give every mining thread its own work from the pool's newest stratum job,
+ * each with a distinct nonce2, so it can be picked up as soon as the threads
+ * are restarted instead of going through the staging queue */
+static void push_stratum_work(struct pool *pool)
+{
+	struct work *work, *old;
+	int i;
+
+	rd_lock(&mining_thr_lock);
+	for (i = 0; i < mining_threads; i++) {
+		struct thr_info *thr = mining_thr[i];
+
+		work = make_work();
+		gen_stratum_work(pool, work);
+		old = __atomic_exchange_n(&thr->next_work, work, __ATOMIC_ACQ_REL);
+		if (old)
+			free_work(old);
+	}
+	rd_unlock(&mining_thr_lock);
+}
+
 static bool test_work_current(struct work *work)
 {
 	bool ret = true;
-	char *hexstr;
+	char hexstr[37];
 
 	if (work->mandatory)
 		return ret;
 
 	/* Hack to work around dud work sneaking into test */
-	hexstr = bin2hex(work->data + 8, 18);
+	__bin2hex(hexstr, work->data + 8, 18);
 	if (!strncmp(hexstr, "000000000000000000000000000000000000", 36))
-		goto out_free;
+		goto out;
 
 	/* Search to see if this block exists yet and if not, consider it a
 	 * new block and set the current block details to this one */
@@ -4340,10 +4997,13 @@ static bool test_work_current(struct work *work)
 			applog(LOG_DEBUG, "Deleted block %d from database", deleted_block);
 		set_curblock(hexstr, work->data);
 		if (unlikely(new_blocks == 1))
-			goto out_free;
+			goto out;
 
 		work->work_block = ++work_block;
 
+		if (work->stratum && work->pool == current_pool())
+			push_stratum_work(work->pool);
+
 		if (!work->stratum) {
 			if (work->longpoll) {
 				applog(LOG_NOTICE, "%sLONGPOLL from pool %d detected new block",
@@ -4363,37 +5023,34 @@ static bool test_work_current(struct work *work)
 		}
 	}
 	work->longpoll = false;
-out_free:
-	free(hexstr);
+out:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
-static bool work_rollable(struct work *work)
-{
-	return (!work->clone && work->rolltime);
-}
-
 static bool hash_push(struct work *work)
 {
-	bool rc = true;
+	if (unlikely(getq->frozen))
+		return false;
 
-	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
-	} else
-		rc = false;
-	pthread_cond_broadcast(&getq->cond);
-	mutex_unlock(stgd_lock);
+	__atomic_add_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
+	if (work_rollable(work) || unlikely(!lfq_push(staged_lfq, work))) {
+		mutex_lock(stgd_lock);
+		__hash_add_staged(work);
+		pthread_cond_signal(&getq->cond);
+		mutex_unlock(stgd_lock);
+		return true;
+	}
 
-	return rc;
+	/* Pairs with the fence in hash_pop so either we see its waiter or it
+	 * sees our work */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stgd_waiters, __ATOMIC_RELAXED)) {
+		mutex_lock(stgd_lock);
+		pthread_cond_signal(&getq->cond);
+		mutex_unlock(stgd_lock);
+	}
+
+	return true;
 }
 
 static void *stage_thread(void *userdata)
@@ -4756,23 +5413,79 @@ void zero_bestshare(void)
 	}
 }
 
+/* Drain every mining thread's shard into the device and global totals, or
+ * throw the counts away when discard is set. Must hold stats_lock. */
+static void __stats_fold(bool discard)
+{
+	int i;
+
+	rd_lock(&mining_thr_lock);
+	for (i = 0; i < mining_threads; i++) {
+		struct thr_info *thr = mining_thr[i];
+		struct stats_shard *shard;
+		uint64_t diff1, hw;
+
+		if (unlikely(!thr || !thr->cgpu))
+			continue;
+		shard = &thr->shard;
+		/* Only write to the shard's line when there is something to
+		 * move so an idle fold doesn't steal it from the miner */
+		diff1 = __atomic_load_n(&shard->diff1, __ATOMIC_RELAXED);
+		if (diff1)
+			diff1 = __atomic_exchange_n(&shard->diff1, 0, __ATOMIC_RELAXED);
+		hw = __atomic_load_n(&shard->hw_errors, __ATOMIC_RELAXED);
+		if (hw)
+			hw = __atomic_exchange_n(&shard->hw_errors, 0, __ATOMIC_RELAXED);
+		if (discard)
+			continue;
+
+		thr->cgpu->diff1 += diff1;
+		total_diff1 += diff1;
+		thr->cgpu->hw_errors += hw;
+		hw_errors += hw;
+	}
+	rd_unlock(&mining_thr_lock);
+}
+
+void stats_fold(void)
+{
+	mutex_lock(&stats_lock);
+	__stats_fold(false);
+	mutex_unlock(&stats_lock);
+}
+
 void zero_stats(void)
 {
 	int i;
 
+	/* Counts found before the reset are discarded with the totals they
+	 * would have been folded into, anything found after it lands in the
+	 * shards and shows up at the next fold */
+	mutex_lock(&stats_lock);
+	__stats_fold(true);
+	total_diff1 = 0;
+	hw_errors = 0;
+	for (i = 0; i < total_pools; i++)
+		__atomic_store_n(&pools[i]->diff1, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < total_devices; ++i) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		cgpu->diff1 = 0;
+		cgpu->hw_errors = 0;
+	}
+	mutex_unlock(&stats_lock);
+
 	cgtime(&total_tv_start);
 	total_mhashes_done = 0;
 	total_getworks = 0;
 	total_accepted = 0;
 	total_rejected = 0;
-	hw_errors = 0;
 	total_stale = 0;
 	total_discarded = 0;
 	local_work = 0;
 	total_go = 0;
 	total_ro = 0;
 	total_secs = 1.0;
-	total_diff1 = 0;
 	found_blocks = 0;
 	total_diff_accepted = 0;
 	total_diff_rejected = 0;
@@ -4785,11 +5498,11 @@ void zero_stats(void)
 		pool->accepted = 0;
 		pool->rejected = 0;
 		pool->stale_shares = 0;
+		memset(pool->stale_reasons, 0, sizeof(pool->stale_reasons));
 		pool->discarded_work = 0;
 		pool->getfail_occasions = 0;
 		pool->remotefail_occasions = 0;
 		pool->last_share_time = 0;
-		pool->diff1 = 0;
 		pool->diff_accepted = 0;
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
@@ -4805,10 +5518,8 @@ void zero_stats(void)
 		cgpu->total_mhashes = 0;
 		cgpu->accepted = 0;
 		cgpu->rejected = 0;
-		cgpu->hw_errors = 0;
 		cgpu->utility = 0.0;
 		cgpu->last_share_pool_time = 0;
-		cgpu->diff1 = 0;
 		cgpu->diff_accepted = 0;
 		cgpu->diff_rejected = 0;
 		cgpu->last_share_diff = 0;
@@ -5437,6 +6148,12 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 			applog(LOG_NOTICE, "Rejected untracked stratum share from pool %d", pool->pool_no);
 		goto out;
 	}
+	if (sshare->tv_sent.tv_sec) {
+		struct timeval now;
+
+		cgtime(&now);
+		hist_add(&pool->submit_result_hist, tdiff(&now, &sshare->tv_sent));
+	}
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
 	free(sshare);
@@ -5477,19 +6194,18 @@ void clear_stratum_shares(struct pool *pool)
 	}
 }
 
-static void clear_pool_work(struct pool *pool)
+static bool claim_pool_work(struct work *work, void *arg)
 {
-	struct work *work, *tmp;
-	int cleared = 0;
+	if (work->pool != (struct pool *)arg)
+		return false;
+	free_work(work);
+	return true;
+}
 
+static void clear_pool_work(struct pool *pool)
+{
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-		}
-	}
+	__sift_staged(claim_pool_work, pool);
 	mutex_unlock(stgd_lock);
 }
 
@@ -5543,7 +6259,6 @@ static bool cnx_needed(struct pool *pool)
 
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
-static void gen_stratum_work(struct pool *pool, struct work *work);
 
 static void stratum_resumed(struct pool *pool)
 {
@@ -5589,6 +6304,20 @@ static void *stratum_thread(void *userdata)
 		if (unlikely(pool->removed))
 			break;
 
+		/* A client.reconnect from the last line parsed */
+		if (unlikely(pool->stratum_reconnect)) {
+			pool->stratum_reconnect = false;
+			if (!restart_stratum(pool)) {
+				pool_died(pool);
+				while (!restart_stratum(pool)) {
+					if (pool->removed)
+						goto out;
+					nmsleep(30000);
+				}
+				stratum_resumed(pool);
+			}
+		}
+
 		/* Check to see whether we need to maintain this connection
 		 * indefinitely or just bring it up when we switch to this
 		 * pool */
@@ -5655,7 +6384,6 @@ static void *stratum_thread(void *userdata)
 
 		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
 			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
 		if (pool->swork.clean) {
 			struct work *work = make_work();
 
@@ -5667,6 +6395,7 @@ static void *stratum_thread(void *userdata)
 				/* Only accept a work restart if this stratum
 				 * connection is from the current pool */
 				if (pool == current_pool()) {
+					push_stratum_work(pool);
 					restart_threads();
 					applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
 				}
@@ -5892,34 +6621,60 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
 }
 
+/* Must be called with stgd_lock held */
+static struct work *__hash_pop_staged(void)
+{
+	struct work *work;
+
+	/* Take work that can't be rolled first, to allow masters to be
+	 * reused */
+	if (!list_empty(&staged_overflow))
+		work = list_entry(staged_overflow.next, struct work, stage_list);
+	else if (!list_empty(&staged_rollable_list))
+		work = list_entry(staged_rollable_list.next, struct work, stage_list);
+	else
+		return NULL;
+	__hash_del_staged(work);
+
+	return work;
+}
+
+/* Returns NULL only if the getq is frozen with nothing staged */
 static struct work *hash_pop(void)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work;
+
+	/* Work that can't be rolled is preferred anyway and is taken from
+	 * the lock free queue without waiting on stgd_lock */
+	work = lfq_pop(staged_lfq);
+	if (likely(work))
+		goto out;
 
 	mutex_lock(stgd_lock);
-	while (!getq->frozen && !HASH_COUNT(staged_work))
+	__atomic_add_fetch(&stgd_waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (42) {
+		work = lfq_pop(staged_lfq);
+		if (!work)
+			work = __hash_pop_staged();
+		if (work || getq->frozen)
+			break;
 		pthread_cond_wait(&getq->cond, stgd_lock);
+	}
+	__atomic_sub_fetch(&stgd_waiters, 1, __ATOMIC_RELAXED);
+	mutex_unlock(stgd_lock);
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	if (unlikely(!work))
+		return NULL;
+out:
+	__atomic_sub_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
 
 	/* Signal the getwork scheduler to look for more work */
-	pthread_cond_signal(&gws_cond);
-
-	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
-	pthread_cond_signal(&getq->cond);
-	mutex_unlock(stgd_lock);
+	if (__atomic_load_n(&gws_waiting, __ATOMIC_SEQ_CST)) {
+		mutex_lock(stgd_lock);
+		pthread_cond_signal(&gws_cond);
+		mutex_unlock(stgd_lock);
+	}
 
 	return work;
 }
@@ -6014,25 +6769,30 @@ void set_target(unsigned char *dest_target, double diff)
  * other means to detect when the pool has died in stratum_thread */
 static void gen_stratum_work(struct pool *pool, struct work *work)
 {
-	uint32_t *data32, *swap32;
-	int i;
-
-	/* Use intermediate lock to update the one pool variable */
-	cg_ilock(&pool->data_lock);
-
-	*(uint32_t *)work->data = htole32(pool->nonce2);
-	
-	pool->nonce2++;
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dlock(&pool->data_lock);
+	struct stratum_template *tmpl = &pool->tmpl;
+	unsigned long seq;
+	char job_id[24];
+	uint32_t nonce2;
 
+	/* Copy the job out of the pool's binary template, retrying if a
+	 * notify rewrote it meanwhile */
+	do {
+		seq = seq_read_begin(&tmpl->seq);
+		memcpy(work->data, tmpl->data, sizeof(work->data));
+		memcpy(work->hash_tail, tmpl->tail, sizeof(work->hash_tail));
+		memcpy(work->target, tmpl->target, sizeof(work->target));
+		memcpy(job_id, tmpl->job_id, sizeof(job_id));
+		work->job_gen = tmpl->job_gen;
+		work->clean_gen = tmpl->clean_gen;
+		copy_time(&work->tv_notify, &tmpl->tv_notify);
+	} while (seq_read_retry(&tmpl->seq, seq));
+	job_id[sizeof(job_id) - 1] = '\0';
+
+	nonce2 = __atomic_fetch_add(&pool->nonce2, 1, __ATOMIC_RELAXED);
+	*(uint32_t *)work->data = htole32(nonce2);
+	work->hash_tail_set = true;
 	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	memcpy(work->target, pool->gbt_target, 32);
-	/* Convert hex data to binary data for work */
-	if (unlikely(!hex2bin(&work->data[8], &pool->swork.header[16], 172)))
-		quit(1, "Failed to convert header to data in gen_stratum_work");
-	cg_runlock(&pool->data_lock);
+	work->job_id = work_strdup(work, job_id);
 
 	applog(LOG_DEBUG, "Work job_id %s", work->job_id);
 
@@ -6058,9 +6818,20 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 	 * should not be restarted */
 	thread_reportout(thr);
 
+	/* Work pushed straight from a new stratum job comes first */
+	work = __atomic_exchange_n(&thr->next_work, NULL, __ATOMIC_ACQ_REL);
+	if (work && stale_work(work, false)) {
+		discard_work(work);
+		work = NULL;
+	}
+
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
 	while (!work) {
 		work = hash_pop();
+		if (unlikely(!work)) {
+			nmsleep(100);
+			continue;
+		}
 		if (stale_work(work, false)) {
 			discard_work(work);
 			work = NULL;
@@ -6075,87 +6846,200 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 	return work;
 }
 
+/* Account the time from the work being made to it being written to this
+ * device, and for the first work of each stratum job the time from the pool
+ * notifying it */
+void record_work_written(struct cgpu_info *cgpu, struct work *work)
+{
+	struct timeval now;
+	double latency;
+
+	cgtime(&now);
+	hist_add(&cgpu->work_write_hist, tdiff(&now, &work->tv_staged));
+
+	if (!work->stratum || !timercmp(&work->tv_notify, &cgpu->last_notify, !=))
+		return;
+
+	hist_add(&cgpu->notify_work_hist, tdiff(&work->tv_staged, &work->tv_notify));
+	latency = tdiff(&now, &work->tv_notify);
+	copy_time(&cgpu->last_notify, &work->tv_notify);
+
+	mutex_lock(&stats_lock);
+	cgpu->notify_latency_total += latency;
+	if (latency > cgpu->notify_latency_max)
+		cgpu->notify_latency_max = latency;
+	cgpu->notify_latency_count++;
+	mutex_unlock(&stats_lock);
+}
+
+/* Takes ownership of the work, waiting for room if the submit threads
+ * are SUBMIT_QUEUE_MAX shares behind */
+static void queue_submit_work(struct work *work)
+{
+	applog(LOG_DEBUG, "Pushing submit work to submit queue");
+	mutex_lock(&submit_lock);
+	while (submit_outstanding >= SUBMIT_QUEUE_MAX)
+		pthread_cond_wait(&submit_cond, &submit_lock);
+	submit_outstanding++;
+	mutex_unlock(&submit_lock);
+	__atomic_add_fetch(&work->pool->submit_queued, 1, __ATOMIC_RELAXED);
+	if (unlikely(!tq_push(submit_q, work)))
+		quit(1, "Failed to tq_push work in queue_submit_work");
+}
+
 void submit_work_async(struct work *work_in, struct timeval *tv_work_found)
 {
 	struct work *work = copy_work(work_in);
-	pthread_t submit_thread;
 
 	if (tv_work_found)
 		copy_time(&work->tv_work_found, tv_work_found);
-	applog(LOG_DEBUG, "Pushing submit work to work thread");
-	if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-		quit(1, "Failed to create submit_work_thread");
+	queue_submit_work(work);
 }
 
 void inc_hw_errors(struct thr_info *thr)
 {
-	mutex_lock(&stats_lock);
-	hw_errors++;
-	thr->cgpu->hw_errors++;
-	mutex_unlock(&stats_lock);
+	__atomic_add_fetch(&thr->shard.hw_errors, 1, __ATOMIC_RELAXED);
 
 	thr->cgpu->drv->hw_error(thr);
 }
 
-void submit_nonce(struct thr_info *thr, struct work *work, uint64_t nonce)
+/* Check a nonce result once its hash has been regenerated and submit it if
+ * it meets the target. Takes ownership of the work. */
+static void check_nonce_work(struct work *work)
 {
-	struct timeval tv_work_found;
-	unsigned char hash2[32];
-	uint32_t *hash2_32 = (uint32_t *)hash2;
-	uint32_t diff1targ;
+	struct thr_info *thr = work->thr;
 
-	cgtime(&tv_work_found);
-	work->res_nonce = nonce;
-
-	mutex_lock(&stats_lock);
-	total_diff1 += work->device_diff;
-	thr->cgpu->diff1 += work->device_diff;
-	work->pool->diff1 += work->device_diff;
-	mutex_unlock(&stats_lock);
-
-	/* Do one last check before attempting to submit the work */
-	rebuild_hash(work);
-	flip32(hash2_32, work->hash);
-
-	diff1targ = opt_scrypt ? 0x0000ffffUL : 0;	
+	cgtime(&work->tv_verified);
+	hist_add(&thr->cgpu->nonce_verify_hist, tdiff(&work->tv_verified, &work->tv_work_found));
 
 	if (*(uint32_t *)work->hash != 0) {
-//	if (be32toh(hash2_32[7]) > diff1targ) {
 		applog(LOG_INFO, "%s%d: invalid nonce - HW error: hash begin = 0x%0X",
 				thr->cgpu->drv->name, thr->cgpu->device_id, *(uint32_t*)work->hash);
 
 		inc_hw_errors(thr);
+		free_work(work);
 		return;
-	}	
-
-// *** /DM/ ***
-
-	mutex_lock(&stats_lock);
-	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
+	}
 
+	__atomic_store_n(&thr->cgpu->last_device_valid_work, time(NULL), __ATOMIC_RELAXED);
 
 	for (int i = 0; i < 32; i ++)
 	{
 		if (work->hash[i] > work->target[i])
 		{
 			applog(LOG_ERR, "Share below target");
-
+			free_work(work);
 			return;
 		}
 		if (work->hash[i] == 0)
-			continue;	
+			continue;
 
 		break;
 	}
-	/*
 
-	if (!fulltest(work->hash, work->target)) {
-		applog(LOG_INFO, "Share below target");
-		return;
+	queue_submit_work(work);
+}
+
+/* Make sure the block-wise and batched hashing used for verification agree
+ * with the plain BLAKE3 hasher before trusting any result from them */
+static bool verify_selftest(void)
+{
+	struct work *works[VERIFY_BATCH_MAX];
+	unsigned char expect[VERIFY_BATCH_MAX][32];
+	bool ret = true;
+	int count, i, j;
+
+	for (i = 0; i < VERIFY_BATCH_MAX; i++) {
+		blake3_hasher hasher;
+		unsigned char buf[180];
+
+		works[i] = make_work();
+		for (j = 0; j < 180; j++)
+			works[i]->data[j] = (unsigned char)(j * 7 + i);
+		works[i]->res_nonce = 0x0123456789abcdefULL * (i + 1);
+
+		memcpy(buf, works[i]->data, 180);
+		memcpy(buf, &works[i]->res_nonce, sizeof(works[i]->res_nonce));
+		blake3_hasher_init(&hasher);
+		blake3_hasher_update(&hasher, buf, 180);
+		blake3_hasher_finalize(&hasher, expect[i], 32);
 	}
-*/
-	submit_work_async(work, &tv_work_found);
+
+	for (count = 1; ret && count <= VERIFY_BATCH_MAX; count++) {
+		if (count > 1)
+			regen_hash_many(works, count);
+		else
+			regen_hash(works[0]);
+		for (i = 0; i < count; i++) {
+			if (unlikely(memcmp(works[i]->hash, expect[i], 32))) {
+				applog(LOG_ERR, "BLAKE3 verification self test failed on %d of %d", i, count);
+				ret = false;
+				break;
+			}
+			memset(works[i]->hash, 0, 32);
+		}
+	}
+
+	for (i = 0; i < VERIFY_BATCH_MAX; i++)
+		free_work(works[i]);
+
+	return ret;
+}
+
+/* Nonces from every device are queued to the verify thread which
+ * regenerates their hashes in batches as wide as the SIMD BLAKE3 kernels
+ * allow, falling back to one at a time on scalar only builds. */
+static void *verify_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	struct work *works[VERIFY_BATCH_MAX];
+	int batch, count, i;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	RenameThread("verify");
+
+	batch = blake3_hash_many_degree();
+	if (batch > VERIFY_BATCH_MAX)
+		batch = VERIFY_BATCH_MAX;
+	if (opt_scrypt || batch < 1)
+		batch = 1;
+	applog(LOG_DEBUG, "Verifying nonces in batches of up to %d", batch);
+
+	while (42) {
+		count = tq_pop_many(mythr->q, (void **)works, batch, NULL);
+		if (unlikely(!count))
+			continue;
+
+		if (count > 1)
+			regen_hash_many(works, count);
+		else
+			rebuild_hash(works[0]);
+
+		for (i = 0; i < count; i++)
+			check_nonce_work(works[i]);
+	}
+
+	return NULL;
+}
+
+void submit_nonce(struct thr_info *thr, struct work *work, uint64_t nonce)
+{
+	struct work *verify_work;
+
+	work->res_nonce = nonce;
+
+	/* The thread's own shard is folded into the device and global
+	 * totals later, only the per pool count is shared */
+	__atomic_add_fetch(&thr->shard.diff1, (uint64_t)work->device_diff, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&work->pool->diff1, (int)work->device_diff, __ATOMIC_RELAXED);
+
+	/* Hand a copy to the verify thread to do one last check before
+	 * attempting to submit the work */
+	verify_work = copy_work(work);
+	verify_work->thr = thr;
+	cgtime(&verify_work->tv_work_found);
+	tq_push(control_thr[verify_thr_id].q, verify_work);
 }
 
 static inline bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
@@ -6193,6 +7077,27 @@ static void mt_disable(struct thr_info *mythr, const int thr_id,
 	drv->thread_enable(mythr);
 }
 
+/* Account time a device spent waiting on work to it and the work's pool */
+static void record_getwork_wait(struct cgminer_stats *dev_stats, struct pool *pool, struct timeval *wait)
+{
+	struct cgminer_stats *pool_stats = &(pool->cgminer_stats);
+
+	addtime(wait, &dev_stats->getwork_wait);
+	hist_add(&dev_stats->getwork_hist, wait->tv_sec + wait->tv_usec / 1000000.0);
+	if (time_more(wait, &dev_stats->getwork_wait_max))
+		copy_time(&dev_stats->getwork_wait_max, wait);
+	if (time_less(wait, &dev_stats->getwork_wait_min))
+		copy_time(&dev_stats->getwork_wait_min, wait);
+	dev_stats->getwork_calls++;
+
+	addtime(wait, &pool_stats->getwork_wait);
+	if (time_more(wait, &pool_stats->getwork_wait_max))
+		copy_time(&pool_stats->getwork_wait_max, wait);
+	if (time_less(wait, &pool_stats->getwork_wait_min))
+		copy_time(&pool_stats->getwork_wait_min, wait);
+	pool_stats->getwork_calls++;
+}
+
 /* The main hashing loop for devices that are slow enough to work on one work
  * item at a time, without a queue, aborting work before the entire nonce
  * range has been hashed if needed. */
@@ -6204,7 +7109,6 @@ static void hash_sole_work(struct thr_info *mythr)
 	struct timeval getwork_start, tv_start, *tv_end, tv_workstart, tv_lastupdate;
 	
 	struct cgminer_stats *dev_stats = &(cgpu->cgminer_stats);
-	struct cgminer_stats *pool_stats;
 	/* Try to cycle approximately 5 times before each log update */
 	const long cycle = opt_log_interval / 5 ? : 1;
 	const bool primary = (!mythr->device_thread) || mythr->primary_thread;
@@ -6260,22 +7164,7 @@ static void hash_sole_work(struct thr_info *mythr)
 			cgtime(&tv_start);
 
 			subtime(&tv_start, &getwork_start);
-
-			addtime(&getwork_start, &dev_stats->getwork_wait);
-			if (time_more(&getwork_start, &dev_stats->getwork_wait_max))
-				copy_time(&dev_stats->getwork_wait_max, &getwork_start);
-			if (time_less(&getwork_start, &dev_stats->getwork_wait_min))
-				copy_time(&dev_stats->getwork_wait_min, &getwork_start);
-			dev_stats->getwork_calls++;
-
-			pool_stats = &(work->pool->cgminer_stats);
-
-			addtime(&getwork_start, &pool_stats->getwork_wait);
-			if (time_more(&getwork_start, &pool_stats->getwork_wait_max))
-				copy_time(&pool_stats->getwork_wait_max, &getwork_start);
-			if (time_less(&getwork_start, &pool_stats->getwork_wait_min))
-				copy_time(&pool_stats->getwork_wait_min, &getwork_start);
-			pool_stats->getwork_calls++;
+			record_getwork_wait(dev_stats, work->pool, &getwork_start);
 
 			cgtime(&(work->tv_work_start));
 
@@ -6301,6 +7190,7 @@ static void hash_sole_work(struct thr_info *mythr)
 			if (hashes > cgpu->max_hashes)
 				cgpu->max_hashes = hashes;
 
+			timersub(tv_end, &tv_start, &diff);
 			sdiff.tv_sec += diff.tv_sec;
 			sdiff.tv_usec += diff.tv_usec;
 			if (sdiff.tv_usec > 1000000) {
@@ -6310,19 +7200,20 @@ static void hash_sole_work(struct thr_info *mythr)
 
 			timersub(tv_end, &tv_workstart, &wdiff);
 
-		if (unlikely((long)sdiff.tv_sec < cycle)) {
-				int mult;
-
-				if (likely(max_nonce == 0xffffffff))
-				{
-					continue;
+			/* A short scan over the full range can't be scaled up,
+			 * but the hashmeter and pause checks below still have
+			 * to run for it */
+			if (unlikely((long)sdiff.tv_sec < cycle)) {
+				if (unlikely(max_nonce != 0xffffffff)) {
+					int mult;
+
+					mult = 1000000 / ((sdiff.tv_usec + 0x400) / 0x400) + 0x10;
+					mult *= cycle;
+					if (max_nonce > (0xffffffffULL * 0x400) / mult)
+						max_nonce = 0xffffffff;
+					else
+						max_nonce = ((uint64_t)max_nonce * mult) / 0x400;
 				}
-				mult = 1000000 / ((sdiff.tv_usec + 0x400) / 0x400) + 0x10;
-				mult *= cycle;
-				if (max_nonce > (0xffffffff * 0x400) / mult)
-					max_nonce = 0xffffffff;
-				else
-					max_nonce = (max_nonce * mult) / 0x400;
 			} else if (unlikely(sdiff.tv_sec > cycle))
 				max_nonce = max_nonce * cycle / sdiff.tv_sec;
 			else if (unlikely(sdiff.tv_usec > 100000))
@@ -6380,11 +7271,21 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct de
 		rd_unlock(&cgpu->qlock);
 
 		if (need_work) {
-			struct work *work = get_work(mythr, thr_id);
+			struct timeval tv_getwork, tv_gotwork;
+			struct work *work;
+
+			cgtime(&tv_getwork);
+			work = get_work(mythr, thr_id);
+			cgtime(&tv_gotwork);
+			timersub(&tv_gotwork, &tv_getwork, &tv_gotwork);
+			record_getwork_wait(&(cgpu->cgminer_stats), work->pool, &tv_gotwork);
 
 			work->device_diff = MIN(drv->max_diff, work->work_difficulty);
+			memcpy(work->queue_key, work->midstate, QUEUE_KEY_MIDSTATE);
+			memcpy(work->queue_key + QUEUE_KEY_MIDSTATE, work->data + QUEUE_KEY_OFFSET, QUEUE_KEY_DATA);
 			wr_lock(&cgpu->qlock);
 			HASH_ADD_INT(cgpu->queued_work, id, work);
+			HASH_ADD(hh_key, cgpu->queued_bykey, queue_key, QUEUE_KEY_LEN, work);
 			wr_unlock(&cgpu->qlock);
 		}
 		/* The queue_full function should be used by the driver to
@@ -6442,23 +7343,44 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t mid
  * The common values for midstatelen, offset, datalen are 32, 64, 12 */
 struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
 {
-	struct work *ret;
+	bool indexed = (midstatelen == QUEUE_KEY_MIDSTATE && offset == QUEUE_KEY_OFFSET &&
+			datalen == QUEUE_KEY_DATA);
+	unsigned char key[QUEUE_KEY_LEN];
+	struct work *ret = NULL;
+
+	/* The common values are looked up in the index, anything else or a
+	 * matching item not yet on the device falls back to a full scan */
+	if (indexed) {
+		memcpy(key, midstate, QUEUE_KEY_MIDSTATE);
+		memcpy(key + QUEUE_KEY_MIDSTATE, data, QUEUE_KEY_DATA);
+	}
 
 	rd_lock(&cgpu->qlock);
-	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	if (indexed)
+		HASH_FIND(hh_key, cgpu->queued_bykey, key, QUEUE_KEY_LEN, ret);
+	if (!ret || !ret->queued)
+		ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
 	rd_unlock(&cgpu->qlock);
 
 	return ret;
 }
 
+/* Remove a work item from the device's queued work. Must be called with
+ * cgpu->qlock write locked. */
+void __work_dequeued(struct cgpu_info *cgpu, struct work *work)
+{
+	if (work->queued)
+		cgpu->queued_count--;
+	HASH_DEL(cgpu->queued_work, work);
+	HASH_DELETE(hh_key, cgpu->queued_bykey, work);
+}
+
 /* This function should be used by queued device drivers when they're sure
  * the work struct is no longer in use. */
 void work_completed(struct cgpu_info *cgpu, struct work *work)
 {
 	wr_lock(&cgpu->qlock);
-	if (work->queued)
-		cgpu->queued_count--;
-	HASH_DEL(cgpu->queued_work, work);
+	__work_dequeued(cgpu, work);
 	wr_unlock(&cgpu->qlock);
 
 	free_work(work);
@@ -6474,7 +7396,7 @@ static void flush_queue(struct cgpu_info *cgpu)
 		/* Can only discard the work items if they're not physically
 		 * queued on the device. */
 		if (!work->queued) {
-			HASH_DEL(cgpu->queued_work, work);
+			__work_dequeued(cgpu, work);
 			discard_work(work);
 			discarded++;
 		}
@@ -6891,6 +7813,112 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 #define WATCHDOG_SICK_COUNT		(WATCHDOG_SICK_TIME/WATCHDOG_INTERVAL)
 #define WATCHDOG_DEAD_COUNT		(WATCHDOG_DEAD_TIME/WATCHDOG_INTERVAL)
 
+static json_t *hist_json(struct cg_histogram *hist)
+{
+	json_t *obj = json_object();
+
+	json_object_set_new(obj, "count", json_integer(hist->count));
+	json_object_set_new(obj, "mean", json_real(hist_mean(hist)));
+	json_object_set_new(obj, "p50", json_real(hist_percentile(hist, 50)));
+	json_object_set_new(obj, "p90", json_real(hist_percentile(hist, 90)));
+	json_object_set_new(obj, "p99", json_real(hist_percentile(hist, 99)));
+
+	return obj;
+}
+
+/* Write the results of a --benchmark-time run as JSON so runs of different
+ * builds can be compared. Times are in seconds and hash rates in MH/s. */
+static void benchmark_report(void)
+{
+	struct cg_histogram *getwork_hist;
+	json_t *report, *devs;
+	struct timeval now;
+	double elapsed, mhashes;
+	FILE *f = stdout;
+	int i;
+
+	getwork_hist = calloc(1, sizeof(*getwork_hist));
+	if (unlikely(!getwork_hist))
+		quit(1, "Failed to calloc getwork_hist in benchmark_report");
+
+	cgtime(&now);
+	elapsed = tdiff(&now, &total_tv_start);
+	if (elapsed <= 0)
+		elapsed = 1;
+	mutex_lock(&hash_lock);
+	mhashes = total_mhashes_done;
+	mutex_unlock(&hash_lock);
+
+	report = json_object();
+	json_object_set_new(report, "version", json_string(VERSION));
+	json_object_set_new(report, "seed", json_integer(opt_benchmark_seed));
+	json_object_set_new(report, "difficulty", json_real(opt_benchmark_diff));
+	json_object_set_new(report, "elapsed", json_real(elapsed));
+	json_object_set_new(report, "mhashes", json_real(mhashes));
+	json_object_set_new(report, "hashrate", json_real(mhashes / elapsed));
+
+	stats_fold();
+	devs = json_array();
+	rd_lock(&devices_lock);
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = devices[i];
+		json_t *dev = json_object();
+
+		json_object_set_new(dev, "name", json_string(cgpu->drv->name));
+		json_object_set_new(dev, "id", json_integer(cgpu->device_id));
+		json_object_set_new(dev, "threads", json_integer(cgpu->threads));
+		json_object_set_new(dev, "hashrate", json_real(cgpu->total_mhashes / elapsed));
+		json_object_set_new(dev, "nonces", json_integer(cgpu->diff1));
+		json_object_set_new(dev, "accepted", json_integer(cgpu->accepted));
+		json_object_set_new(dev, "hw_errors", json_integer(cgpu->hw_errors));
+		json_object_set_new(dev, "getwork_wait", hist_json(&cgpu->cgminer_stats.getwork_hist));
+		json_array_append_new(devs, dev);
+		hist_merge(getwork_hist, &cgpu->cgminer_stats.getwork_hist);
+	}
+	rd_unlock(&devices_lock);
+
+	mutex_lock(&stats_lock);
+	json_object_set_new(report, "nonces", json_integer(total_diff1));
+	json_object_set_new(report, "accepted", json_integer(total_accepted));
+	json_object_set_new(report, "shares_per_sec", json_real(total_accepted / elapsed));
+	json_object_set_new(report, "hw_errors", json_integer(hw_errors));
+	json_object_set_new(report, "hw_error_rate", json_real(total_diff1 ? (double)hw_errors / total_diff1 : 0));
+	mutex_unlock(&stats_lock);
+	json_object_set_new(report, "getwork_wait", hist_json(getwork_hist));
+	json_object_set_new(report, "submit_latency", hist_json(&submit_hist));
+	json_object_set_new(report, "devices", devs);
+
+	if (opt_benchmark_report) {
+		f = fopen(opt_benchmark_report, "w");
+		if (unlikely(!f)) {
+			applog(LOG_ERR, "Failed to open %s for the benchmark report", opt_benchmark_report);
+			f = stdout;
+		}
+	}
+	json_dumpf(report, f, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+	fputc('\n', f);
+	if (f != stdout)
+		fclose(f);
+	else
+		fflush(f);
+
+	json_decref(report);
+	free(getwork_hist);
+}
+
+static void *benchmark_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("benchmark");
+
+	sleep(opt_benchmark_time);
+	applog(LOG_WARNING, "Benchmark ran for %d seconds as requested and exiting.", opt_benchmark_time);
+	benchmark_report();
+	kill_work();
+
+	return NULL;
+}
+
 static void *watchdog_thread(void __maybe_unused *userdata)
 {
 	const unsigned int interval = WATCHDOG_INTERVAL;
@@ -6911,6 +7939,7 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 		discard_stale();
 
+		stats_fold();
 		hashmeter(-1, &zero_tv, 0);
 
 #ifdef HAVE_CURSES
@@ -7057,6 +8086,10 @@ void print_summary(void)
 	double utility, displayed_hashes, work_util;
 	bool mhash_base = true;
 
+	/* The mining threads are gone by now so the shards can be drained
+	 * without stats_lock, which one of them may have died holding */
+	__stats_fold(false);
+
 	timersub(&total_tv_end, &total_tv_start, &diff);
 	hours = diff.tv_sec / 3600;
 	mins = (diff.tv_sec % 3600) / 60;
@@ -7156,6 +8189,9 @@ static void clean_up(void)
 
 void quit(int status, const char *format, ...)
 {
+	journal_close();
+	logging_stop();
+
 	if (format) {
 		va_list ap;
 		va_start(ap, format);
@@ -7409,6 +8445,8 @@ extern struct device_drv bflsc_drv;
 extern struct device_drv bitforce_drv;
 #endif
 
+extern struct device_drv cpu_drv;
+
 #ifdef USE_ICARUS
 extern struct device_drv icarus_drv;
 #endif
@@ -7481,6 +8519,7 @@ static void noop_thread_enable(struct thr_info __maybe_unused *thr)
 {
 }
 
+#define noop_thread_restart noop_thread_enable
 #define noop_flush_work noop_reinit_device
 #define noop_queue_full noop_get_stats
 
@@ -7511,6 +8550,8 @@ void fill_device_drv(struct cgpu_info *cgpu)
 		drv->thread_shutdown = &noop_thread_shutdown;
 	if (!drv->thread_enable)
 		drv->thread_enable = &noop_thread_enable;
+	if (!drv->thread_restart)
+		drv->thread_restart = &noop_thread_restart;
 	if (!drv->hash_work)
 		drv->hash_work = &hash_sole_work;
 	if (!drv->flush_work)
@@ -7551,6 +8592,7 @@ void enable_device(struct cgpu_info *cgpu)
 
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
+	cgpu->queued_bykey = NULL;
 }
 
 struct _cgpu_devid_counter {
@@ -7760,9 +8802,15 @@ int main(int argc, char *argv[])
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
 	mutex_init(&stats_lock);
+	mutex_init(&work_depot_lock);
+	if (unlikely(pthread_key_create(&work_cache_key, retire_work_cache)))
+		quit(1, "Failed to pthread_key_create work_cache_key");
 	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
 	mutex_init(&sshare_lock);
+	mutex_init(&submit_lock);
+	if (unlikely(pthread_cond_init(&submit_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init submit_cond");
 	rwlock_init(&blk_lock);
 	rwlock_init(&netacc_lock);
 	rwlock_init(&mining_thr_lock);
@@ -7893,6 +8941,9 @@ int main(int argc, char *argv[])
 	gpu_threads = 0;
 #endif
 
+	if (!opt_scrypt)
+		cpu_drv.drv_detect();
+
 #ifdef USE_ICARUS
 	if (!opt_scrypt)
 		icarus_drv.drv_detect();
@@ -8010,11 +9061,21 @@ int main(int argc, char *argv[])
 		openlog(PACKAGE, LOG_PID, LOG_USER);
 #endif
 
+	logging_start();
+
+	if (opt_share_journal && !journal_open(opt_share_journal))
+		quit(1, "Failed to open share journal %s", opt_share_journal);
+
 	#if defined(unix)
 		if (opt_stderr_cmd)
 			fork_monitor();
 	#endif // defined(unix)
 
+	/* Check the batched hashing the verify thread relies on before any
+	 * device can hand it a nonce */
+	if (!opt_scrypt && !verify_selftest())
+		quit(1, "BLAKE3 verification self test failed");
+
 	mining_thr = calloc(mining_threads, sizeof(thr));
 	if (!mining_thr)
 		quit(1, "Failed to calloc mining_thr");
@@ -8024,7 +9085,7 @@ int main(int argc, char *argv[])
 			quit(1, "Failed to calloc mining_thr[%d]", i);
 	}
 
-	total_control_threads = 8;
+	total_control_threads = 9;
 	control_thr = calloc(total_control_threads, sizeof(*thr));
 	if (!control_thr)
 		quit(1, "Failed to calloc control_thr");
@@ -8040,12 +9101,35 @@ int main(int argc, char *argv[])
 		quit(1, "stage thread create failed");
 	pthread_detach(thr->pth);
 
+	submit_q = tq_new();
+	if (!submit_q)
+		quit(1, "Failed to tq_new submit_q");
+	for (i = 0; i < opt_submit_threads; i++) {
+		pthread_t submit_thread;
+
+		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)(intptr_t)i)))
+			quit(1, "submit thread create failed");
+	}
+
+	verify_thr_id = 8;
+	thr = &control_thr[verify_thr_id];
+	thr->q = tq_new();
+	if (!thr->q)
+		quit(1, "Failed to tq_new");
+	/* start verify thread */
+	if (thr_info_create(thr, NULL, verify_thread, thr))
+		quit(1, "verify thread create failed");
+	pthread_detach(thr->pth);
+
 	/* Create a unique get work queue */
 	getq = tq_new();
 	if (!getq)
 		quit(1, "Failed to create getq");
 	/* We use the getq mutex as the staged lock */
 	stgd_lock = &getq->mutex;
+	/* The queue overflows onto the staged lists so it needn't be
+	 * sized exactly */
+	staged_lfq = lfq_new(opt_queue + mining_threads * 2 + 64);
 
 	if (opt_benchmark)
 		goto begin_bench;
@@ -8142,6 +9226,13 @@ begin_bench:
 		}
 	}
 
+	if (opt_benchmark && opt_benchmark_time) {
+		pthread_t bench_thread;
+
+		if (unlikely(pthread_create(&bench_thread, NULL, benchmark_thread, NULL)))
+			quit(1, "benchmark thread create failed");
+	}
+
 #ifdef HAVE_OPENCL
 	applog(LOG_INFO, "%d gpu miner threads started", gpu_threads);
 	for (i = 0; i < nDevs; i++)
@@ -8204,8 +9295,8 @@ begin_bench:
 #endif
 
 	/* Just to be sure */
-	if (total_control_threads != 8)
-		quit(1, "incorrect total_control_threads (%d) should be 8", total_control_threads);
+	if (total_control_threads != 9)
+		quit(1, "incorrect total_control_threads (%d) should be 9", total_control_threads);
 
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {
@@ -8230,7 +9321,11 @@ begin_bench:
 
 		/* Wait until hash_pop tells us we need to create more work */
 		if (ts > max_staged) {
-			pthread_cond_wait(&gws_cond, stgd_lock);
+			__atomic_store_n(&gws_waiting, true, __ATOMIC_SEQ_CST);
+			ts = __total_staged();
+			if (ts > max_staged)
+				pthread_cond_wait(&gws_cond, stgd_lock);
+			__atomic_store_n(&gws_waiting, false, __ATOMIC_SEQ_CST);
 			ts = __total_staged();
 		}
 		mutex_unlock(stgd_lock);
@@ -0,0 +1,212 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Software BLAKE3 miner for the 180 byte header.
+ *
+ * One CPU device is created with --cpu-threads mining threads. Each thread
+ * scans the 64 bit nonce the same way a board splits it across its cores:
+ *   bytes 0..2 - prefix taken from the work (nonce2 on stratum)
+ *   byte  3    - mining thread, so threads never overlap on identical work
+ *   bytes 4..7 - 32 bit counter scanned from work->blk.nonce upwards
+ * Nonces are hashed CPU_LANES at a time through blake3_hash_many_chunk_split,
+ * which runs the first two blocks of every header through the widest SIMD
+ * kernel the CPU supports (AVX-512, AVX2, SSE4.1 or SSE2) and compresses the
+ * final block, fixed for the work, per nonce. Nonces with 32 leading zero
+ * bits are handed to submit_nonce() like those from any board, making this a
+ * reference to check the FPGA results and the share validation against.
+ */
+
+#include "config.h"
+#include "miner.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux
+  #include <sched.h>
+#endif
+
+#include "blake3/blake3.h"
+
+/* Nonces hashed per hash_many call, a multiple of every SIMD degree */
+#define CPU_LANES 64
+
+/* Initial nonce range per scanhash call, hash_sole_work scales it to the
+ * log interval from there */
+#define CPU_INITIAL_RANGE 0x10000
+
+struct CPU_INFO {
+	uint8_t lanes[CPU_LANES][HEADER_TAIL_OFFSET];
+	const uint8_t *inputs[CPU_LANES];
+	const uint8_t *tails[CPU_LANES];
+	uint8_t out[CPU_LANES * BLAKE3_OUT_LEN];
+	uint64_t nonce_base;
+	int cpu;
+};
+
+struct device_drv cpu_drv;
+
+static void cpu_detect()
+{
+	struct cgpu_info *cpu;
+
+	if (opt_cpu_threads <= 0)
+		return;
+
+	cpu = calloc(1, sizeof(struct cgpu_info));
+	if (unlikely(!cpu))
+		quit(1, "Failed to calloc cpu in cpu_detect");
+	cpu->drv = &cpu_drv;
+	cpu->deven = DEV_ENABLED;
+	cpu->threads = opt_cpu_threads;
+	cpu->name = strdup("BLAKE3");
+	add_cgpu(cpu);
+
+	applog(LOG_INFO, "CPU %d: %d threads hashing %d lanes per call (SIMD degree %d)",
+		cpu->device_id, cpu->threads, CPU_LANES,
+		(int)blake3_hash_many_degree());
+}
+
+static bool cpu_thread_prepare(struct thr_info *thr)
+{
+	struct CPU_INFO *info;
+	int i;
+
+	info = calloc(1, sizeof(struct CPU_INFO));
+	if (unlikely(!info))
+		quit(1, "Failed to calloc CPU_INFO in cpu_thread_prepare");
+	for (i = 0; i < CPU_LANES; i++)
+		info->inputs[i] = info->lanes[i];
+	info->cpu = -1;
+	thr->cgpu_data = info;
+
+	return true;
+}
+
+/* Pin each mining thread to its own processor so the threads keep their
+ * lane buffers in cache and don't migrate mid scan */
+static bool cpu_thread_init(struct thr_info *thr)
+{
+	struct CPU_INFO *info = thr->cgpu_data;
+
+#ifdef __linux
+	if (num_processors > 1) {
+		cpu_set_t set;
+
+		info->cpu = thr->device_thread % num_processors;
+		CPU_ZERO(&set);
+		CPU_SET(info->cpu, &set);
+		if (unlikely(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+			applog(LOG_WARNING, "CPU %d thread %d failed to pin to processor %d",
+				thr->cgpu->device_id, thr->device_thread, info->cpu);
+			info->cpu = -1;
+		}
+	}
+#endif
+	applog(LOG_DEBUG, "CPU %d thread %d running on processor %d",
+		thr->cgpu->device_id, thr->device_thread, info->cpu);
+
+	return true;
+}
+
+static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
+{
+	return CPU_INITIAL_RANGE;
+}
+
+/* Lay the first two blocks of the header out once per work in every lane,
+ * leaving only the nonce to rewrite per batch */
+static bool cpu_prepare_work(struct thr_info *thr, struct work *work)
+{
+	struct CPU_INFO *info = thr->cgpu_data;
+	int i;
+
+	if (unlikely(!work->hash_tail_set))
+		set_hash_tail(work);
+	for (i = 0; i < CPU_LANES; i++) {
+		memcpy(info->lanes[i], work->data, HEADER_TAIL_OFFSET);
+		info->tails[i] = work->hash_tail;
+	}
+	info->nonce_base = (uint64_t)work->data[0] |
+			   ((uint64_t)work->data[1] << 8) |
+			   ((uint64_t)work->data[2] << 16) |
+			   ((uint64_t)(thr->device_thread & 0xff) << 24);
+
+	return true;
+}
+
+static int64_t cpu_scanhash(struct thr_info *thr, struct work *work, int64_t max_nonce)
+{
+	struct CPU_INFO *info = thr->cgpu_data;
+	uint64_t first = work->blk.nonce, last = max_nonce, n = first;
+	uint64_t nonce;
+	int count, i;
+
+	if (last > 0xffffffffULL)
+		last = 0xffffffffULL;
+
+	while (n < last) {
+		count = CPU_LANES;
+		if (last - n < CPU_LANES)
+			count = last - n;
+
+		for (i = 0; i < count; i++) {
+			nonce = info->nonce_base | ((n + i) << 32);
+			memcpy(info->lanes[i], &nonce, sizeof(nonce));
+		}
+		blake3_hash_many_chunk_split(info->inputs, info->tails, count,
+					     180, info->out);
+		for (i = 0; i < count; i++) {
+			uint32_t *hash32 = (uint32_t *)&info->out[i * BLAKE3_OUT_LEN];
+
+			if (unlikely(!*hash32))
+				submit_nonce(thr, work, info->nonce_base | ((n + i) << 32));
+		}
+		n += count;
+
+		if (unlikely(thr->work_restart))
+			break;
+	}
+
+	work->blk.nonce = n;
+	return n - first;
+}
+
+static struct api_data *cpu_api_stats(struct cgpu_info *cgpu)
+{
+	struct api_data *root = NULL;
+	int threads = cgpu->threads, lanes = CPU_LANES;
+	int degree = blake3_hash_many_degree();
+
+	root = api_add_int(root, "Threads", &threads, true);
+	root = api_add_int(root, "Lanes", &lanes, true);
+	root = api_add_int(root, "SIMD Degree", &degree, true);
+
+	return root;
+}
+
+static void cpu_thread_shutdown(struct thr_info *thr)
+{
+	free(thr->cgpu_data);
+	thr->cgpu_data = NULL;
+}
+
+struct device_drv cpu_drv = {
+	.drv_id = DRIVER_CPU,
+	.dname = "cpu",
+	.name = "CPU",
+	.drv_detect = cpu_detect,
+	.get_api_stats = cpu_api_stats,
+	.thread_prepare = cpu_thread_prepare,
+	.can_limit_work = cpu_can_limit_work,
+	.thread_init = cpu_thread_init,
+	.prepare_work = cpu_prepare_work,
+	.scanhash = cpu_scanhash,
+	.thread_shutdown = cpu_thread_shutdown,
+};
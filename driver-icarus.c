@@ -33,6 +33,7 @@
 #include "miner.h"
 
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/time.h>
@@ -43,6 +44,7 @@
   #include <termios.h>
   #include <sys/stat.h>
   #include <fcntl.h>
+  #include <errno.h>
   #ifndef O_CLOEXEC
     #define O_CLOEXEC 0
   #endif
@@ -54,6 +56,11 @@
 #include "elist.h"
 #include "fpgautils.h"
 
+#ifdef __linux
+  #include <sys/epoll.h>
+  #define ICARUS_ASYNC_IO
+#endif
+
 // *** deke ***
 // The serial I/O speed - Linux uses a define 'B115200' in bits/termios.h
 #define ICARUS_IO_SPEED 3000000 
@@ -178,17 +185,109 @@ static const char *MODE_UNKNOWN_STR = "unknown";
 #define MAX_CORE_HISTORY_SAMPLES 10
 #define HASHRATE_AVG_OVER_SECS 5
 #define SECONDS_PER_NONCE_RANGE 10
+// Work written to the device that nonces can still be matched against
+#define ICARUS_INFLIGHT 4
+// Most work kept ready to write, the limit of --icarus-queue
+#define ICARUS_MAX_QUEUE 10
 
 struct CORE_HISTORY_SAMPLE {
-	struct timeval sample_time;
+	double sample_time;
 	uint32_t hashrate;
 };
 
+// Ring of the latest samples with the running sum of those still inside
+// the averaging window, so neither adding a sample nor reading the average
+// rescans the history. Alongside it an exponentially weighted rate and
+// variance with a half-life of --icarus-halflife seconds.
 struct CORE_HISTORY {
 	struct CORE_HISTORY_SAMPLE samples[MAX_CORE_HISTORY_SAMPLES];
+	uint8_t head;
+	uint8_t count;
+	uint64_t sum;
+	uint32_t average;
+
+	double ewma;
+	double ewma_var;
+	double ewma_time;
+	double last_active;
 };
+
+static inline double tv_secs(struct timeval *tv)
+{
+	return (double)tv->tv_sec + (double)tv->tv_usec / 1000000.0;
+}
+
+// Start every core off with one sample of the rate expected from the clock
+static void init_core_history(struct CORE_HISTORY *history, struct timeval *sample_time, uint32_t hashrate)
+{
+	memset(history, 0, sizeof(*history));
+	history->samples[0].sample_time = tv_secs(sample_time);
+	history->samples[0].hashrate = hashrate;
+	history->head = 1;
+	history->count = 1;
+	history->sum = hashrate;
+	history->average = hashrate;
+	history->ewma = hashrate;
+	history->ewma_time = history->samples[0].sample_time;
+	history->last_active = history->samples[0].sample_time;
+}
+
+static inline struct CORE_HISTORY_SAMPLE *newest_core_sample(struct CORE_HISTORY *history)
+{
+	return &history->samples[(history->head + MAX_CORE_HISTORY_SAMPLES - 1) % MAX_CORE_HISTORY_SAMPLES];
+}
+
+// Drop the samples taken more than 'seconds' before 'now' from the window
+static void expire_core_history(struct CORE_HISTORY *history, double now, uint32_t seconds)
+{
+	while (history->count) {
+		struct CORE_HISTORY_SAMPLE *oldest = &history->samples[(history->head + MAX_CORE_HISTORY_SAMPLES - history->count) % MAX_CORE_HISTORY_SAMPLES];
+
+		if (now - oldest->sample_time <= seconds)
+			break;
+		history->sum -= oldest->hashrate;
+		history->count--;
+	}
+	history->average = history->count ? history->sum / history->count : 0;
+}
 //
 
+#ifdef ICARUS_ASYNC_IO
+// Replies from every device are read by a single epoll thread that
+// reassembles whole frames and queues them per device, so the mining
+// thread only wakes up once a complete reply is available
+#define ICARUS_RX_SIZE (ICARUS_READ_SIZE * 16)
+#define ICARUS_FRAME_QUEUE 64
+
+struct ICARUS_FRAME {
+	struct timeval tv_finish;
+	unsigned char buf[ICARUS_READ_SIZE];
+};
+
+struct ICARUS_IO {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	int device_id;
+	bool error;
+
+	// Bytes read but not yet making up a whole frame
+	unsigned char rx[ICARUS_RX_SIZE];
+	size_t rx_len;
+	struct timeval rx_first;
+
+	struct ICARUS_FRAME frames[ICARUS_FRAME_QUEUE];
+	unsigned int frame_head;
+	unsigned int frame_tail;
+
+	uint64_t reads;
+	uint64_t frames_read;
+	uint64_t telemetry;
+	uint64_t resyncs;
+	uint64_t overruns;
+};
+#endif
+
 struct ICARUS_INFO {
 	// time to calculate the golden_ob
 	uint64_t golden_hashes;
@@ -234,6 +333,33 @@ struct ICARUS_INFO {
 	uint8_t expected_cores;
 	struct CORE_HISTORY core_history[MAX_CORES];
 	//
+
+	// The last work written, newest before inflight_next, so nonces the
+	// cores were still finding for earlier work can be credited. Work
+	// stays queued on the cgpu until it drops out of here.
+	struct work *inflight[ICARUS_INFLIGHT];
+	int inflight_next;
+	uint64_t nonces_recovered;
+	uint64_t nonces_dropped;
+
+	// Work taken from the cgpu queue ready to write the moment the board
+	// is done with its current work, oldest first
+	struct work *ready[ICARUS_MAX_QUEUE];
+	int ready_count;
+	struct work *current;
+	bool current_done;
+
+	// Time from the board being done with one work to the next being
+	// written, and how often there was none ready
+	struct timeval idle_start;
+	double idle_total;
+	double idle_max;
+	uint64_t works_written;
+	uint64_t queue_empty;
+
+#ifdef ICARUS_ASYNC_IO
+	struct ICARUS_IO io;
+#endif
 };
 
 #define END_CONDITION 0x0000ffff
@@ -288,9 +414,9 @@ static int icarus_gets(unsigned char *buf, int fd, struct timeval *tv_finish, st
 	int read_amount = ICARUS_READ_SIZE;
 	bool first = true;
 
-	// Read reply 1 byte at a time to get earliest tv_finish
+	// Read as much of the reply as is available, timing the first byte
 	while (true) {
-		ret = read(fd, buf, 1);
+		ret = read(fd, buf, read_amount);
 		if (ret < 0)
 			return ICA_GETS_ERROR;
 
@@ -341,6 +467,307 @@ static int icarus_write(int fd, const void *buf, size_t bufLen)
 	return 0;
 }
 
+// Voltage and temperature report from the board sensors
+static void icarus_telemetry(int device_id, const unsigned char *nonce_bin)
+{
+	unsigned int volt_raw, temp_raw;
+
+	// voltage -> SENSOR 1
+	volt_raw = nonce_bin[1];
+	volt_raw <<= 8;
+	volt_raw |= nonce_bin[2];
+	volt_raw *= 3000;
+	if(volt_raw)
+		fpga_volt_1[device_id] = (volt_raw / 65536);
+	else
+		fpga_volt_1[device_id] = 0;
+	// voltage -> SENSOR 2
+	volt_raw = nonce_bin[3];
+	volt_raw <<= 8;
+	volt_raw |= nonce_bin[4];
+	volt_raw *= 3000;
+	if(volt_raw)
+		fpga_volt_2[device_id] = (volt_raw / 65536);
+	else
+		fpga_volt_2[device_id] = 0;
+	// voltage -> SENSOR 3
+	volt_raw = nonce_bin[5];
+	volt_raw <<= 8;
+	volt_raw |= nonce_bin[6];
+	volt_raw *= 3000;
+	if(volt_raw)
+		fpga_volt_3[device_id] = (volt_raw / 65536);
+	else
+		fpga_volt_3[device_id] = 0;
+	// teperature -> SENSOR 1
+	temp_raw = nonce_bin[9];
+	temp_raw <<= 8;
+	temp_raw |= nonce_bin[10];
+	if(temp_raw)
+		fpga_temp_1[device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
+	else
+		fpga_temp_1[device_id] = 0;
+	// teperature -> SENSOR 2
+	temp_raw = nonce_bin[11];
+	temp_raw <<= 8;
+	temp_raw |= nonce_bin[12];
+	if(temp_raw)
+		fpga_temp_2[device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
+	else
+		fpga_temp_2[device_id] = 0;
+	// teperature -> SENSOR 3
+	temp_raw = nonce_bin[13];
+	temp_raw <<= 8;
+	temp_raw |= nonce_bin[14];
+	if(temp_raw)
+		fpga_temp_3[device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
+	else
+		fpga_temp_3[device_id] = 0;
+}
+
+#ifdef ICARUS_ASYNC_IO
+static struct thr_info icarus_io_thr;
+static pthread_mutex_t icarus_io_start = PTHREAD_MUTEX_INITIALIZER;
+static int icarus_epfd = -1;
+
+// A frame starts with its type byte; nonce and counter frames
+// also always have bytes 2 to 8 zero
+static bool icarus_frame_valid(const unsigned char *buf)
+{
+	int i;
+
+	switch (buf[0]) {
+		case 0x01:
+		case 0xbb:
+			for (i = 2; i <= 8; i++)
+				if (buf[i])
+					return false;
+			return true;
+		case 0xaa:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void icarus_io_queue(struct ICARUS_IO *io, const unsigned char *buf, struct timeval *tv_finish)
+{
+	struct ICARUS_FRAME *frame;
+
+	// Telemetry is consumed here, the mining thread only needs
+	// nonces and counters
+	if (buf[0] == 0xaa) {
+		icarus_telemetry(io->device_id, buf);
+		io->telemetry++;
+		return;
+	}
+
+	if (io->frame_tail - io->frame_head >= ICARUS_FRAME_QUEUE) {
+		io->frame_head++;
+		io->overruns++;
+	}
+	frame = &io->frames[io->frame_tail % ICARUS_FRAME_QUEUE];
+	memcpy(frame->buf, buf, ICARUS_READ_SIZE);
+	copy_time(&frame->tv_finish, tv_finish);
+	io->frame_tail++;
+	io->frames_read++;
+	pthread_cond_signal(&io->cond);
+}
+
+// Split io->rx into frames, skipping any bytes that can't start one
+static void icarus_io_reassemble(struct ICARUS_IO *io, struct timeval *now)
+{
+	size_t off = 0;
+	bool resync = false;
+
+	while (io->rx_len - off >= ICARUS_READ_SIZE) {
+		if (!icarus_frame_valid(io->rx + off)) {
+			if (!resync) {
+				io->resyncs++;
+				resync = true;
+			}
+			off++;
+			continue;
+		}
+		resync = false;
+		icarus_io_queue(io, io->rx + off, &io->rx_first);
+		off += ICARUS_READ_SIZE;
+		copy_time(&io->rx_first, now);
+	}
+
+	if (off) {
+		io->rx_len -= off;
+		memmove(io->rx, io->rx + off, io->rx_len);
+	}
+}
+
+static void icarus_io_read(struct ICARUS_IO *io, uint32_t events)
+{
+	struct timeval now;
+	ssize_t ret;
+
+	mutex_lock(&io->lock);
+	if (io->fd == -1)
+		goto out;
+
+	ret = read(io->fd, io->rx + io->rx_len, ICARUS_RX_SIZE - io->rx_len);
+	if (ret > 0) {
+		cgtime(&now);
+		if (!io->rx_len)
+			copy_time(&io->rx_first, &now);
+		io->rx_len += ret;
+		io->reads++;
+		icarus_io_reassemble(io, &now);
+	} else if ((ret < 0 && errno != EAGAIN && errno != EINTR) ||
+		   (events & (EPOLLERR | EPOLLHUP))) {
+		epoll_ctl(icarus_epfd, EPOLL_CTL_DEL, io->fd, NULL);
+		io->error = true;
+		pthread_cond_signal(&io->cond);
+	}
+out:
+	mutex_unlock(&io->lock);
+}
+
+#define ICARUS_IO_EVENTS 64
+
+static void *icarus_io_thread(void __maybe_unused *userdata)
+{
+	struct epoll_event events[ICARUS_IO_EVENTS];
+	int i, n;
+
+	pthread_detach(pthread_self());
+	RenameThread("icarusio");
+
+	while (42) {
+		n = epoll_wait(icarus_epfd, events, ICARUS_IO_EVENTS, -1);
+		if (unlikely(n < 0)) {
+			if (errno == EINTR)
+				continue;
+			quit(1, "Icarus I/O epoll_wait failed");
+		}
+		for (i = 0; i < n; i++)
+			icarus_io_read(events[i].data.ptr, events[i].events);
+	}
+
+	return NULL;
+}
+
+static void icarus_io_init(struct ICARUS_IO *io, int device_id)
+{
+	mutex_init(&io->lock);
+	if (unlikely(pthread_cond_init(&io->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init icarus io cond");
+	io->fd = -1;
+	io->device_id = device_id;
+}
+
+// Hand a freshly opened device over to the I/O thread, starting it
+// the first time round
+static bool icarus_io_add(struct ICARUS_IO *io, int fd)
+{
+	struct epoll_event ev;
+
+	mutex_lock(&icarus_io_start);
+	if (icarus_epfd == -1) {
+		icarus_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (unlikely(icarus_epfd == -1 ||
+			     thr_info_create(&icarus_io_thr, NULL, icarus_io_thread, NULL)))
+			quit(1, "Icarus I/O thread create failed");
+	}
+	mutex_unlock(&icarus_io_start);
+
+	mutex_lock(&io->lock);
+	io->fd = fd;
+	io->error = false;
+	io->rx_len = 0;
+	io->frame_head = io->frame_tail = 0;
+	mutex_unlock(&io->lock);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = io;
+	if (unlikely(epoll_ctl(icarus_epfd, EPOLL_CTL_ADD, fd, &ev))) {
+		applog(LOG_ERR, "Icarus %d: epoll_ctl add failed", io->device_id);
+		mutex_lock(&io->lock);
+		io->fd = -1;
+		mutex_unlock(&io->lock);
+		return false;
+	}
+
+	return true;
+}
+
+static void icarus_io_del(struct ICARUS_IO *io)
+{
+	mutex_lock(&io->lock);
+	if (io->fd != -1) {
+		epoll_ctl(icarus_epfd, EPOLL_CTL_DEL, io->fd, NULL);
+		io->fd = -1;
+	}
+	mutex_unlock(&io->lock);
+}
+
+// Same results as icarus_gets() but waits for the I/O thread to
+// queue a whole frame rather than reading the device directly, a
+// work restart wakes it through icarus_thread_restart()
+static int icarus_io_gets(struct ICARUS_IO *io, unsigned char *buf, struct timeval *tv_finish, struct thr_info *thr, int read_count)
+{
+	struct ICARUS_FRAME *frame;
+	struct timeval now, then, tdiff;
+	struct timespec abstime;
+	int ret;
+
+	tdiff.tv_sec = read_count / TIME_FACTOR;
+	tdiff.tv_usec = (read_count % TIME_FACTOR) * (1000000 / TIME_FACTOR);
+	cgtime(&now);
+	timeradd(&now, &tdiff, &then);
+	abstime.tv_sec = then.tv_sec;
+	abstime.tv_nsec = then.tv_usec * 1000;
+
+	mutex_lock(&io->lock);
+	while (io->frame_head == io->frame_tail) {
+		if (io->error) {
+			ret = ICA_GETS_ERROR;
+			goto out;
+		}
+
+		if (thr && thr->work_restart) {
+			cgtime(tv_finish);
+			if (opt_debug) {
+				timersub(tv_finish, &now, &tdiff);
+				applog(LOG_DEBUG,
+					"Icarus Read: Work restart at %ld.%02ld seconds",
+					(long)tdiff.tv_sec, (long)tdiff.tv_usec / 10000);
+			}
+			ret = ICA_GETS_RESTART;
+			goto out;
+		}
+
+		if (pthread_cond_timedwait(&io->cond, &io->lock, &abstime) == ETIMEDOUT &&
+		    io->frame_head == io->frame_tail && !io->error) {
+			if (opt_debug) {
+				applog(LOG_DEBUG,
+					"Icarus Read: No data in %.2f seconds",
+					(float)read_count/(float)TIME_FACTOR);
+			}
+			cgtime(tv_finish);
+			ret = ICA_GETS_TIMEOUT;
+			goto out;
+		}
+	}
+
+	frame = &io->frames[io->frame_head % ICARUS_FRAME_QUEUE];
+	memcpy(buf, frame->buf, ICARUS_READ_SIZE);
+	copy_time(tv_finish, &frame->tv_finish);
+	io->frame_head++;
+	ret = ICA_GETS_OK;
+out:
+	mutex_unlock(&io->lock);
+
+	return ret;
+}
+#endif
+
 // *** deke ***
 static bool cairnsmore_send_cmd(int fd, uint8_t cmd, uint16_t data, bool probe)
 {
@@ -469,6 +896,9 @@ static bool cairnsmore_send_cmd(int fd, uint8_t cmd, uint16_t data, bool probe)
 static void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
+#ifdef ICARUS_ASYNC_IO
+	icarus_io_del(&icarus_info[icarus->device_id]->io);
+#endif
 	icarus_close(icarus->device_fd);
 	icarus->device_fd = -1;
 }
@@ -896,12 +1326,15 @@ static bool icarus_detect_one(const char *devpath)
 	info->nonce_mask = mask(work_division);
 	info->enabled_cores = 0;
 	info->active_core_count = 0;
+#ifdef ICARUS_ASYNC_IO
+	icarus_io_init(&info->io, icarus->device_id);
+#endif
 
-	memset(info->core_history, 0, sizeof(info->core_history));
-	cgtime(&info->core_history[0].samples[0].sample_time);
-	info->core_history[0].samples[0].hashrate = cainsmore_clock_speed*5/2*1000000;
-	for (int i = 1; i < MAX_CORES; ++i)
-		memcpy(&info->core_history[i].samples[0], &info->core_history[0].samples[0], sizeof(struct CORE_HISTORY_SAMPLE));
+	struct timeval now;
+
+	cgtime(&now);
+	for (int i = 0; i < MAX_CORES; ++i)
+		init_core_history(&info->core_history[i], &now, cainsmore_clock_speed*5/2*1000000);
 
 	if (nonce_bin[0] == 0xbb)	
 	{
@@ -942,6 +1375,12 @@ static bool icarus_prepare(struct thr_info *thr)
 		return false;
 	}
 
+#ifdef ICARUS_ASYNC_IO
+	if (unlikely(!icarus_io_add(&icarus_info[icarus->device_id]->io, fd))) {
+		icarus_close(fd);
+		return false;
+	}
+#endif
 	icarus->device_fd = fd;
 
 	applog(LOG_INFO, "Opened Icarus on %s", icarus->device_path);
@@ -1010,6 +1449,11 @@ uint32_t new_hashcount_since_last_return(struct ICARUS_INFO *info, struct timeva
 {
 	struct timeval elapsed;
 
+	// Frames the reader stamped before the latest work was written
+	// are already accounted for
+	if (timercmp(until, &info->prev_hashcount_return, <))
+		return 0;
+
 	timersub(until, &info->prev_hashcount_return, &elapsed);
 	copy_time(&info->prev_hashcount_return, until);
 	uint32_t device_hashcount_this_period = (double)info->prev_hashrate * ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec))/((double)1000000)); 
@@ -1028,62 +1472,68 @@ uint32_t new_hashcount_since_last_return(struct ICARUS_INFO *info, struct timeva
 void update_core_history(struct ICARUS_INFO *info, uint8_t core_num, struct timeval *sample_time, uint32_t hashrate, bool force_retain_all)
 {
 	struct CORE_HISTORY *history = &info->core_history[core_num];
-	struct CORE_HISTORY_SAMPLE *prev_sample = &history->samples[0];
-	double work_start = (double)(info->work_start.tv_sec) + ((double)(info->work_start.tv_usec))/((double)1000000); 
-	double sample_finish= (double)(sample_time->tv_sec) + ((double)(sample_time->tv_usec))/((double)1000000); 
-	double prev_sample_finish= (double)(prev_sample->sample_time.tv_sec) + ((double)(prev_sample->sample_time.tv_usec))/((double)1000000); 
+	struct CORE_HISTORY_SAMPLE *sample = newest_core_sample(history);
+	double work_start = tv_secs(&info->work_start);
+	double sample_finish = tv_secs(sample_time);
+	double elapsed, alpha, diff;
 	
 	// We will only log a new sample per work normally, since the most accurate hashrate for a given work
 	// is the last update. All previous updates were for a smaller portion of the FPGA's 
 	// continuous processing of the given work.
-	if (force_retain_all || work_start > prev_sample_finish)
+	if (force_retain_all || !history->count || work_start > sample->sample_time)
 	{
-		for (int i = MAX_CORE_HISTORY_SAMPLES-1; i > 0; --i)
-			memcpy(&history->samples[i-1], &history->samples[i], sizeof(struct CORE_HISTORY_SAMPLE));
+		sample = &history->samples[history->head];
+		// A full ring overwrites its oldest sample
+		if (history->count == MAX_CORE_HISTORY_SAMPLES)
+		{
+			history->sum -= sample->hashrate;
+			history->count--;
+		}
+		history->head = (history->head + 1) % MAX_CORE_HISTORY_SAMPLES;
+		history->count++;
 	}
-	copy_time(&prev_sample->sample_time, sample_time);
-	prev_sample->hashrate = hashrate;
+	else
+		history->sum -= sample->hashrate;
+	sample->sample_time = sample_finish;
+	sample->hashrate = hashrate;
+	history->sum += hashrate;
+	expire_core_history(history, sample_finish, HASHRATE_AVG_OVER_SECS);
+
+	// Weigh each sample by how long it has been since the last one
+	elapsed = sample_finish - history->ewma_time;
+	if (elapsed > 0)
+	{
+		alpha = 1.0 - exp2(-elapsed / opt_icarus_halflife);
+		diff = (double)hashrate - history->ewma;
+		history->ewma += alpha * diff;
+		history->ewma_var = (1.0 - alpha) * (history->ewma_var + alpha * diff * diff);
+		history->ewma_time = sample_finish;
+	}
+	if (hashrate)
+		history->last_active = sample_finish;
 }
 
 // 'from_time' is the time reference we are going to look from and go back 'seconds' to average over.
+// Samples older than that are dropped for good, so 'seconds' must not shrink between calls.
 uint32_t get_core_hashrate_average(struct ICARUS_INFO *info, uint8_t core_num, uint32_t seconds, struct timeval *from_time)
 {
-	uint64_t hashrate_sum = 0;
-	uint16_t sample_count = 0;
-	struct timeval elapsed;
 	struct CORE_HISTORY *history = &info->core_history[core_num];
-	struct CORE_HISTORY_SAMPLE *sample = history->samples;
 
-	for (int i=0; i < MAX_CORE_HISTORY_SAMPLES; ++i, ++sample)
-	{
-		if (sample->sample_time.tv_sec == 0 && sample->sample_time.tv_usec == 0)
-			break;
+	expire_core_history(history, tv_secs(from_time), seconds);
 
-		timersub(from_time, &sample->sample_time, &elapsed);
-		uint32_t time_ago = (double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec))/((double)1000000);
-		if (time_ago > seconds)
-			break;
-
-		sample_count ++;
-		hashrate_sum += sample->hashrate;
-	}
-	if (sample_count == 0)
-		return 0;
-
-	return hashrate_sum / sample_count;
+	return history->average;
 }
 
 // 'from_time' is the time reference we are going to look from and go back 'seconds' to average over.
 void disable_inactive_cores_since_work_start(struct ICARUS_INFO *info)
 {
+	double work_start = tv_secs(&info->work_start);
 
 	for (int i=0; i < info->expected_cores; i ++)
 	{
-		double work_start = (double)(info->work_start.tv_sec) + ((double)(info->work_start.tv_usec))/((double)1000000); 
-		struct timeval *sample_time = &info->core_history[i].samples[0].sample_time;
-		double sample_finish = (double)(sample_time->tv_sec) + ((double)(sample_time->tv_usec))/((double)1000000); 
+		struct CORE_HISTORY *history = &info->core_history[i];
 
-		if (sample_finish < work_start)
+		if (!history->count || newest_core_sample(history)->sample_time < work_start)
 			disable_core(info, i);
 	}
 }
@@ -1096,11 +1546,9 @@ uint64_t get_device_hashrate_average(struct ICARUS_INFO *info, uint32_t seconds,
 	for (int i=0; i < info->expected_cores; i ++)
 	{
 		uint32_t hashrate = get_core_hashrate_average(info, i, seconds, from_time);
-		applog(LOG_ERR, "Core %d hashrate avg = %u", i, hashrate);
+		applog(LOG_DEBUG, "Core %d hashrate avg = %u", i, hashrate);
 		if (hashrate != 0)
 		{
-			if (hashrate < 100000000)
-		applog(LOG_ERR, "Core %d dropping hashrate avg = %u", i, hashrate);
 			hashrate_sum += hashrate;
 			if ((info->enabled_cores >> i) & 0x1 == 0)
 				enable_core(info, i);
@@ -1121,6 +1569,9 @@ uint64_t get_hashcount_estimate_for_return(struct ICARUS_INFO *info, struct work
 	struct timeval elapsed;
 	//
 	// Tyler Edit
+	if (timercmp(until_time, &info->prev_hashcount_return, <))
+		return 0;
+
 	timersub(until_time, &info->prev_hashcount_return, &elapsed);
 
 	uint64_t hash_count = (double)info->prev_hashrate * ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec))/((double)1000000)); 
@@ -1142,6 +1593,42 @@ bool is_response_for_current_work(uint8_t *nonce_bin, struct work *work)
 	return (memcmp(&nonce_bin[9], work->data, 3) == 0);
 }
 
+static void inflight_add(struct cgpu_info *icarus, struct ICARUS_INFO *info, struct work *work)
+{
+	struct work **slot = &info->inflight[info->inflight_next];
+
+	if (*slot)
+		work_completed(icarus, *slot);
+	*slot = work;
+	info->inflight_next = (info->inflight_next + 1) % ICARUS_INFLIGHT;
+}
+
+// Find the written work a nonce frame's 3 byte prefix belongs to, newest first
+static struct work *inflight_find(struct ICARUS_INFO *info, uint8_t *nonce_bin)
+{
+	int i, slot;
+
+	for (i = 1; i <= ICARUS_INFLIGHT; i++) {
+		slot = (info->inflight_next + ICARUS_INFLIGHT - i) % ICARUS_INFLIGHT;
+		if (info->inflight[slot] && is_response_for_current_work(nonce_bin, info->inflight[slot]))
+			return info->inflight[slot];
+	}
+	return NULL;
+}
+
+static void inflight_clear(struct cgpu_info *icarus, struct ICARUS_INFO *info)
+{
+	int i;
+
+	for (i = 0; i < ICARUS_INFLIGHT; i++) {
+		if (info->inflight[i]) {
+			work_completed(icarus, info->inflight[i]);
+			info->inflight[i] = NULL;
+		}
+	}
+	info->current = NULL;
+}
+
 //
 // since_time - we use this time to look for activity from cores since then. If no activity
 // we will assume the core is inactive. This reference point should be when new work begins.
@@ -1154,14 +1641,9 @@ bool is_response_for_current_work(uint8_t *nonce_bin, struct work *work)
 bool update_active_core(struct ICARUS_INFO *info, struct timeval *since_time, uint16_t core_num, struct timeval *sample_time)
 {
 	struct CORE_HISTORY *history = &info->core_history[core_num];
-	struct CORE_HISTORY_SAMPLE *sample = history->samples;
 
 	// there has been a response since reference time so don't set inactive.
-	if (sample[0].sample_time.tv_sec > since_time->tv_sec)
-		return false;
-
-	// there has been a response since reference time so don't set inactive.
-	if ((sample[0].sample_time.tv_sec == since_time->tv_sec) && (sample[0].sample_time.tv_usec >  since_time->tv_usec))
+	if (history->count && newest_core_sample(history)->sample_time > tv_secs(since_time))
 		return false;
 
 	// inactive since reference time
@@ -1469,6 +1951,9 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 			return 0;	/* This should never happen */
 		}
 		cgtime(&tv_start);
+		record_work_written(icarus, work);
+		inflight_add(icarus, info, work);
+		info->works_written++;
 		copy_time(&info->work_start, &tv_start);
 		copy_time(&info->prev_hashcount_return, &tv_start);
 		info->prev_hashcount = 0;
@@ -1485,7 +1970,11 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 
 	/* Icarus will return 4 bytes (ICARUS_READ_SIZE) nonces or nothing */
 	memset(nonce_bin, 0, sizeof(nonce_bin));
+#ifdef ICARUS_ASYNC_IO
+	ret = icarus_io_gets(&info->io, nonce_bin, &tv_finish, thr, info->read_count);
+#else
 	ret = icarus_gets(nonce_bin, fd, &tv_finish, thr, info->read_count);
+#endif
 	
 	if (!ret)
 	{
@@ -1569,8 +2058,6 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 		 return estimate_hashes;
 	}
 	
-	unsigned int volt_raw, temp_raw;	
-	
 	if ((nonce_bin[0] == 0xbb) && !nonce_bin[2] && !nonce_bin[3] && !nonce_bin[4] && !nonce_bin[5] && !nonce_bin[6] && !nonce_bin[7] && !nonce_bin[8])
 	{
 		// nonce
@@ -1595,58 +2082,7 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 	}
 	else if (nonce_bin[0] == 0xaa)
 	{
-		// voltage -> SENSOR 1
-		volt_raw = nonce_bin[1];
-		volt_raw <<= 8;
-		volt_raw |= nonce_bin[2];
-		volt_raw *= 3000;	
-		if(volt_raw)
-			fpga_volt_1[icarus->device_id] = (volt_raw / 65536);
-		else
-			fpga_volt_1[icarus->device_id] = 0;
-		// voltage -> SENSOR 2
-		volt_raw = nonce_bin[3];
-		volt_raw <<= 8;
-		volt_raw |= nonce_bin[4];
-		volt_raw *= 3000;	
-		if(volt_raw)
-			fpga_volt_2[icarus->device_id] = (volt_raw / 65536);
-		else
-			fpga_volt_2[icarus->device_id] = 0;
-		// voltage -> SENSOR 3
-		volt_raw = nonce_bin[5];
-		volt_raw <<= 8;
-		volt_raw |= nonce_bin[6];
-		volt_raw *= 3000;	
-		if(volt_raw)
-			fpga_volt_3[icarus->device_id] = (volt_raw / 65536);
-		else
-			fpga_volt_3[icarus->device_id] = 0;	
-		// teperature -> SENSOR 1
-		temp_raw = nonce_bin[9];
-		temp_raw <<= 8;
-		temp_raw |= nonce_bin[10];
-		if(temp_raw)
-			fpga_temp_1[icarus->device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
-		else
-			fpga_temp_1[icarus->device_id] = 0;
-		// teperature -> SENSOR 2
-		temp_raw = nonce_bin[11];
-		temp_raw <<= 8;
-		temp_raw |= nonce_bin[12];	
-		if(temp_raw)
-			fpga_temp_2[icarus->device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
-		else
-			fpga_temp_2[icarus->device_id] = 0;
-		// teperature -> SENSOR 3
-		temp_raw = nonce_bin[13];
-		temp_raw <<= 8;
-		temp_raw |= nonce_bin[14];	
-		if(temp_raw)
-			fpga_temp_3[icarus->device_id] = ((((float)temp_raw * 509.3140064) / 65536 ) - 280.2308787);
-		else
-			fpga_temp_3[icarus->device_id] = 0;
-		
+		icarus_telemetry(icarus->device_id, nonce_bin);
 
 		hash_count = get_hashcount_estimate_for_return(info, work, &tv_finish);
 		icarus->result_is_estimate = true;
@@ -1683,10 +2119,26 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 	if (!icarus->result_is_counter)
 	//
 	{
+		struct work *nonce_work = work;
+
+		// The cores can still be finishing work written before this one
+		if (!is_response_for_current_work(nonce_bin, work)) {
+			nonce_work = inflight_find(info, nonce_bin);
+			if (nonce_work)
+				info->nonces_recovered++;
+			else {
+				info->nonces_dropped++;
+				applog(LOG_INFO, "%s%d: nonce %08x [core %d] for unknown work %02x%02x%02x dropped",
+				       icarus->drv->name, icarus->device_id, nonce, nonce_d,
+				       nonce_bin[9], nonce_bin[10], nonce_bin[11]);
+				goto nonce_done;
+			}
+		}
+
 		uint64_t real_nonce = ((uint64_t)nonce_d<<32)+nonce;
 		if (info->expected_cores >= 9)
 		{
-			uint32_t nonce2 = *(uint32_t*)work->data;
+			uint32_t nonce2 = *(uint32_t*)nonce_work->data;
 			nonce2 &= 0xffffff;
 			nonce2 = bswap_32(nonce2);
 			real_nonce |= ((uint64_t)htole32(nonce2))<<32;
@@ -1707,8 +2159,9 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 		applog(LOG_WARNING, "VCU1525 %d: nonce %016lx, [core %d]", icarus->device_id, real_nonce, nonce_d);
 		uint64_t flip_nonce = bswap_64(real_nonce);
 //		applog(LOG_WARNING, "real nonce = 0x%0llX, flip nonce = 0x%0llX", real_nonce, flip_nonce);
-		submit_nonce(thr, work, flip_nonce);
+		submit_nonce(thr, nonce_work, flip_nonce);
 	}
+nonce_done:
 	was_hw_error = (curr_hw_errors > icarus->hw_errors);
 
 	// TODO: check if this is still valid; applicable and functioning
@@ -1867,10 +2320,114 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 	return hash_count;
 }
 
+// Move work from the cgpu queue to the ready list, which is the board's
+// queue as far as hash_queued_work() is concerned
+static bool icarus_queue_full(struct cgpu_info *icarus)
+{
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+	struct work *work;
+
+	if (info->ready_count >= opt_icarus_queue)
+		return true;
+
+	work = get_queued(icarus);
+	if (work)
+		info->ready[info->ready_count++] = work;
+
+	return info->ready_count >= opt_icarus_queue;
+}
+
+static void icarus_current_done(struct ICARUS_INFO *info)
+{
+	if (info->current && !info->current_done) {
+		info->current_done = true;
+		cgtime(&info->idle_start);
+	}
+}
+
+// Drop the ready work and have the next scanwork write fresh work at once
+static void icarus_flush_work(struct cgpu_info *icarus)
+{
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+	int i;
+
+	for (i = 0; i < info->ready_count; i++)
+		work_completed(icarus, info->ready[i]);
+	info->ready_count = 0;
+
+	icarus_current_done(info);
+}
+
+// The oldest ready work that isn't stale
+static struct work *icarus_next_work(struct cgpu_info *icarus, struct ICARUS_INFO *info)
+{
+	struct work *work;
+
+	while (info->ready_count) {
+		work = info->ready[0];
+		info->ready_count--;
+		memmove(&info->ready[0], &info->ready[1], info->ready_count * sizeof(work));
+		if (!stale_work(work, false))
+			return work;
+		work_completed(icarus, work);
+	}
+
+	return NULL;
+}
+
+static int64_t icarus_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+	struct timeval now, elapsed;
+	struct work *work;
+	int64_t hashes;
+	double idle;
+
+	if (!info->current || info->current_done) {
+		work = icarus_next_work(icarus, info);
+		if (!work) {
+			// hash_queued_work() will fill the queue and call again
+			info->queue_empty++;
+			return 0;
+		}
+
+		if (info->current_done) {
+			cgtime(&now);
+			idle = tdiff(&now, &info->idle_start);
+			info->idle_total += idle;
+			if (idle > info->idle_max)
+				info->idle_max = idle;
+		}
+
+		work->blk.nonce = 0;
+		cgtime(&work->tv_work_start);
+		icarus_prepare_work(thr, work);
+		info->current = work;
+		info->current_done = false;
+	}
+
+	work = info->current;
+	hashes = icarus_scanhash(thr, work, 0);
+	if (unlikely(hashes < 0))
+		return hashes;
+
+	// The same reasons hash_sole_work() abandons work for, the nonce
+	// being set to the end of the range once the cores have been through it
+	cgtime(&now);
+	timersub(&now, &work->tv_work_start, &elapsed);
+	if (elapsed.tv_sec > opt_scantime || work->blk.nonce == 0xffffffff ||
+	    hashes >= 0xfffffffe || stale_work(work, false))
+		icarus_current_done(info);
+
+	return hashes;
+}
+
 static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 {
 	struct api_data *root = NULL;
 	struct ICARUS_INFO *info = icarus_info[cgpu->device_id];
+	struct timeval now;
 
 	// Warning, access to these is not locked - but we don't really
 	// care since hashing performance is way more important than
@@ -1892,6 +2449,39 @@ static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 	root = api_add_int(root, "baud", &(info->baud), false);
 	root = api_add_int(root, "work_division", &(info->work_division), false);
 	root = api_add_int(root, "fpga_count", &(info->fpga_count), false);
+	root = api_add_uint64(root, "nonces_recovered", &(info->nonces_recovered), false);
+	root = api_add_uint64(root, "nonces_dropped", &(info->nonces_dropped), false);
+	root = api_add_int(root, "work_queue", &(info->ready_count), false);
+	root = api_add_uint64(root, "works_written", &(info->works_written), false);
+	root = api_add_uint64(root, "queue_empty", &(info->queue_empty), false);
+	root = api_add_double(root, "idle_total", &(info->idle_total), false);
+	root = api_add_double(root, "idle_max", &(info->idle_max), false);
+
+	cgtime(&now);
+	for (int i = 0; i < info->expected_cores; i++) {
+		struct CORE_HISTORY *history = &info->core_history[i];
+		double mhs = history->ewma / 1000000.0;
+		double stddev = sqrt(history->ewma_var) / 1000000.0;
+		double idle = tv_secs(&now) - history->last_active;
+		bool enabled = (info->enabled_cores >> i) & 0x1;
+		char name[32];
+
+		sprintf(name, "core%d_mhs", i);
+		root = api_add_mhs(root, name, &mhs, true);
+		sprintf(name, "core%d_stddev", i);
+		root = api_add_mhs(root, name, &stddev, true);
+		sprintf(name, "core%d_idle", i);
+		root = api_add_double(root, name, &idle, true);
+		sprintf(name, "core%d_enabled", i);
+		root = api_add_bool(root, name, &enabled, true);
+	}
+#ifdef ICARUS_ASYNC_IO
+	root = api_add_uint64(root, "io_reads", &(info->io.reads), false);
+	root = api_add_uint64(root, "io_frames", &(info->io.frames_read), false);
+	root = api_add_uint64(root, "io_telemetry", &(info->io.telemetry), false);
+	root = api_add_uint64(root, "io_resyncs", &(info->io.resyncs), false);
+	root = api_add_uint64(root, "io_overruns", &(info->io.overruns), false);
+#endif
 
 	return root;
 }
@@ -1899,6 +2489,20 @@ static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 static void icarus_shutdown(struct thr_info *thr)
 {
 	do_icarus_close(thr);
+	icarus_flush_work(thr->cgpu);
+	inflight_clear(thr->cgpu, icarus_info[thr->cgpu->device_id]);
+}
+
+static void icarus_thread_restart(struct thr_info __maybe_unused *thr)
+{
+#ifdef ICARUS_ASYNC_IO
+	struct ICARUS_IO *io = &icarus_info[thr->cgpu->device_id]->io;
+
+	// Wake icarus_io_gets() to see work_restart
+	mutex_lock(&io->lock);
+	pthread_cond_signal(&io->cond);
+	mutex_unlock(&io->lock);
+#endif
 }
 // *** deke ***
 struct device_drv icarus_drv = {
@@ -1908,9 +2512,12 @@ struct device_drv icarus_drv = {
 	.drv_detect = icarus_detect,
 	.get_api_stats = icarus_api_stats,
 	.thread_prepare = icarus_prepare,
-	.scanhash = icarus_scanhash,
+	.hash_work = hash_queued_work,
+	.scanwork = icarus_scanwork,
+	.queue_full = icarus_queue_full,
+	.flush_work = icarus_flush_work,
 	.thread_shutdown = icarus_shutdown,
+	.thread_restart = icarus_thread_restart,
 	.get_statline = icarus_statline,
-	.prepare_work = icarus_prepare_work,
 };
 // *** /DM/ ***
@@ -0,0 +1,323 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* End to end benchmark for the Icarus driver
+ *
+ * Measures a running cgminer, usually mining on icarus-sim boards against
+ * stratum-sim, over a fixed window after a warm up. It reads the API at the
+ * start and end of the window and the CPU time of every cgminer thread from
+ * /proc, and reports:
+ *   nonces/s                  from Diff1 Work summed over 'devs'
+ *   shares/s                  from Accepted in 'summary'
+ *   MH/s                      from Total MH in 'summary'
+ *   found to submit latency   Submit Latency Avg/Max of each pool, the time
+ *                             from the nonce reaching cgminer to its
+ *                             mining.submit being written, since cgminer
+ *                             started
+ *   CPU %                     of each thread, of the threads working for
+ *                             all boards, and per board
+ *
+ * Compile:
+ *   gcc -O2 icarus-bench.c -o icarus-bench
+ *
+ * Run, e.g. for 8 boards:
+ *   ./stratum-sim -p 3334 -i 5000 &
+ *   ./icarus-sim -n 8 -l /tmp/vcu -r 175 &
+ *   ./cgminer -o stratum+tcp://127.0.0.1:3334 -u u -p x --api-listen \
+ *     -S /tmp/vcu0 ... -S /tmp/vcu7 --text-only &
+ *   ./icarus-bench -P $(pidof cgminer) -w 10 -t 60
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define MAXTHREADS 256
+
+static const char *host = "127.0.0.1";
+static const char *port = "4028";
+static int pid;
+static int warmup = 10;
+static int seconds = 60;
+
+struct thread_cpu {
+	int tid;
+	char name[32];
+	uint64_t ticks;
+};
+
+struct sample {
+	double when;
+	double diff1;
+	double accepted;
+	double mhs;
+	int nthreads;
+	struct thread_cpu threads[MAXTHREADS];
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send one JSON command and return the whole reply, which the API ends
+ * by closing the connection */
+static char *api(const char *command)
+{
+	struct addrinfo hints, *addr;
+	size_t len = 0, size = 65536;
+	char req[128], *buf;
+	ssize_t n;
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addr))
+		return NULL;
+	fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0 || connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		if (fd >= 0)
+			close(fd);
+		freeaddrinfo(addr);
+		return NULL;
+	}
+	freeaddrinfo(addr);
+
+	snprintf(req, sizeof(req), "{\"command\":\"%s\"}", command);
+	buf = malloc(size);
+	if (!buf || send(fd, req, strlen(req), 0) < 0) {
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	while ((n = recv(fd, buf + len, size - len - 1, 0)) > 0) {
+		len += n;
+		if (size - len < 1024) {
+			size *= 2;
+			buf = realloc(buf, size);
+			if (!buf)
+				break;
+		}
+	}
+	close(fd);
+	if (buf)
+		buf[len] = '\0';
+
+	return buf;
+}
+
+/* The number after the nth "key": in a reply, or -1 if there isn't one */
+static double json_num(const char *reply, const char *key, int nth)
+{
+	char pat[64];
+	const char *p = reply;
+
+	snprintf(pat, sizeof(pat), "\"%s\":", key);
+	while (p && (p = strstr(p, pat))) {
+		if (!nth--)
+			return strtod(p + strlen(pat), NULL);
+		p += strlen(pat);
+	}
+
+	return -1;
+}
+
+static int json_count(const char *reply, const char *key)
+{
+	int count = 0;
+
+	while (json_num(reply, key, count) >= 0)
+		count++;
+
+	return count;
+}
+
+static void read_threads(struct sample *s)
+{
+	char path[64], buf[512], *p;
+	struct dirent *de;
+	unsigned long utime, stime;
+	DIR *dir;
+	FILE *f;
+
+	s->nthreads = 0;
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) && s->nthreads < MAXTHREADS) {
+		struct thread_cpu *t = &s->threads[s->nthreads];
+
+		if (de->d_name[0] == '.')
+			continue;
+		t->tid = atoi(de->d_name);
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, t->tid);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		p = fgets(buf, sizeof(buf), f);
+		fclose(f);
+		if (!p || !(p = strchr(buf, '(')))
+			continue;
+		snprintf(t->name, sizeof(t->name), "%.*s", (int)(strrchr(buf, ')') - p - 1), p + 1);
+		p = strrchr(buf, ')');
+		/* utime and stime are the 12th and 13th fields after the name */
+		if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) != 2)
+			continue;
+		t->ticks = utime + stime;
+		s->nthreads++;
+	}
+	closedir(dir);
+}
+
+static bool take_sample(struct sample *s)
+{
+	char *reply;
+	int i;
+
+	reply = api("summary");
+	if (!reply)
+		return false;
+	s->when = now_secs();
+	s->accepted = json_num(reply, "Accepted", 0);
+	s->mhs = json_num(reply, "Total MH", 0);
+	free(reply);
+	read_threads(s);
+
+	reply = api("devs");
+	if (!reply)
+		return false;
+	s->diff1 = 0;
+	for (i = 0; json_num(reply, "Diff1 Work", i) >= 0; i++)
+		s->diff1 += json_num(reply, "Diff1 Work", i);
+	free(reply);
+
+	return true;
+}
+
+static uint64_t start_ticks(struct sample *start, int tid)
+{
+	int i;
+
+	for (i = 0; i < start->nthreads; i++) {
+		if (start->threads[i].tid == tid)
+			return start->threads[i].ticks;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -P pid [-h host] [-p port] [-w warmup] [-t seconds]\n"
+			"  -P  pid of the cgminer to measure\n"
+			"  -h  API host (default 127.0.0.1)\n"
+			"  -p  API port (default 4028)\n"
+			"  -w  seconds to wait before measuring (default 10)\n"
+			"  -t  seconds to measure (default 60)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct sample start, end;
+	double elapsed, hz, cpu, total = 0, miners = 0;
+	char *reply;
+	int boards, pools, i, opt;
+
+	while ((opt = getopt(argc, argv, "P:h:p:w:t:")) != -1) {
+		switch (opt) {
+			case 'P':
+				pid = atoi(optarg);
+				break;
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'w':
+				warmup = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (pid < 1 || warmup < 0 || seconds < 1)
+		usage(argv[0]);
+
+	/* Give a freshly started cgminer time to open the API */
+	sleep(warmup);
+	for (i = 0; i < 30 && !take_sample(&start); i++)
+		sleep(1);
+	if (i == 30) {
+		fprintf(stderr, "Can't reach the API on %s:%s\n", host, port);
+		return 1;
+	}
+	sleep(seconds);
+	if (!take_sample(&end)) {
+		fprintf(stderr, "Lost the API on %s:%s\n", host, port);
+		return 1;
+	}
+	elapsed = end.when - start.when;
+	hz = sysconf(_SC_CLK_TCK);
+
+	reply = api("devs");
+	boards = reply ? json_count(reply, "PGA") : 0;
+	free(reply);
+	if (boards < 1)
+		boards = 1;
+
+	printf("%d boards for %.1fs\n", boards, elapsed);
+	printf("nonces/s %.2f  shares/s %.2f  MH/s %.2f\n",
+		(end.diff1 - start.diff1) / elapsed,
+		(end.accepted - start.accepted) / elapsed,
+		(end.mhs - start.mhs) / elapsed);
+
+	reply = api("pools");
+	pools = reply ? json_count(reply, "POOL") : 0;
+	for (i = 0; i < pools; i++) {
+		printf("pool %d found to submit latency avg %.6fs max %.6fs\n", i,
+			json_num(reply, "Submit Latency Avg", i),
+			json_num(reply, "Submit Latency Max", i));
+	}
+	free(reply);
+
+	printf("CPU %% by thread:\n");
+	for (i = 0; i < end.nthreads; i++) {
+		struct thread_cpu *t = &end.threads[i];
+
+		cpu = (t->ticks - start_ticks(&start, t->tid)) / hz / elapsed * 100;
+		total += cpu;
+		if (!strncmp(t->name, "miner/", 6))
+			miners += cpu;
+		if (cpu >= 0.05)
+			printf("  %-16s %6.1f\n", t->name, cpu);
+	}
+	printf("CPU %% total %.1f  per board %.2f  (mining threads %.2f per board)\n",
+		total, total / boards, miners / boards);
+
+	return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Pseudo-terminal simulator for the VCU1525/FK33 Icarus protocol
+ *
+ * Each simulated board is a pty that cgminer can open with -S, it accepts
+ * the 175 byte work write and the PLL command, answers the detect probe and
+ * returns 17 byte 0x01 nonce, 0xbb counter and 0xaa telemetry frames the
+ * same as the bitstream does. Nonces are found with a real BLAKE3 search so
+ * a reply with the default 32 zero bits will pass cgminer's verify thread.
+ *
+ * Compile:
+ *   gcc -O2 icarus-sim.c blake3/blake3.c blake3/blake3_dispatch.c \
+ *     blake3/blake3_portable.c -DBLAKE3_NO_SSE2 -DBLAKE3_NO_SSE41 \
+ *     -DBLAKE3_NO_AVX2 -DBLAKE3_NO_AVX512 -lpthread -o icarus-sim
+ *
+ * Run:
+ *   ./icarus-sim -n 4 -l /tmp/vcu
+ *   cgminer -S /tmp/vcu0 -S /tmp/vcu1 -S /tmp/vcu2 -S /tmp/vcu3 ...
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "blake3/blake3.h"
+
+#define WORK_SIZE 175
+#define REPLY_SIZE 17
+#define HEADER_SIZE 180
+#define MAX_BOARDS 256
+#define MAX_CORES 32
+// Nonces hashed on one core before looking at the pty again
+#define HASH_BATCH 1024
+
+static int opt_boards = 1;
+static int opt_cores = 9;
+static int opt_bits = 32;
+static double opt_rate;
+static int opt_counter_ms = 1000;
+static int opt_telemetry_s = 5;
+static char *opt_link;
+static int opt_drain_ms;
+static bool opt_verbose;
+
+struct board {
+	int id;
+	int master;
+	int slave;
+	char path[64];
+	pthread_t pth;
+
+	unsigned char rx[WORK_SIZE * 2];
+	size_t rx_len;
+
+	unsigned char header[HEADER_SIZE];
+	bool have_work;
+	uint32_t progress[MAX_CORES];
+	// Work being replaced, hashed until drain_until like the bitstream
+	// pipeline finishing it after a new write
+	unsigned char prev_header[HEADER_SIZE];
+	uint32_t prev_progress[MAX_CORES];
+	struct timeval drain_until;
+	int core;
+	int clock;
+
+	uint64_t works;
+	uint64_t hashes;
+	uint64_t nonces;
+	uint64_t counters;
+	struct timeval work_start;
+	uint64_t work_hashes;
+};
+
+static struct board boards[MAX_BOARDS];
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double tdiff(struct timeval *end, struct timeval *start)
+{
+	return (double)(end->tv_sec - start->tv_sec) +
+	       (double)(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static bool write_reply(struct board *b, const unsigned char *reply)
+{
+	ssize_t ret;
+	size_t off = 0;
+
+	while (off < REPLY_SIZE) {
+		ret = write(b->master, reply + off, REPLY_SIZE - off);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return false;
+		}
+		off += ret;
+	}
+
+	return true;
+}
+
+static void frame_head(struct board *b, unsigned char *reply, unsigned char type, int core)
+{
+	memset(reply, 0, REPLY_SIZE);
+	reply[0] = type;
+	memcpy(&reply[9], b->header, 3);
+	reply[12] = core;
+}
+
+static void put_be32(unsigned char *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void send_counter(struct board *b, int core)
+{
+	unsigned char reply[REPLY_SIZE];
+
+	frame_head(b, reply, 0xbb, core);
+	reply[1] = opt_cores;
+	put_be32(&reply[13], b->progress[core]);
+	write_reply(b, reply);
+	b->counters++;
+}
+
+static void send_nonce(struct board *b, const unsigned char *header, int core, uint32_t nonce)
+{
+	unsigned char reply[REPLY_SIZE];
+	struct timeval now;
+
+	frame_head(b, reply, 0x01, core);
+	memcpy(&reply[9], header, 3);
+	put_be32(&reply[13], nonce);
+	write_reply(b, reply);
+	b->nonces++;
+
+	if (opt_verbose) {
+		gettimeofday(&now, NULL);
+		pthread_mutex_lock(&out_lock);
+		printf("nonce,%d,%d,%02x%02x%02x%02x%08x,%ld.%06ld\n",
+			b->id, core, header[0], header[1], header[2],
+			core, nonce, (long)now.tv_sec, (long)now.tv_usec);
+		fflush(stdout);
+		pthread_mutex_unlock(&out_lock);
+	}
+}
+
+// Raw sensor values are the inverse of the driver's conversion
+static void send_telemetry(struct board *b)
+{
+	unsigned char reply[REPLY_SIZE];
+	unsigned int volt = 850 * 65536 / 3000;
+	unsigned int temp = (unsigned int)((55.0 + b->id % 10 + 280.2308787) * 65536 / 509.3140064);
+	int i;
+
+	memset(reply, 0, REPLY_SIZE);
+	reply[0] = 0xaa;
+	for (i = 0; i < 3; i++) {
+		reply[1 + i * 2] = volt >> 8;
+		reply[2 + i * 2] = volt;
+		reply[9 + i * 2] = temp >> 8;
+		reply[10 + i * 2] = temp;
+	}
+	write_reply(b, reply);
+}
+
+static void new_frame(struct board *b, const unsigned char *frame)
+{
+	unsigned char reply[REPLY_SIZE];
+	int i;
+
+	// PLL command from cairnsmore_send_cmd()
+	if (frame[0] == 0xaa && frame[1] == 0xaa && frame[2] == 0xaa && frame[3] == 0xaa &&
+	    frame[12] == 0xbb && frame[13] == 0xbb && frame[14] == 0xbb && frame[15] == 0xbb) {
+		b->clock = (frame[4] << 8) | frame[5];
+		return;
+	}
+
+	// The detect probe is all zero and expects a counter back at once
+	for (i = 0; i < WORK_SIZE; i++)
+		if (frame[i])
+			break;
+	if (i == WORK_SIZE) {
+		frame_head(b, reply, 0xbb, 0);
+		reply[1] = opt_cores;
+		write_reply(b, reply);
+		return;
+	}
+
+	if (opt_drain_ms && b->have_work) {
+		memcpy(b->prev_header, b->header, sizeof(b->prev_header));
+		memcpy(b->prev_progress, b->progress, sizeof(b->prev_progress));
+		gettimeofday(&b->drain_until, NULL);
+		b->drain_until.tv_usec += opt_drain_ms * 1000;
+		b->drain_until.tv_sec += b->drain_until.tv_usec / 1000000;
+		b->drain_until.tv_usec %= 1000000;
+	}
+
+	// Work is header bytes 0-2 then 8-179, bytes 3-7 are the core and nonce
+	memset(b->header, 0, sizeof(b->header));
+	memcpy(b->header, frame, 3);
+	memcpy(&b->header[8], &frame[3], WORK_SIZE - 3);
+	memset(b->progress, 0, sizeof(b->progress));
+	b->core = 0;
+	b->have_work = true;
+	b->works++;
+	gettimeofday(&b->work_start, NULL);
+	b->work_hashes = 0;
+}
+
+static bool leading_zero_bits(const unsigned char *hash, int bits)
+{
+	int i;
+
+	for (i = 0; i < bits / 8; i++)
+		if (hash[i])
+			return false;
+	if (bits % 8 && (hash[i] >> (8 - bits % 8)))
+		return false;
+
+	return true;
+}
+
+static void hash_batch(struct board *b)
+{
+	unsigned char buf[HEADER_SIZE], hash[BLAKE3_OUT_LEN];
+	unsigned char *header = b->header;
+	uint32_t *progress = b->progress;
+	blake3_hasher hasher;
+	int core = b->core;
+	struct timeval now;
+	uint32_t nonce;
+	int i;
+
+	if (opt_drain_ms) {
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &b->drain_until, <)) {
+			header = b->prev_header;
+			progress = b->prev_progress;
+		}
+	}
+
+	memcpy(buf, header, sizeof(buf));
+	buf[3] = core;
+	for (i = 0; i < HASH_BATCH; i++) {
+		nonce = progress[core]++;
+		put_be32(&buf[4], nonce);
+
+		blake3_hasher_init(&hasher);
+		blake3_hasher_update(&hasher, buf, sizeof(buf));
+		blake3_hasher_finalize(&hasher, hash, sizeof(hash));
+
+		if (leading_zero_bits(hash, opt_bits))
+			send_nonce(b, header, core, nonce);
+	}
+	b->hashes += HASH_BATCH;
+	b->work_hashes += HASH_BATCH;
+
+	if (++b->core >= opt_cores)
+		b->core = 0;
+}
+
+static void *board_thread(void *userdata)
+{
+	struct board *b = userdata;
+	struct timeval now, last_counter, last_telemetry;
+	struct pollfd pfd;
+	ssize_t ret;
+	int core, timeout;
+	double ahead;
+
+	gettimeofday(&last_counter, NULL);
+	last_telemetry = last_counter;
+
+	while (42) {
+		pfd.fd = b->master;
+		pfd.events = POLLIN;
+		timeout = b->have_work ? 0 : 100;
+		if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+			ret = read(b->master, b->rx + b->rx_len, sizeof(b->rx) - b->rx_len);
+			if (ret > 0) {
+				b->rx_len += ret;
+				while (b->rx_len >= WORK_SIZE) {
+					new_frame(b, b->rx);
+					b->rx_len -= WORK_SIZE;
+					memmove(b->rx, b->rx + WORK_SIZE, b->rx_len);
+				}
+			}
+		}
+
+		if (b->have_work)
+			hash_batch(b);
+
+		gettimeofday(&now, NULL);
+
+		// Hold each core to the requested rate
+		if (b->have_work && opt_rate > 0) {
+			ahead = (double)b->work_hashes / (opt_rate * 1000000.0 * opt_cores) -
+				tdiff(&now, &b->work_start);
+			if (ahead > 0.001)
+				usleep((useconds_t)(ahead * 1000000.0));
+		}
+
+		if (b->have_work && tdiff(&now, &last_counter) * 1000.0 >= opt_counter_ms) {
+			for (core = 0; core < opt_cores; core++)
+				send_counter(b, core);
+			last_counter = now;
+		}
+
+		if (opt_telemetry_s > 0 && tdiff(&now, &last_telemetry) >= opt_telemetry_s) {
+			send_telemetry(b);
+			last_telemetry = now;
+		}
+	}
+
+	return NULL;
+}
+
+static bool open_board(struct board *b)
+{
+	struct termios tio;
+	char link[256];
+	char *name;
+
+	b->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (b->master < 0 || grantpt(b->master) || unlockpt(b->master))
+		return false;
+
+	name = ptsname(b->master);
+	if (!name)
+		return false;
+	snprintf(b->path, sizeof(b->path), "%s", name);
+
+	// Keep a slave open so the pty survives cgminer closing and
+	// reopening the device, and start it raw
+	b->slave = open(b->path, O_RDWR | O_NOCTTY);
+	if (b->slave < 0)
+		return false;
+	tcgetattr(b->slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(b->slave, TCSANOW, &tio);
+
+	if (opt_link) {
+		snprintf(link, sizeof(link), "%s%d", opt_link, b->id);
+		unlink(link);
+		if (symlink(b->path, link)) {
+			fprintf(stderr, "Failed to link %s to %s\n", link, b->path);
+			return false;
+		}
+		printf("board %d: %s -> %s\n", b->id, link, b->path);
+	} else
+		printf("board %d: %s\n", b->id, b->path);
+
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -n <boards>    Number of boards to simulate (default 1)\n"
+		"  -c <cores>     Cores per board (default 9)\n"
+		"  -b <bits>      Leading zero hash bits for a nonce reply (default 32)\n"
+		"  -r <MH/s>      Limit each core to this hash rate (default unlimited)\n"
+		"  -i <ms>        Counter frame interval (default 1000)\n"
+		"  -t <seconds>   Telemetry frame interval, 0 for none (default 5)\n"
+		"  -d <ms>        Keep hashing the previous work this long after a new write\n"
+		"  -l <prefix>    Symlink each board's pty to <prefix>N\n"
+		"  -v             Print every nonce sent with its timestamp\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct timeval start, now;
+	uint64_t hashes, nonces, works;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n:c:b:r:i:t:d:l:v")) != -1) {
+		switch (c) {
+			case 'n':
+				opt_boards = atoi(optarg);
+				break;
+			case 'c':
+				opt_cores = atoi(optarg);
+				break;
+			case 'b':
+				opt_bits = atoi(optarg);
+				break;
+			case 'r':
+				opt_rate = atof(optarg);
+				break;
+			case 'i':
+				opt_counter_ms = atoi(optarg);
+				break;
+			case 't':
+				opt_telemetry_s = atoi(optarg);
+				break;
+			case 'd':
+				opt_drain_ms = atoi(optarg);
+				break;
+			case 'l':
+				opt_link = optarg;
+				break;
+			case 'v':
+				opt_verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (opt_boards < 1 || opt_boards > MAX_BOARDS ||
+	    opt_cores < 1 || opt_cores > MAX_CORES ||
+	    opt_bits < 0 || opt_bits > 256 || opt_counter_ms < 1 || opt_drain_ms < 0)
+		usage(argv[0]);
+
+	if (opt_bits < 32)
+		fprintf(stderr, "Nonces with fewer than 32 zero bits will be HW errors in cgminer\n");
+	if (opt_cores < 9)
+		fprintf(stderr, "Fewer than 9 cores makes cgminer drop the work prefix from nonces\n");
+
+	for (i = 0; i < opt_boards; i++) {
+		boards[i].id = i;
+		if (!open_board(&boards[i])) {
+			fprintf(stderr, "Failed to open pty for board %d: %s\n", i, strerror(errno));
+			return 1;
+		}
+	}
+	fflush(stdout);
+
+	for (i = 0; i < opt_boards; i++) {
+		if (pthread_create(&boards[i].pth, NULL, board_thread, &boards[i])) {
+			fprintf(stderr, "Failed to start board %d\n", i);
+			return 1;
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	while (42) {
+		sleep(10);
+		gettimeofday(&now, NULL);
+		hashes = nonces = works = 0;
+		for (i = 0; i < opt_boards; i++) {
+			hashes += boards[i].hashes;
+			nonces += boards[i].nonces;
+			works += boards[i].works;
+		}
+		pthread_mutex_lock(&out_lock);
+		fprintf(stderr, "%.0fs: %d boards %.3f MH/s works %llu nonces %llu\n",
+			tdiff(&now, &start), opt_boards,
+			(double)hashes / tdiff(&now, &start) / 1000000.0,
+			(unsigned long long)works, (unsigned long long)nonces);
+		pthread_mutex_unlock(&out_lock);
+	}
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Converts cgminer --share-journal files to CSV or JSON
+ *
+ * Each file given is read in turn, so a rotated set can be dumped oldest
+ * first with e.g. shares.jrn.2 shares.jrn.1 shares.jrn
+ *
+ * Compile:
+ *   gcc -O2 journal-dump.c -o journal-dump
+ *
+ * Run:
+ *   ./journal-dump shares.jrn > shares.csv
+ *   ./journal-dump -j shares.jrn > shares.json
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <endian.h>
+
+#define JOURNAL_READER
+#include "journal.h"
+
+static bool json;
+static bool first = true;
+
+static const char *disposition_str(int disposition)
+{
+	switch (disposition) {
+		case JOURNAL_ACCEPT:
+			return "accept";
+		case JOURNAL_REJECT:
+			return "reject";
+		case JOURNAL_DISCARD:
+			return "discard";
+		default:
+			return "unknown";
+	}
+}
+
+static void print_record(struct journal_record *rec)
+{
+	uint64_t time_us = le64toh(rec->time_us);
+	char device[sizeof(rec->device) + 1];
+	char job_id[sizeof(rec->job_id) + 1];
+	char *c;
+
+	memcpy(device, rec->device, sizeof(rec->device));
+	device[sizeof(rec->device)] = '\0';
+	memcpy(job_id, rec->job_id, sizeof(rec->job_id));
+	job_id[sizeof(rec->job_id)] = '\0';
+	/* Nothing cgminer writes needs quoting, but keep the output valid
+	 * whatever is in the file */
+	for (c = job_id; *c; c++)
+		if (*c == '"' || *c == '\\' || *c == ',' || (unsigned char)*c < ' ')
+			*c = '_';
+
+	if (json) {
+		printf("%s{\"time\":%" PRIu64 ".%06" PRIu64 ",\"disposition\":\"%s\","
+		       "\"pool\":%u,\"device\":\"%s%u\",\"thread\":%u,\"core\":%u,"
+		       "\"job_id\":\"%s\",\"nonce\":\"%016" PRIx64 "\","
+		       "\"share_diff\":%.0f,\"work_diff\":%g}",
+		       first ? "[\n" : ",\n",
+		       time_us / 1000000, time_us % 1000000, disposition_str(rec->disposition),
+		       le16toh(rec->pool), device, le16toh(rec->device_id), le16toh(rec->thr_id),
+		       rec->core, job_id, le64toh(rec->nonce), journal_double(rec->share_diff),
+		       journal_double(rec->work_diff));
+	} else {
+		if (first)
+			printf("time,disposition,pool,device,thread,core,job_id,nonce,share_diff,work_diff\n");
+		printf("%" PRIu64 ".%06" PRIu64 ",%s,%u,%s%u,%u,%u,%s,%016" PRIx64 ",%.0f,%g\n",
+		       time_us / 1000000, time_us % 1000000, disposition_str(rec->disposition),
+		       le16toh(rec->pool), device, le16toh(rec->device_id), le16toh(rec->thr_id),
+		       rec->core, job_id, le64toh(rec->nonce), journal_double(rec->share_diff),
+		       journal_double(rec->work_diff));
+	}
+	first = false;
+}
+
+static int dump_file(const char *path)
+{
+	struct journal_header hdr;
+	struct journal_record rec;
+	uint64_t i, capacity;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+	    le32toh(hdr.version) != JOURNAL_VERSION ||
+	    le32toh(hdr.record_size) != sizeof(struct journal_record)) {
+		fprintf(stderr, "%s: not a version %d share journal\n", path, JOURNAL_VERSION);
+		fclose(f);
+		return 1;
+	}
+
+	/* The header count may lag a crash, the first unwritten record
+	 * marks the real end */
+	capacity = le64toh(hdr.capacity);
+	for (i = 0; i < capacity; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1 || !rec.time_us)
+			break;
+		print_record(&rec);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-j] journal...\n"
+						"  -j  output JSON instead of CSV\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-j] journal...\n", argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++)
+		ret |= dump_file(argv[i]);
+
+	if (json)
+		printf("%s]\n", first ? "[" : "\n");
+
+	return ret;
+}
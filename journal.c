@@ -0,0 +1,341 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "miner.h"
+#include "journal.h"
+
+char *opt_share_journal;
+/* Size of each journal file in MB */
+int opt_share_journal_size = 16;
+
+#ifndef WIN32
+/* Shares are copied into the mapped file under journal_lock, which only
+ * costs a memcpy on the submit path. The flusher thread updates the header
+ * count and schedules the dirty pages for writeback once a second, and the
+ * kernel writes the pages out if we die before then.
+ *
+ * The flusher also keeps a spare file, preallocated and mapped as .next, so
+ * a full journal is swapped for it under the lock and the syncing, renaming
+ * and preallocation of the next spare all happen on the flusher thread. */
+struct journal_file {
+	int fd;
+	struct journal_header *map;
+	struct journal_record *recs;
+	size_t len;
+	uint64_t capacity;
+	uint64_t count;
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t journal_pth;
+static bool journal_running;
+static bool journal_quit;
+
+static char *journal_path;
+static char *journal_next_path;
+/* The file being written, the spare and a full one waiting to be rotated */
+static struct journal_file journal_cur, journal_next, journal_full;
+static uint64_t journal_flushed;
+static uint64_t journal_dropped;
+
+static void journal_unmap(struct journal_file *jf)
+{
+	if (!jf->map)
+		return;
+
+	jf->map->count = htole64(jf->count);
+	msync(jf->map, jf->len, MS_SYNC);
+	munmap(jf->map, jf->len);
+	close(jf->fd);
+	jf->map = NULL;
+	jf->recs = NULL;
+	jf->fd = -1;
+}
+
+/* Opens the journal at path, creating it at the configured size or
+ * carrying on after the last record of an existing one */
+static bool journal_map_file(const char *path, struct journal_file *jf)
+{
+	struct journal_header hdr;
+	struct stat st;
+	uint64_t capacity, count;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		applog(LOG_ERR, "Failed to open share journal %s: %s", path, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &st))
+		goto out_err;
+
+	if (!st.st_size) {
+		capacity = (uint64_t)opt_share_journal_size * 1024 * 1024 / sizeof(struct journal_record);
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+		hdr.version = htole32(JOURNAL_VERSION);
+		hdr.record_size = htole32(sizeof(struct journal_record));
+		hdr.capacity = htole64(capacity);
+		hdr.created_us = htole64((uint64_t)time(NULL) * 1000000);
+		if (ftruncate(fd, sizeof(hdr) + capacity * sizeof(struct journal_record)) ||
+		    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto out_err;
+	} else {
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+		    le32toh(hdr.version) != JOURNAL_VERSION ||
+		    le32toh(hdr.record_size) != sizeof(struct journal_record) ||
+		    (uint64_t)st.st_size != sizeof(hdr) + le64toh(hdr.capacity) * sizeof(struct journal_record)) {
+			applog(LOG_ERR, "%s is not a share journal, not overwriting it", path);
+			close(fd);
+			return false;
+		}
+		capacity = le64toh(hdr.capacity);
+	}
+
+	jf->len = sizeof(hdr) + capacity * sizeof(struct journal_record);
+	map = mmap(NULL, jf->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out_err;
+
+	jf->fd = fd;
+	jf->map = map;
+	jf->recs = (struct journal_record *)(jf->map + 1);
+	jf->capacity = capacity;
+
+	/* Records past the flushed count may have made it to the file */
+	count = le64toh(jf->map->count);
+	while (count < capacity && jf->recs[count].time_us)
+		count++;
+	jf->count = count;
+
+	applog(LOG_INFO, "Share journal %s has %"PRIu64" of %"PRIu64" records",
+	       path, count, capacity);
+	return true;
+
+out_err:
+	applog(LOG_ERR, "Failed to set up share journal %s: %s", path, strerror(errno));
+	close(fd);
+	return false;
+}
+
+/* Sync and close the full journal, move it to .1, shifting older ones up
+ * and dropping the oldest, then give its name to the spare that replaced
+ * it. Called on the flusher thread without journal_lock. */
+static void journal_rotate(struct journal_file *full)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+
+	journal_unmap(full);
+
+	for (i = JOURNAL_KEEP; i > 0; i--) {
+		if (i > 1)
+			snprintf(from, sizeof(from), "%s.%d", journal_path, i - 1);
+		else
+			snprintf(from, sizeof(from), "%s", journal_path);
+		snprintf(to, sizeof(to), "%s.%d", journal_path, i);
+		if (rename(from, to) && errno != ENOENT)
+			applog(LOG_WARNING, "Failed to rotate share journal %s to %s: %s",
+			       from, to, strerror(errno));
+	}
+
+	if (rename(journal_next_path, journal_path))
+		applog(LOG_WARNING, "Failed to rename share journal %s to %s: %s",
+		       journal_next_path, journal_path, strerror(errno));
+}
+
+static void *journal_thread(void __maybe_unused *userdata)
+{
+	struct journal_file full;
+	time_t next_try = 0;
+
+	RenameThread("journal");
+
+	mutex_lock(&journal_lock);
+	while (!journal_quit) {
+		struct journal_file next;
+		struct timespec abstime;
+		struct timeval now;
+		bool need_next;
+
+		/* Rotate a full journal and make a new spare with the lock
+		 * dropped. No journal can fill meanwhile since the spare
+		 * is gone until this puts one back. A spare that fails is
+		 * tried again a minute later. */
+		full = journal_full;
+		journal_full.map = NULL;
+		need_next = !journal_next.map && journal_cur.map && time(NULL) >= next_try;
+		if (full.map || need_next) {
+			mutex_unlock(&journal_lock);
+			if (full.map)
+				journal_rotate(&full);
+			next.map = NULL;
+			if (need_next && !journal_map_file(journal_next_path, &next)) {
+				applog(LOG_WARNING, "No spare share journal, shares will be dropped when %s fills",
+				       journal_path);
+				next_try = time(NULL) + 60;
+			}
+			mutex_lock(&journal_lock);
+			if (next.map)
+				journal_next = next;
+		}
+
+		if (journal_cur.map && journal_flushed != journal_cur.count) {
+			journal_cur.map->count = htole64(journal_cur.count);
+			msync(journal_cur.map, journal_cur.len, MS_ASYNC);
+			journal_flushed = journal_cur.count;
+		}
+
+		cgtime(&now);
+		abstime.tv_sec = now.tv_sec + 1;
+		abstime.tv_nsec = now.tv_usec * 1000;
+		pthread_cond_timedwait(&journal_cond, &journal_lock, &abstime);
+	}
+	/* Finish a rotation the last shares started */
+	if (journal_full.map) {
+		full = journal_full;
+		journal_full.map = NULL;
+		journal_rotate(&full);
+	}
+	mutex_unlock(&journal_lock);
+
+	return NULL;
+}
+
+bool journal_open(const char *path)
+{
+	journal_path = strdup(path);
+	if (unlikely(!journal_path))
+		quit(1, "Failed to strdup journal_path");
+	if (unlikely(asprintf(&journal_next_path, "%s.next", path) < 0))
+		quit(1, "Failed to asprintf journal_next_path");
+
+	if (!journal_map_file(journal_path, &journal_cur))
+		return false;
+	journal_flushed = journal_cur.count;
+	/* The flusher keeps trying if there's no spare yet */
+	journal_map_file(journal_next_path, &journal_next);
+
+	if (unlikely(pthread_create(&journal_pth, NULL, journal_thread, NULL)))
+		quit(1, "Failed to create journal thread");
+	journal_running = true;
+
+	return true;
+}
+
+void journal_share(enum journal_disposition disposition, const struct work *work)
+{
+	struct journal_record rec;
+	struct thr_info *thr;
+	struct cgpu_info *cgpu;
+
+	if (!__atomic_load_n(&journal_running, __ATOMIC_ACQUIRE))
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time_us = (uint64_t)work->tv_work_found.tv_sec * 1000000 + work->tv_work_found.tv_usec;
+	if (unlikely(!rec.time_us)) {
+		struct timeval now;
+
+		cgtime(&now);
+		rec.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	}
+	rec.time_us = htole64(rec.time_us);
+	rec.nonce = htole64(work->res_nonce);
+	rec.share_diff = journal_le_double(work->share_diff);
+	rec.work_diff = journal_le_double(work->work_difficulty);
+	rec.pool = htole16(work->pool->pool_no);
+	rec.thr_id = htole16(work->thr_id);
+	rec.core = (work->res_nonce >> 24) & 0xff;
+	rec.disposition = disposition;
+	thr = work->thr ? work->thr : get_thread(work->thr_id);
+	cgpu = thr ? thr->cgpu : NULL;
+	if (cgpu) {
+		rec.device_id = htole16(cgpu->device_id);
+		strncpy(rec.device, cgpu->drv->name, sizeof(rec.device));
+	}
+	if (work->job_id)
+		strncpy(rec.job_id, work->job_id, sizeof(rec.job_id));
+
+	mutex_lock(&journal_lock);
+	/* Swap a full journal for the spare and leave the rotation to the
+	 * flusher */
+	if (journal_cur.count == journal_cur.capacity && journal_next.map && !journal_full.map) {
+		journal_full = journal_cur;
+		journal_cur = journal_next;
+		journal_next.map = NULL;
+		journal_flushed = journal_cur.count;
+		pthread_cond_signal(&journal_cond);
+	}
+	if (likely(journal_cur.map && journal_cur.count < journal_cur.capacity))
+		memcpy(&journal_cur.recs[journal_cur.count++], &rec, sizeof(rec));
+	else if (!journal_dropped++)
+		applog(LOG_WARNING, "Share journal %s is full with no spare, dropping shares",
+		       journal_path);
+	mutex_unlock(&journal_lock);
+}
+
+/* Flush and close the journal. Safe to call more than once. */
+void journal_close(void)
+{
+	if (!__atomic_exchange_n(&journal_running, false, __ATOMIC_ACQ_REL))
+		return;
+
+	mutex_lock(&journal_lock);
+	journal_quit = true;
+	pthread_cond_signal(&journal_cond);
+	mutex_unlock(&journal_lock);
+	pthread_join(journal_pth, NULL);
+
+	mutex_lock(&journal_lock);
+	journal_unmap(&journal_cur);
+	/* An unused spare is made again on the next start */
+	if (journal_next.map) {
+		bool unused = !journal_next.count;
+
+		journal_unmap(&journal_next);
+		if (unused)
+			unlink(journal_next_path);
+	}
+	if (journal_dropped)
+		applog(LOG_WARNING, "Share journal dropped %"PRIu64" shares", journal_dropped);
+	mutex_unlock(&journal_lock);
+}
+#else /* WIN32 */
+bool journal_open(const char __maybe_unused *path)
+{
+	applog(LOG_ERR, "The share journal is not available on windows");
+	return false;
+}
+
+void journal_share(enum journal_disposition __maybe_unused disposition,
+		   const struct work __maybe_unused *work)
+{
+}
+
+void journal_close(void)
+{
+}
+#endif
@@ -0,0 +1,83 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Binary share journal
+ *
+ * A journal file is a 64 byte header followed by fixed 64 byte records,
+ * preallocated to its full size and written through a shared mapping. All
+ * values are little endian, the doubles as the bits of an IEEE 754 double.
+ * A record with a zero time has never been written, so a reader can find
+ * the end even if the header count wasn't flushed before a crash. When a
+ * file fills writing carries on in a spare file prepared as .next, and the
+ * full one is rotated to .1, .2 ... journal-dump.c converts a journal to
+ * CSV or JSON.
+ */
+
+#define JOURNAL_MAGIC		"CGSHJRN1"
+#define JOURNAL_VERSION		1
+#define JOURNAL_KEEP		8
+
+enum journal_disposition {
+	JOURNAL_ACCEPT = 1,
+	JOURNAL_REJECT,
+	JOURNAL_DISCARD,
+};
+
+struct journal_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;
+	uint64_t	capacity;	/* records the file has room for */
+	uint64_t	count;		/* records written, as of the last flush */
+	uint64_t	created_us;
+	uint8_t		reserved[24];
+};
+
+struct journal_record {
+	uint64_t	time_us;	/* nonce found, microseconds since the epoch */
+	uint64_t	nonce;
+	uint64_t	share_diff;	/* double, see journal_double() */
+	uint64_t	work_diff;
+	uint16_t	pool;
+	uint16_t	device_id;
+	char		device[4];	/* driver name, not null terminated */
+	uint16_t	thr_id;
+	uint8_t		core;		/* top byte of the nonce's low word */
+	uint8_t		disposition;
+	char		job_id[20];	/* not null terminated if 20 long */
+};
+
+/* Doubles are stored as their bit pattern in little endian order */
+static inline uint64_t journal_le_double(double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	return htole64(u);
+}
+
+static inline double journal_double(uint64_t le)
+{
+	uint64_t u = le64toh(le);
+	double d;
+
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+#ifndef JOURNAL_READER
+struct work;
+
+extern char *opt_share_journal;
+extern int opt_share_journal_size;
+
+extern bool journal_open(const char *path);
+extern void journal_share(enum journal_disposition disposition, const struct work *work);
+extern void journal_close(void);
+#endif
+
+#endif /* __JOURNAL_H__ */
@@ -9,6 +9,9 @@
 
 #include "config.h"
 
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "logging.h"
@@ -21,36 +24,227 @@ bool opt_log_output = false;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
-static void my_log_curses(__maybe_unused int prio, char *f, va_list ap)
+/* Most messages allowed per second, 0 for no limit */
+int opt_log_rate;
+
+/* Once logging_start() has run applog() only formats the message into a
+ * preallocated record and queues it. The writer thread does the time
+ * formatting, stderr, syslog and curses output, so mining and stratum
+ * threads never block on the console. Before the writer starts and after
+ * logging_stop() messages are written directly as they always were. */
+#define LOG_RECORDS 1024
+#define LOG_MSG_LEN 256
+
+struct log_rec {
+	int prio;
+	time_t when;
+	/* Messages too long for msg are allocated */
+	char *big;
+	char msg[LOG_MSG_LEN];
+};
+
+struct log_time {
+	time_t sec;
+	char buf[32];
+};
+
+static struct log_rec *log_recs;
+static struct lfq *log_free, *log_pending;
+static bool log_async;
+static bool log_quit;
+static int log_users;
+static bool log_sleeping;
+static pthread_t log_pth;
+static pthread_mutex_t log_lock;
+static pthread_cond_t log_cond;
+
+static struct log_stats log_stats;
+static time_t log_window;
+static int log_window_count;
+static int log_window_limited;
+
+/* Format the time once per second rather than once per message */
+static const char *log_timestamp(struct log_time *lt, time_t when)
+{
+	if (when != lt->sec) {
+		struct tm tm;
+
+		localtime_r(&when, &tm);
+		sprintf(lt->buf, " [%d-%02d-%02d %02d:%02d:%02d] ",
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min,
+			tm.tm_sec);
+		lt->sec = when;
+	}
+	return lt->buf;
+}
+
+#ifdef HAVE_CURSES
+static bool log_curses_str(int prio, const char *f, ...)
+{
+	va_list ap;
+	bool ret;
+
+	va_start(ap, f);
+	ret = log_curses_only(prio, f, ap);
+	va_end(ap);
+
+	return ret;
+}
+#endif
+
+static void my_log_curses(__maybe_unused int prio, const char *ts, const char *msg)
 {
 	if (opt_quiet && prio != LOG_ERR)
 		return;
 
 #ifdef HAVE_CURSES
 	extern bool use_curses;
-	if (use_curses && log_curses_only(prio, f, ap))
+	if (use_curses && log_curses_str(prio, "%s%s\n", ts, msg))
 		;
 	else
 #endif
 	{
-		int len = strlen(f);
-
-		strcpy(f + len - 1, "                    \n");
-
 		mutex_lock(&console_lock);
-		vprintf(f, ap);
+		printf("%s%s                    \n", ts, msg);
 		mutex_unlock(&console_lock);
 	}
 }
 
-static void log_generic(int prio, const char *fmt, va_list ap);
+/*
+ * generic log function used by priority specific ones
+ * equals vapplog() without additional priority checks
+ */
+static void log_generic(int prio, time_t when, const char *msg, struct log_time *lt, bool flush)
+{
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		syslog(prio, "%s", msg);
+	}
+#else
+	if (0) {}
+#endif
+	else {
+		const char *ts = log_timestamp(lt, when);
+
+		/* Only output to stderr if it's not going to the screen as well */
+		if (!isatty(fileno((FILE *)stderr))) {
+			fprintf(stderr, "%s%s\n", ts, msg);
+			if (flush)
+				fflush(stderr);
+		}
+
+		my_log_curses(prio, ts, msg);
+	}
+}
+
+/* Returns false once more than opt_log_rate messages have been logged in the
+ * current second. The first message of the next second reports how many
+ * were held back. */
+static bool log_allowed(time_t when)
+{
+	time_t window = __atomic_load_n(&log_window, __ATOMIC_RELAXED);
+	int limited;
+
+	if (when != window &&
+	    __atomic_compare_exchange_n(&log_window, &window, when, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&log_window_count, 0, __ATOMIC_RELAXED);
+		limited = __atomic_exchange_n(&log_window_limited, 0, __ATOMIC_RELAXED);
+		if (limited)
+			_applog(LOG_WARNING, "Log rate limit of %d/s suppressed %d messages",
+				opt_log_rate, limited);
+	}
+
+	if (__atomic_add_fetch(&log_window_count, 1, __ATOMIC_RELAXED) <= opt_log_rate)
+		return true;
+
+	__atomic_add_fetch(&log_window_limited, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&log_stats.limited, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+static void log_sync(int prio, time_t when, const char *fmt, va_list ap)
+{
+	struct log_time lt = {0, ""};
+	char *msg;
+	va_list apc;
+	int len;
+
+	va_copy(apc, ap);
+	len = vsnprintf(NULL, 0, fmt, apc);
+	va_end(apc);
+	if (len < 0)
+		return;
+	msg = alloca(len + 1);
+	vsnprintf(msg, len + 1, fmt, ap);
+
+	log_generic(prio, when, msg, &lt, true);
+}
+
+/* Returns false if there was no free record for the message */
+static bool log_queue(int prio, time_t when, const char *fmt, va_list ap)
+{
+	struct log_rec *rec;
+	va_list apc;
+	int len;
+
+	rec = lfq_pop(log_free);
+	if (unlikely(!rec))
+		return false;
+
+	rec->prio = prio;
+	rec->when = when;
+	va_copy(apc, ap);
+	len = vsnprintf(rec->msg, LOG_MSG_LEN, fmt, apc);
+	va_end(apc);
+	if (unlikely(len >= LOG_MSG_LEN)) {
+		rec->big = malloc(len + 1);
+		if (likely(rec->big))
+			vsnprintf(rec->big, len + 1, fmt, ap);
+		__atomic_add_fetch(&log_stats.oversize, 1, __ATOMIC_RELAXED);
+	}
+
+	/* Can't fail, there are only as many records as cells */
+	lfq_push(log_pending, rec);
+
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_ACQUIRE)) {
+		mutex_lock(&log_lock);
+		pthread_cond_signal(&log_cond);
+		mutex_unlock(&log_lock);
+	}
+
+	return true;
+}
 
 void vapplog(int prio, const char *fmt, va_list ap)
 {
+	time_t when;
+
 	if (!opt_debug && prio == LOG_DEBUG)
 		return;
-	if (use_syslog || opt_log_output || prio <= LOG_NOTICE)
-		log_generic(prio, fmt, ap);
+	if (!(use_syslog || opt_log_output || prio <= LOG_NOTICE))
+		return;
+
+	/* The final summary is logged after logging_stop() and is never
+	 * limited */
+	when = time(NULL);
+	if (opt_log_rate && __atomic_load_n(&log_async, __ATOMIC_RELAXED) &&
+	    !log_allowed(when))
+		return;
+
+	__atomic_add_fetch(&log_users, 1, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+		if (log_queue(prio, when, fmt, ap))
+			__atomic_add_fetch(&log_stats.logged, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+	} else
+		log_sync(prio, when, fmt, ap);
+	__atomic_sub_fetch(&log_users, 1, __ATOMIC_RELEASE);
 }
 
 void _applog(int prio, const char *fmt, ...)
@@ -62,56 +256,120 @@ void _applog(int prio, const char *fmt, ...)
 	va_end(ap);
 }
 
+/* Write out everything queued, returns false if there was nothing */
+static bool log_drain(struct log_time *lt)
+{
+	struct log_rec *rec;
+	bool did = false;
 
-/* high-level logging functions, based on global opt_log_level */
+	while ((rec = lfq_pop(log_pending))) {
+		log_generic(rec->prio, rec->when, rec->big ? rec->big : rec->msg, lt, false);
+		if (rec->big) {
+			free(rec->big);
+			rec->big = NULL;
+		}
+		lfq_push(log_free, rec);
+		did = true;
+	}
+	if (did)
+		fflush(stderr);
 
-/*
- * generic log function used by priority specific ones
- * equals vapplog() without additional priority checks
- */
-static void log_generic(int prio, const char *fmt, va_list ap)
+	return did;
+}
+
+static void *log_thread(void __maybe_unused *userdata)
 {
-#ifdef HAVE_SYSLOG_H
-	if (use_syslog) {
-		vsyslog(prio, fmt, ap);
-	}
-#else
-	if (0) {}
-#endif
-	else {
-		char *f;
-		int len;
-		struct timeval tv = {0, 0};
-		struct tm *tm;
-
-		cgtime(&tv);
-
-		const time_t tmp_time = tv.tv_sec;
-		tm = localtime(&tmp_time);
-
-		len = 40 + strlen(fmt) + 22;
-		f = alloca(len);
-		sprintf(f, " [%d-%02d-%02d %02d:%02d:%02d] %s\n",
-			tm->tm_year + 1900,
-			tm->tm_mon + 1,
-			tm->tm_mday,
-			tm->tm_hour,
-			tm->tm_min,
-			tm->tm_sec,
-			fmt);
-		/* Only output to stderr if it's not going to the screen as well */
-		if (!isatty(fileno((FILE *)stderr))) {
-			va_list apc;
+	struct log_time lt = {0, ""};
 
-			va_copy(apc, ap);
-			vfprintf(stderr, f, apc);	/* atomic write to stderr */
-			va_end(apc);
-			fflush(stderr);
-		}
+	RenameThread("log");
+
+	while (!__atomic_load_n(&log_quit, __ATOMIC_ACQUIRE)) {
+		struct timespec abstime;
+		struct timeval now;
 
-		my_log_curses(prio, f, ap);
+		if (log_drain(&lt))
+			continue;
+
+		/* Producers only signal when they see us asleep, so check once
+		 * more after saying so, and never sleep long in case a
+		 * signal slipped past */
+		mutex_lock(&log_lock);
+		__atomic_store_n(&log_sleeping, true, __ATOMIC_RELEASE);
+		if (lfq_count(log_pending)) {
+			__atomic_store_n(&log_sleeping, false, __ATOMIC_RELEASE);
+			mutex_unlock(&log_lock);
+			continue;
+		}
+		cgtime(&now);
+		abstime.tv_sec = now.tv_sec;
+		abstime.tv_nsec = now.tv_usec * 1000 + 100000000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&log_cond, &log_lock, &abstime);
+		__atomic_store_n(&log_sleeping, false, __ATOMIC_RELEASE);
+		mutex_unlock(&log_lock);
 	}
+	log_drain(&lt);
+
+	return NULL;
+}
+
+void logging_start(void)
+{
+	int i;
+
+	log_recs = calloc(LOG_RECORDS, sizeof(*log_recs));
+	if (unlikely(!log_recs))
+		quit(1, "Failed to calloc log_recs in logging_start");
+	log_free = lfq_new(LOG_RECORDS);
+	log_pending = lfq_new(LOG_RECORDS);
+	for (i = 0; i < LOG_RECORDS; i++)
+		lfq_push(log_free, &log_recs[i]);
+
+	mutex_init(&log_lock);
+	if (unlikely(pthread_cond_init(&log_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init log_cond");
+	if (unlikely(pthread_create(&log_pth, NULL, log_thread, NULL)))
+		quit(1, "Failed to create log thread");
+
+	__atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
 }
+
+/* Switch back to writing messages directly and flush the queue. Safe to call
+ * more than once and from any thread but the writer. */
+void logging_stop(void)
+{
+	int tries;
+
+	if (!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+		return;
+
+	/* Let callers that already saw log_async finish queueing. A thread
+	 * cancelled inside applog() never will, so don't wait forever. */
+	for (tries = 0; tries < 100 && __atomic_load_n(&log_users, __ATOMIC_ACQUIRE); tries++)
+		nmsleep(1);
+
+	__atomic_store_n(&log_quit, true, __ATOMIC_RELEASE);
+	mutex_lock(&log_lock);
+	pthread_cond_signal(&log_cond);
+	mutex_unlock(&log_lock);
+	pthread_join(log_pth, NULL);
+}
+
+void get_log_stats(struct log_stats *stats)
+{
+	stats->logged = __atomic_load_n(&log_stats.logged, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+	stats->limited = __atomic_load_n(&log_stats.limited, __ATOMIC_RELAXED);
+	stats->oversize = __atomic_load_n(&log_stats.oversize, __ATOMIC_RELAXED);
+	stats->queued = log_pending ? lfq_count(log_pending) : 0;
+}
+
+
+/* high-level logging functions, based on global opt_log_level */
+
 /* we can not generalize variable argument list */
 #define LOG_TEMPLATE(PRIO)		\
 	if (PRIO <= opt_log_level) {	\
@@ -4,6 +4,7 @@
 #include "config.h"
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
@@ -25,6 +26,20 @@ extern bool want_per_device_stats;
 
 /* global log_level, messages with lower or equal prio are logged */
 extern int opt_log_level;
+extern int opt_log_rate;
+
+struct log_stats {
+	uint64_t	logged;
+	uint64_t	dropped;
+	uint64_t	limited;
+	uint64_t	oversize;
+	uint64_t	queued;
+};
+
+/* hand output to a writer thread, and back again before exiting */
+extern void logging_start(void);
+extern void logging_stop(void);
+extern void get_log_stats(struct log_stats *stats);
 
 /* low-level logging functions with priority parameter */
 extern void vapplog(int prio, const char *fmt, va_list ap);
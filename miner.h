@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <jansson.h>
 #include <curl/curl.h>
 #include "elist.h"
@@ -162,6 +163,8 @@ static inline int fsync (int fd)
 #  define htole16(x) (x)
 #  define htole32(x) (x)
 #  define le32toh(x) (x)
+#  define htole64(x) (x)
+#  define le64toh(x) (x)
 #  define be32toh(x) bswap_32(x)
 #  define be64toh(x) bswap_64(x)
 #  define htobe32(x) bswap_32(x)
@@ -170,6 +173,8 @@ static inline int fsync (int fd)
 #  define htole16(x) bswap_16(x)
 #  define htole32(x) bswap_32(x)
 #  define le32toh(x) bswap_32(x)
+#  define htole64(x) bswap_64(x)
+#  define le64toh(x) bswap_64(x)
 #  define be32toh(x) (x)
 #  define be64toh(x) (x)
 #  define htobe32(x) (x)
@@ -232,6 +237,7 @@ enum drv_driver {
 	DRIVER_ZTEX,
 	DRIVER_BFLSC,
 	DRIVER_AVALON,
+	DRIVER_CPU,
 	DRIVER_MAX
 };
 
@@ -345,6 +351,9 @@ struct device_drv {
 	void (*hw_error)(struct thr_info *);
 	void (*thread_shutdown)(struct thr_info *);
 	void (*thread_enable)(struct thr_info *);
+	/* Called once work_restart is set so a thread blocked waiting on its
+	 * device can return straight away */
+	void (*thread_restart)(struct thr_info *);
 
 	// Does it need to be free()d?
 	bool copy;
@@ -399,11 +408,23 @@ enum dev_reason {
 
 #define MIN_SEC_UNSET 99999999
 
+/* Log scale histogram of durations that threads can add to without
+ * locking, for percentiles of getwork waits, submit latency and the like */
+#define HIST_SUB_BUCKETS	4
+#define HIST_BUCKETS		(32 * HIST_SUB_BUCKETS)
+
+struct cg_histogram {
+	uint64_t	buckets[HIST_BUCKETS];
+	uint64_t	count;
+	uint64_t	total_us;
+};
+
 struct cgminer_stats {
 	uint32_t getwork_calls;
 	struct timeval getwork_wait;
 	struct timeval getwork_wait_max;
 	struct timeval getwork_wait_min;
+	struct cg_histogram getwork_hist;
 };
 
 // Just the actual network getworks to the pool
@@ -549,6 +570,21 @@ struct cgpu_info {
 	time_t last_share_pool_time;
 	double last_share_diff;
 	time_t last_device_valid_work;
+	int stale;
+	double diff_stale;
+
+	/* Time from a stratum job being notified to its first write to the
+	 * device */
+	struct timeval last_notify;
+	double notify_latency_total;
+	double notify_latency_max;
+	unsigned int notify_latency_count;
+
+	/* Latency of each stage a job and its shares go through on this
+	 * device, added to without locking */
+	struct cg_histogram notify_work_hist;	/* notify to the work being made */
+	struct cg_histogram work_write_hist;	/* work made to written to device */
+	struct cg_histogram nonce_verify_hist;	/* nonce found to verified */
 
 	time_t device_last_well;
 	time_t device_last_not_well;
@@ -568,6 +604,8 @@ struct cgpu_info {
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	/* The same work indexed by queue_key for find_queued_work_bymidstate */
+	struct work *queued_bykey;
 	unsigned int queued_count;
 };
 
@@ -582,6 +620,31 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
+/* Bounded lock free multi producer multi consumer queue of pointers. Each
+ * cell carries a sequence number telling producers and consumers whose turn
+ * it is, so the only shared writes are one compare and swap per operation. */
+struct lfq_cell {
+	unsigned long	seq;
+	void		*data;
+};
+
+struct lfq {
+	struct lfq_cell	*cells;
+	unsigned long	mask;
+
+	/* Keep producer and consumer positions on separate cache lines */
+	unsigned long	head __attribute__((aligned(64)));
+	unsigned long	tail __attribute__((aligned(64)));
+};
+
+/* Counters a mining thread bumps for every nonce it finds, kept on their own
+ * cache line and updated without a lock. stats_fold() drains them into the
+ * device and global totals before anything reports them. */
+struct stats_shard {
+	uint64_t diff1;
+	uint64_t hw_errors;
+} __attribute__((aligned(64)));
+
 struct thr_info {
 	int		id;
 	int		device_thread;
@@ -599,6 +662,10 @@ struct thr_info {
 	double	rolling;
 
 	bool	work_restart;
+	/* Work generated for this thread directly from a new stratum job */
+	struct work *next_work;
+
+	struct stats_shard shard;
 };
 
 struct string_elist {
@@ -842,6 +909,35 @@ static inline void cg_wunlock(cglock_t *lock)
 	mutex_unlock(&lock->mutex);
 }
 
+/* Sequence counter for data with a single writer that readers copy out
+ * without locking. The count is odd while a write is in progress and
+ * readers retry their copy if it changed underneath them. */
+static inline void seq_write_begin(unsigned long *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(unsigned long *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long seq_read_begin(unsigned long *seq)
+{
+	unsigned long ret;
+
+	while ((ret = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return ret;
+}
+
+static inline bool seq_read_retry(unsigned long *seq, unsigned long start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
 struct pool;
 
 extern bool opt_protocol;
@@ -854,6 +950,7 @@ extern bool opt_autofan;
 extern bool opt_autoengine;
 extern bool use_curses;
 extern char *opt_api_allow;
+extern int opt_api_cache;
 extern char *opt_api_groups;
 extern char *opt_api_description;
 extern int opt_api_port;
@@ -863,6 +960,8 @@ extern bool opt_delaynet;
 extern bool opt_restart;
 extern char *opt_icarus_options;
 extern char *opt_icarus_timing;
+extern int opt_icarus_halflife;
+extern int opt_icarus_queue;
 extern char *opt_cainsmore_clock;	// KRAMBLE
 extern char *opt_ztex_clock;		// KRAMBLE
 extern bool opt_worktime;
@@ -888,6 +987,7 @@ extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     struct pool *pool, bool);
 extern const char *proxytype(curl_proxytype proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
+extern void __bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
@@ -962,6 +1062,7 @@ extern int hotplug_time;
 extern struct list_head scan_devices;
 extern int nDevs;
 extern int num_processors;
+extern int opt_cpu_threads;
 extern int hw_errors;
 extern bool use_syslog;
 extern bool opt_quiet;
@@ -1062,10 +1163,29 @@ struct stratum_work {
 	size_t cb2_len;
 	size_t cb_len;
 
-	size_t header_len;
-	char header[361];
 	int merkles;
 	double diff;
+	struct timeval tv_notify;
+};
+
+struct stratum_template {
+	unsigned long	seq;
+	unsigned char	data[180];
+	unsigned char	tail[64];
+	unsigned char	target[32];
+	char		job_id[24];
+	unsigned int	job_gen;
+	unsigned int	clean_gen;
+	struct timeval	tv_notify;
+};
+
+/* Why stale_work() found work stale, counted per pool for the API */
+enum stale_reason {
+	STALE_JOB,
+	STALE_BLOCK,
+	STALE_EXPIRY,
+	STALE_SWITCH,
+	STALE_REASONS,
 };
 
 #define RBUFSIZE 8192
@@ -1104,6 +1224,15 @@ struct pool {
 	unsigned int remotefail_occasions;
 	struct timeval tv_idle;
 
+	/* Shares waiting for a submit thread, and the time taken from each
+	 * share's nonce being found to it being sent to the pool */
+	int submit_queued;
+	double submit_latency_total;
+	double submit_latency_max;
+	unsigned int submit_latency_count;
+	struct cg_histogram verify_submit_hist;	/* share verified to sent */
+	struct cg_histogram submit_result_hist;	/* share sent to pool reply */
+
 	double utility;
 	int last_shares, shares;
 
@@ -1142,6 +1271,10 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	/* Unconsumed data lies from head to tail, scanned for \n up to scanned */
+	size_t sockbuf_head;
+	size_t sockbuf_tail;
+	size_t sockbuf_scanned;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
@@ -1152,7 +1285,18 @@ struct pool {
 	bool stratum_active;
 	bool stratum_init;
 	bool stratum_notify;
+	/* Set by a client.reconnect for the stratum thread to act on once it
+	 * is done with the line, which lives in the sockbuf it would reuse */
+	bool stratum_reconnect;
 	struct stratum_work swork;
+	/* The current job decoded once per notify, for gen_stratum_work to
+	 * copy under tmpl.seq instead of taking data_lock */
+	struct stratum_template tmpl;
+	/* Bumped by each new stratum job, and clean_gen set to it by each
+	 * clean one, so work can be checked against them without a lock */
+	unsigned int job_gen;
+	unsigned int clean_gen;
+	uint64_t stale_reasons[STALE_REASONS];
 	pthread_t stratum_thread;
 	pthread_mutex_t stratum_lock;
 	int sshares; /* stratum shares submitted waiting on response */
@@ -1183,8 +1327,24 @@ struct pool {
 #define GETWORK_MODE_STRATUM 'S'
 #define GETWORK_MODE_GBT 'G'
 
+/* The 180 byte header hashes as three BLAKE3 blocks of which only the first
+ * holds the nonce. The final block is fixed for a job and kept zero padded
+ * so it can be handed to the compression function as it is. */
+#define HEADER_TAIL_OFFSET	128
+#define HEADER_TAIL_LEN		52
+
+/* Queued work is indexed by the midstate and the data slice that queued
+ * drivers return with each result, the common values passed to
+ * find_queued_work_bymidstate() */
+#define QUEUE_KEY_MIDSTATE	32
+#define QUEUE_KEY_OFFSET	64
+#define QUEUE_KEY_DATA		12
+#define QUEUE_KEY_LEN		(QUEUE_KEY_MIDSTATE + QUEUE_KEY_DATA)
+
 struct work {
 	unsigned char	data[180];
+	unsigned char	hash_tail[64];
+	bool		hash_tail_set;
 	unsigned char	midstate[32];
 	unsigned char	target[32];
 	unsigned char	hash[32];
@@ -1227,8 +1387,18 @@ struct work {
 	int		gbt_txns;
 
 	unsigned int	work_block;
+	unsigned int	job_gen;
+	unsigned int	clean_gen;
 	int		id;
 	UT_hash_handle	hh;
+	/* Link in one of the staged work lanes while staged */
+	struct list_head stage_list;
+	/* Link in the submit retry list, and when the share was first sent */
+	struct list_head submit_list;
+	time_t		submit_start;
+	/* Midstate and data slice a queued device reports results by */
+	unsigned char	queue_key[QUEUE_KEY_LEN];
+	UT_hash_handle	hh_key;
 
 	double		work_difficulty;
 
@@ -1237,14 +1407,34 @@ struct work {
 	// Allow devices to flag work for their own purposes
 	bool		devflag;
 
+	/* Inline storage for the short strings above, see work_strdup() */
+	char		strbuf[64];
+	size_t		strbuf_used;
+	/* Link in the work slab caches while the struct is free */
+	struct work	*slab_next;
+
 	struct timeval	tv_getwork;
 	struct timeval	tv_getwork_reply;
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
 	struct timeval	tv_work_found;
+	struct timeval	tv_verified;
+	struct timeval	tv_notify;
+	struct timeval	tv_submit_retry;
 	char		getwork_mode;
 };
 
+struct work_alloc_stats {
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint64_t	cache_hits;
+	uint64_t	depot_gets;
+	uint64_t	depot_puts;
+	uint64_t	slabs;
+	uint64_t	str_inline;
+	uint64_t	str_heap;
+};
+
 #ifdef USE_MODMINER 
 struct modminer_fpga_state {
 	bool work_running;
@@ -1275,10 +1465,14 @@ struct modminer_fpga_state {
 
 extern void get_datestamp(char *, struct timeval *);
 extern void inc_hw_errors(struct thr_info *thr);
+extern void set_hash_tail(struct work *work);
 extern void submit_nonce(struct thr_info *thr, struct work *work, uint64_t nonce);
+extern void record_work_written(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
 extern struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
+extern bool stale_work(struct work *work, bool share);
+extern void __work_dequeued(struct cgpu_info *cgpu, struct work *work);
 extern void work_completed(struct cgpu_info *cgpu, struct work *work);
 extern void hash_queued_work(struct thr_info *mythr);
 extern void tailsprintf(char *f, const char *fmt, ...);
@@ -1291,6 +1485,7 @@ extern void discard_work(struct work *work);
 extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
+extern void stats_fold(void);
 extern void zero_stats(void);
 extern void default_save_file(char *filename);
 extern bool log_curses_only(int prio, const char *f, va_list ap);
@@ -1300,12 +1495,25 @@ extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
+extern int tq_pop_many(struct thread_q *tq, void **data, int max, const struct timespec *abstime);
+extern struct lfq *lfq_new(unsigned long size);
+extern void lfq_free(struct lfq *q);
+extern bool lfq_push(struct lfq *q, void *data);
+extern void *lfq_pop(struct lfq *q);
+extern unsigned long lfq_count(struct lfq *q);
+extern void hist_add(struct cg_histogram *hist, double secs);
+extern double hist_percentile(struct cg_histogram *hist, double pct);
+extern void hist_merge(struct cg_histogram *dest, struct cg_histogram *src);
+extern double hist_mean(struct cg_histogram *hist);
+extern uint64_t hist_count_upto(struct cg_histogram *hist, double secs);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 extern bool successful_connect;
 extern void adl(void);
 extern void app_restart(void);
 extern void clean_work(struct work *work);
+extern char *work_strdup(struct work *work, const char *s);
+extern void get_work_alloc_stats(struct work_alloc_stats *stats);
 extern void free_work(struct work *work);
 extern void __copy_work(struct work *work, struct work *base_work);
 extern struct work *copy_work(struct work *base_work);
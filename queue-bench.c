@@ -0,0 +1,236 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Microbenchmark for looking up a device's queued work by result
+ *
+ * Fills a queue the way fill_queue() does and looks up random entries by
+ * their 32 byte midstate and the 12 bytes of data at offset 64, as BFLSC and
+ * Avalon do for every result, at queue depths from 16 to 1024. It reports
+ * ns per lookup for:
+ *   scan   HASH_ITER over queued_work with two memcmps, as
+ *          __find_work_bymidstate() does
+ *   index  HASH_FIND in queued_bykey, as find_queued_work_bymidstate() does
+ *          for those values
+ * and the ns per item the index adds to fill_queue() and work_completed().
+ *
+ * Compile:
+ *   gcc -O2 queue-bench.c -o queue-bench
+ *
+ * Run:
+ *   ./queue-bench
+ *   ./queue-bench -n 200000
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "uthash.h"
+
+/* As in miner.h */
+#define QUEUE_KEY_MIDSTATE	32
+#define QUEUE_KEY_OFFSET	64
+#define QUEUE_KEY_DATA		12
+#define QUEUE_KEY_LEN		(QUEUE_KEY_MIDSTATE + QUEUE_KEY_DATA)
+
+#define MAXDEPTH 1024
+
+static int lookups = 1000000;
+
+struct item {
+	int id;
+	bool queued;
+	unsigned char midstate[32];
+	unsigned char data[128];
+	UT_hash_handle hh;
+	unsigned char queue_key[QUEUE_KEY_LEN];
+	UT_hash_handle hh_key;
+};
+
+static struct item *queued_work;
+static struct item *queued_bykey;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct item *find_scan(unsigned char *midstate, unsigned char *data)
+{
+	struct item *item, *tmp, *ret = NULL;
+
+	HASH_ITER(hh, queued_work, item, tmp) {
+		if (item->queued &&
+		    memcmp(item->midstate, midstate, QUEUE_KEY_MIDSTATE) == 0 &&
+		    memcmp(item->data + QUEUE_KEY_OFFSET, data, QUEUE_KEY_DATA) == 0) {
+			ret = item;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static struct item *find_index(unsigned char *midstate, unsigned char *data)
+{
+	unsigned char key[QUEUE_KEY_LEN];
+	struct item *ret = NULL;
+
+	memcpy(key, midstate, QUEUE_KEY_MIDSTATE);
+	memcpy(key + QUEUE_KEY_MIDSTATE, data, QUEUE_KEY_DATA);
+	HASH_FIND(hh_key, queued_bykey, key, QUEUE_KEY_LEN, ret);
+
+	return ret;
+}
+
+static void fill(struct item *items, int n, bool index)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct item *item = &items[i];
+
+		HASH_ADD_INT(queued_work, id, item);
+		if (index) {
+			memcpy(item->queue_key, item->midstate, QUEUE_KEY_MIDSTATE);
+			memcpy(item->queue_key + QUEUE_KEY_MIDSTATE, item->data + QUEUE_KEY_OFFSET, QUEUE_KEY_DATA);
+			HASH_ADD(hh_key, queued_bykey, queue_key, QUEUE_KEY_LEN, item);
+		}
+	}
+}
+
+static void empty(struct item *items, int n, bool index)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		HASH_DEL(queued_work, &items[i]);
+		if (index)
+			HASH_DELETE(hh_key, queued_bykey, &items[i]);
+	}
+}
+
+/* ns per lookup of a random queued item */
+static double time_lookups(struct item *items, int n, bool index, int *order)
+{
+	uint64_t start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++) {
+		struct item *want = &items[order[i]], *got;
+
+		if (index)
+			got = find_index(want->midstate, want->data + QUEUE_KEY_OFFSET);
+		else
+			got = find_scan(want->midstate, want->data + QUEUE_KEY_OFFSET);
+		if (got != want) {
+			fprintf(stderr, "Lookup found the wrong item at depth %d\n", n);
+			exit(1);
+		}
+	}
+
+	return (double)(now_ns() - start) / lookups;
+}
+
+/* ns per item the index adds to filling and emptying the queue */
+static double time_upkeep(struct item *items, int n)
+{
+	int rounds = 200000 / n + 1, r;
+	uint64_t start, plain, indexed;
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		fill(items, n, false);
+		empty(items, n, false);
+	}
+	plain = now_ns() - start;
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		fill(items, n, true);
+		empty(items, n, true);
+	}
+	indexed = now_ns() - start;
+
+	return ((double)indexed - plain) / rounds / n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n lookups]\n"
+			"  -n  lookups timed at each depth (default 1000000)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct item *items;
+	int *order;
+	int n, i, j, opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				lookups = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (lookups < 1)
+		usage(argv[0]);
+
+	items = calloc(MAXDEPTH, sizeof(*items));
+	order = malloc(lookups * sizeof(*order));
+	if (!items || !order) {
+		fprintf(stderr, "Failed to alloc for %d lookups\n", lookups);
+		return 1;
+	}
+
+	/* Every item on the device, with its own midstate and data as
+	 * consecutive work from one pool would have */
+	srandom(1);
+	for (i = 0; i < MAXDEPTH; i++) {
+		items[i].id = i;
+		items[i].queued = true;
+		for (j = 0; j < 32; j++)
+			items[i].midstate[j] = random();
+		for (j = 0; j < 128; j++)
+			items[i].data[j] = random();
+	}
+
+	printf("depth   scan ns/lookup  index ns/lookup  index ns/item upkeep\n");
+	for (n = 16; n <= MAXDEPTH; n *= 2) {
+		double scan, index, upkeep;
+
+		for (i = 0; i < lookups; i++)
+			order[i] = random() % n;
+
+		fill(items, n, true);
+		scan = time_lookups(items, n, false, order);
+		index = time_lookups(items, n, true, order);
+		empty(items, n, true);
+		upkeep = time_upkeep(items, n);
+
+		printf("%5d %16.1f %16.1f %20.1f\n", n, scan, index, upkeep);
+	}
+
+	free(order);
+	free(items);
+
+	return 0;
+}
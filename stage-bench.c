@@ -0,0 +1,586 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Contention benchmark for the staged work store
+ *
+ * A number of mining threads call get work as fast as they can while stage
+ * threads keep the store topped up to a fixed depth, and it reports the
+ * work handed out per second and the latency of each pop for:
+ *   mutex  the staged_work hashtable under stgd_lock, sorted on every push
+ *          and woken with a broadcast, as hash_push()/hash_pop() used to be
+ *   lfq    the lock free queue, only taking stgd_lock to sleep when it is
+ *          empty, as hash_push()/hash_pop() are now
+ * lfq_push() and lfq_pop() are copies of those in util.c.
+ *
+ * With -D it instead times the store that takes what the lock free queue
+ * can't, on one thread at depths from 1 to 1024. Each round stages that many
+ * items, one in four rollable, then pops them all, and a discard pass walks
+ * a full store. It reports ns per item staged and popped, and per pass, for:
+ *   hash   the staged_work hashtable sorted on every add, popping the first
+ *          item that isn't rollable, as __hash_add_staged() and
+ *          __hash_pop_staged() used to be
+ *   lists  the overflow and rollable lists in staging order, as they are now
+ *
+ * Compile:
+ *   gcc -O2 -pthread stage-bench.c -o stage-bench
+ *
+ * Run:
+ *   ./stage-bench -n 32 -t 5
+ *   ./stage-bench -n 64 -q 8 -w 2
+ *   ./stage-bench -D
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "uthash.h"
+#include "elist.h"
+
+/* Pop latencies kept per thread, later ones are counted but not kept */
+#define MAXSAMPLES 100000
+
+static int threads = 32;
+static int stagers = 1;
+static int depth = 64;
+static int seconds = 5;
+static int work_us;
+
+struct item {
+	int id;
+	bool rollable;
+	struct timeval tv_staged;
+	UT_hash_handle hh;
+	struct list_head list;
+};
+
+struct miner {
+	pthread_t pth;
+	uint64_t pops;
+	uint32_t *samples;
+	int nsamples;
+};
+
+static volatile bool stop;
+static int staged_count;
+static int next_id;
+
+static pthread_mutex_t stgd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t getq_cond = PTHREAD_COND_INITIALIZER;
+
+/* mutex: the hashtable kept in staging order */
+static struct item *staged_work;
+
+/* lfq: as in util.c */
+struct lfq_cell {
+	unsigned long seq;
+	void *data;
+};
+
+struct lfq {
+	struct lfq_cell *cells;
+	unsigned long mask;
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+};
+
+static struct lfq *staged_lfq;
+static int stgd_waiters;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void spin_us(int us)
+{
+	uint64_t end = now_ns() + us * 1000ULL;
+
+	while (now_ns() < end)
+		;
+}
+
+static struct lfq *lfq_new(unsigned long size)
+{
+	struct lfq *q;
+	unsigned long i, cells = 2;
+
+	while (cells < size)
+		cells <<= 1;
+
+	q = calloc(1, sizeof(*q));
+	if (q)
+		q->cells = calloc(cells, sizeof(*q->cells));
+	if (!q || !q->cells) {
+		fprintf(stderr, "Failed to calloc lfq\n");
+		exit(1);
+	}
+	for (i = 0; i < cells; i++)
+		q->cells[i].seq = i;
+	q->mask = cells - 1;
+
+	return q;
+}
+
+static bool lfq_push(struct lfq *q, void *data)
+{
+	struct lfq_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (42) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static void *lfq_pop(struct lfq *q)
+{
+	struct lfq_cell *cell;
+	unsigned long pos, seq;
+	void *data;
+	long diff;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while (42) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
+
+static int tv_sort(struct item *a, struct item *b)
+{
+	if (a->tv_staged.tv_sec != b->tv_staged.tv_sec)
+		return a->tv_staged.tv_sec < b->tv_staged.tv_sec ? -1 : 1;
+	return (a->tv_staged.tv_usec > b->tv_staged.tv_usec) -
+	       (a->tv_staged.tv_usec < b->tv_staged.tv_usec);
+}
+
+static void mutex_push(struct item *item)
+{
+	pthread_mutex_lock(&stgd_lock);
+	HASH_ADD_INT(staged_work, id, item);
+	HASH_SORT(staged_work, tv_sort);
+	pthread_cond_broadcast(&getq_cond);
+	pthread_mutex_unlock(&stgd_lock);
+}
+
+static struct item *mutex_pop(void)
+{
+	struct item *item = NULL;
+
+	pthread_mutex_lock(&stgd_lock);
+	while (!stop && !HASH_COUNT(staged_work))
+		pthread_cond_wait(&getq_cond, &stgd_lock);
+	item = staged_work;
+	if (item)
+		HASH_DEL(staged_work, item);
+	pthread_cond_signal(&getq_cond);
+	pthread_mutex_unlock(&stgd_lock);
+
+	return item;
+}
+
+static void lfq_stage(struct item *item)
+{
+	while (!lfq_push(staged_lfq, item))
+		sched_yield();
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stgd_waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&stgd_lock);
+		pthread_cond_signal(&getq_cond);
+		pthread_mutex_unlock(&stgd_lock);
+	}
+}
+
+static struct item *lfq_get(void)
+{
+	struct item *item;
+
+	item = lfq_pop(staged_lfq);
+	if (item)
+		return item;
+
+	pthread_mutex_lock(&stgd_lock);
+	__atomic_add_fetch(&stgd_waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!(item = lfq_pop(staged_lfq)) && !stop)
+		pthread_cond_wait(&getq_cond, &stgd_lock);
+	__atomic_sub_fetch(&stgd_waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stgd_lock);
+
+	return item;
+}
+
+static bool use_lfq;
+
+static void *stage_thread(void __attribute__((unused)) *arg)
+{
+	struct item *item;
+
+	while (!stop) {
+		if (__atomic_load_n(&staged_count, __ATOMIC_RELAXED) >= depth) {
+			sched_yield();
+			continue;
+		}
+		item = malloc(sizeof(*item));
+		if (!item)
+			break;
+		item->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+		gettimeofday(&item->tv_staged, NULL);
+		__atomic_add_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
+		if (use_lfq)
+			lfq_stage(item);
+		else
+			mutex_push(item);
+	}
+
+	return NULL;
+}
+
+static void *miner_thread(void *arg)
+{
+	struct miner *m = arg;
+	struct item *item;
+	uint64_t start;
+
+	while (!stop) {
+		start = now_ns();
+		item = use_lfq ? lfq_get() : mutex_pop();
+		if (!item)
+			break;
+		if (m->nsamples < MAXSAMPLES)
+			m->samples[m->nsamples++] = now_ns() - start;
+		__atomic_sub_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
+		free(item);
+		m->pops++;
+		if (work_us)
+			spin_us(work_us);
+	}
+
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void drain(void)
+{
+	struct item *item, *tmp;
+
+	HASH_ITER(hh, staged_work, item, tmp) {
+		HASH_DEL(staged_work, item);
+		free(item);
+	}
+	while ((item = lfq_pop(staged_lfq)))
+		free(item);
+	staged_count = 0;
+}
+
+static void run(const char *name, bool lfq)
+{
+	struct miner *m;
+	pthread_t *st;
+	uint64_t pops = 0, start, elapsed;
+	uint32_t *all;
+	size_t total = 0;
+	int i;
+
+	use_lfq = lfq;
+	stop = false;
+	m = calloc(threads, sizeof(*m));
+	st = calloc(stagers, sizeof(*st));
+	all = malloc((size_t)threads * MAXSAMPLES * sizeof(uint32_t));
+	if (!m || !st || !all) {
+		fprintf(stderr, "Failed to alloc for %d threads\n", threads);
+		exit(1);
+	}
+
+	for (i = 0; i < stagers; i++)
+		pthread_create(&st[i], NULL, stage_thread, NULL);
+	for (i = 0; i < threads; i++) {
+		m[i].samples = all + (size_t)i * MAXSAMPLES;
+		pthread_create(&m[i].pth, NULL, miner_thread, &m[i]);
+	}
+
+	start = now_ns();
+	sleep(seconds);
+	stop = true;
+	pthread_mutex_lock(&stgd_lock);
+	pthread_cond_broadcast(&getq_cond);
+	pthread_mutex_unlock(&stgd_lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(m[i].pth, NULL);
+	for (i = 0; i < stagers; i++)
+		pthread_join(st[i], NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++) {
+		pops += m[i].pops;
+		memmove(all + total, m[i].samples, m[i].nsamples * sizeof(uint32_t));
+		total += m[i].nsamples;
+	}
+	qsort(all, total, sizeof(uint32_t), cmp_u32);
+
+	printf("%-6s %10.0f pops/s", name, pops * 1e9 / elapsed);
+	if (total)
+		printf("  pop ns p50 %u  p90 %u  p99 %u  max %u",
+			all[total / 2], all[total * 90 / 100],
+			all[total * 99 / 100], all[total - 1]);
+	printf("\n");
+
+	drain();
+	free(all);
+	free(st);
+	free(m);
+}
+
+/* -D: the overflow store on its own, no threads */
+static int staged_rollable;
+static LIST_HEAD(staged_rollable_list);
+static LIST_HEAD(staged_overflow);
+
+static void hash_add(struct item *item)
+{
+	if (item->rollable)
+		staged_rollable++;
+	HASH_ADD_INT(staged_work, id, item);
+	HASH_SORT(staged_work, tv_sort);
+}
+
+static struct item *hash_take(void)
+{
+	struct item *item = NULL, *tmp;
+
+	if (!staged_work)
+		return NULL;
+	if (HASH_COUNT(staged_work) > staged_rollable) {
+		HASH_ITER(hh, staged_work, item, tmp) {
+			if (!item->rollable)
+				break;
+		}
+	} else
+		item = staged_work;
+	HASH_DEL(staged_work, item);
+	if (item->rollable)
+		staged_rollable--;
+
+	return item;
+}
+
+static int hash_discard(void)
+{
+	struct item *item, *tmp;
+	int kept = 0;
+
+	HASH_ITER(hh, staged_work, item, tmp) {
+		if (item->id >= 0)
+			kept++;
+	}
+
+	return kept;
+}
+
+static void list_addw(struct item *item)
+{
+	if (item->rollable) {
+		staged_rollable++;
+		list_add_tail(&item->list, &staged_rollable_list);
+	} else
+		list_add_tail(&item->list, &staged_overflow);
+}
+
+static struct item *list_take(void)
+{
+	struct item *item;
+
+	if (!list_empty(&staged_overflow))
+		item = list_entry(staged_overflow.next, struct item, list);
+	else if (!list_empty(&staged_rollable_list))
+		item = list_entry(staged_rollable_list.next, struct item, list);
+	else
+		return NULL;
+	list_del(&item->list);
+	if (item->rollable)
+		staged_rollable--;
+
+	return item;
+}
+
+static int list_discard(void)
+{
+	struct item *item;
+	int kept = 0;
+
+	list_for_each_entry(item, &staged_overflow, list) {
+		if (item->id >= 0)
+			kept++;
+	}
+	list_for_each_entry(item, &staged_rollable_list, list) {
+		if (item->id >= 0)
+			kept++;
+	}
+
+	return kept;
+}
+
+/* ns per item staged and popped, and per discard pass over a full store */
+static void time_store(struct item *items, int n, bool lists, double *item_ns, double *pass_ns)
+{
+	int rounds = 1000000 / n + 1, r, i;
+	volatile int kept = 0;
+	uint64_t start, pass = 0;
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		uint64_t t;
+
+		for (i = 0; i < n; i++) {
+			/* Staging order, as the work's creation time */
+			items[i].tv_staged.tv_sec = r;
+			items[i].tv_staged.tv_usec = i;
+			if (lists)
+				list_addw(&items[i]);
+			else
+				hash_add(&items[i]);
+		}
+		t = now_ns();
+		kept += lists ? list_discard() : hash_discard();
+		pass += now_ns() - t;
+		for (i = 0; i < n; i++) {
+			if (!(lists ? list_take() : hash_take())) {
+				fprintf(stderr, "Store lost an item at depth %d\n", n);
+				exit(1);
+			}
+		}
+	}
+	*pass_ns = (double)pass / rounds;
+	*item_ns = (double)(now_ns() - start - pass) / rounds / n;
+}
+
+static void depth_sweep(void)
+{
+	double hash_item, hash_pass, list_item, list_pass;
+	struct item *items;
+	int n, i;
+
+	items = calloc(1024, sizeof(*items));
+	if (!items) {
+		fprintf(stderr, "Failed to calloc items\n");
+		exit(1);
+	}
+	for (i = 0; i < 1024; i++) {
+		items[i].id = i;
+		items[i].rollable = !(i % 4);
+	}
+
+	printf("depth   hash ns/item  lists ns/item   hash ns/pass  lists ns/pass\n");
+	for (n = 1; n <= 1024; n *= 2) {
+		time_store(items, n, false, &hash_item, &hash_pass);
+		time_store(items, n, true, &list_item, &list_pass);
+		printf("%5d %14.1f %14.1f %14.1f %14.1f\n", n,
+			hash_item, list_item, hash_pass, list_pass);
+	}
+	free(items);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n threads] [-s stagers] [-q depth] [-w us] [-t seconds] [-D]\n"
+			"  -n  mining threads calling get work (default 32)\n"
+			"  -s  threads staging work (default 1)\n"
+			"  -q  work kept staged (default 64)\n"
+			"  -w  microseconds each mining thread spins between pops (default 0)\n"
+			"  -t  seconds to run each store (default 5)\n"
+			"  -D  time the overflow store alone at depths 1 to 1024\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:q:w:t:D")) != -1) {
+		switch (opt) {
+			case 'n':
+				threads = atoi(optarg);
+				break;
+			case 's':
+				stagers = atoi(optarg);
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 'w':
+				work_us = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'D':
+				depth_sweep();
+				return 0;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (threads < 1 || stagers < 1 || depth < 1 || work_us < 0 || seconds < 1)
+		usage(argv[0]);
+
+	staged_lfq = lfq_new(depth + stagers + 64);
+
+	printf("%d mining threads, %d stagers, depth %d, %dus between pops\n",
+		threads, stagers, depth, work_us);
+	run("mutex", false);
+	run("lfq", true);
+
+	return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Local stand-in for a pool speaking this fork's stratum dialect
+ *
+ * Answers mining.subscribe with mining.subscribed, sends mining.set_target
+ * and a stream of mining.notify jobs with a 180 byte header, and replies to
+ * each mining.submit with mining.submitted after checking the share with
+ * BLAKE3. Every notify and submit can be logged with a timestamp to a CSV
+ * file to measure latency through cgminer.
+ *
+ * Compile:
+ *   gcc -O2 stratum-sim.c blake3/blake3.c blake3/blake3_dispatch.c \
+ *     blake3/blake3_portable.c -DBLAKE3_NO_SSE2 -DBLAKE3_NO_SSE41 \
+ *     -DBLAKE3_NO_AVX2 -DBLAKE3_NO_AVX512 -o stratum-sim
+ *
+ * Run:
+ *   ./stratum-sim -p 3334 -o stratum.csv
+ *   cgminer -o stratum+tcp://127.0.0.1:3334 -u user -p x ...
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "blake3/blake3.h"
+
+#define HEADER_SIZE 180
+#define MAX_CLIENTS 64
+#define RBUFSIZE 8192
+// Jobs remembered so late submits can still be checked
+#define MAX_JOBS 16
+
+static int opt_port = 3334;
+static int opt_notify_ms = 5000;
+static int opt_clean_every = 10;
+static int opt_reject_pct;
+static int opt_bits = 32;
+static char *opt_target = "00000000ffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+static char *opt_csv;
+
+struct job {
+	long long id;
+	unsigned char header[HEADER_SIZE];
+	bool valid;
+};
+
+struct client {
+	int fd;
+	int no;
+	bool subscribed;
+	char rbuf[RBUFSIZE];
+	size_t rlen;
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct job jobs[MAX_JOBS];
+static long long job_id;
+static unsigned char cur_header[HEADER_SIZE];
+static FILE *csv;
+
+static uint64_t notifies, submits, accepted, rejected, invalid;
+
+static double now_secs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static void bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*s++ = hex[p[i] >> 4];
+		*s++ = hex[p[i] & 0xf];
+	}
+	*s = '\0';
+}
+
+static bool hex2bin(unsigned char *p, const char *s, size_t len)
+{
+	unsigned int v;
+
+	while (len--) {
+		if (sscanf(s, "%2x", &v) != 1)
+			return false;
+		*p++ = v;
+		s += 2;
+	}
+
+	return true;
+}
+
+static void log_csv(const char *event, int client, long long job, int id, const char *nonce, const char *result)
+{
+	if (!csv)
+		return;
+	fprintf(csv, "%.6f,%s,%d,%lld,%d,%s,%s\n", now_secs(), event, client, job,
+		id, nonce ? nonce : "", result ? result : "");
+	fflush(csv);
+}
+
+static void send_line(struct client *c, const char *s)
+{
+	char buf[RBUFSIZE];
+	size_t len, off = 0;
+	ssize_t ret;
+
+	len = snprintf(buf, sizeof(buf) - 1, "%s\n", s);
+	while (off < len) {
+		ret = send(c->fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return;
+		}
+		off += ret;
+	}
+}
+
+/* A clean job changes the sequence and previous block hash, all others
+ * only move the timestamp and graffiti on */
+static void new_job(bool clean)
+{
+	struct job *job;
+	uint64_t stamp;
+	int i;
+
+	if (clean || !job_id) {
+		for (i = 8; i < 44; i++)
+			cur_header[i] = random();
+		for (i = 44; i < 140; i++)
+			cur_header[i] = random();
+	}
+	stamp = (uint64_t)(now_secs() * 1000.0);
+	memcpy(&cur_header[140], &stamp, sizeof(stamp));
+	for (i = 148; i < HEADER_SIZE; i++)
+		cur_header[i] = random();
+	memset(cur_header, 0, 8);
+
+	job = &jobs[++job_id % MAX_JOBS];
+	job->id = job_id;
+	memcpy(job->header, cur_header, HEADER_SIZE);
+	job->valid = true;
+}
+
+static void send_target(struct client *c)
+{
+	char s[256];
+
+	snprintf(s, sizeof(s), "{\"id\":null,\"method\":\"mining.set_target\",\"body\":{\"target\":\"%s\"}}", opt_target);
+	send_line(c, s);
+}
+
+static void send_notify(struct client *c)
+{
+	char s[512], hex[HEADER_SIZE * 2 + 1];
+
+	bin2hex(hex, cur_header, HEADER_SIZE);
+	snprintf(s, sizeof(s), "{\"id\":null,\"method\":\"mining.notify\",\"body\":{\"miningRequestId\":%lld,\"header\":\"%s\"}}",
+		job_id, hex);
+	send_line(c, s);
+	log_csv("notify", c->no, job_id, 0, NULL, NULL);
+	notifies++;
+}
+
+static bool json_int(const char *s, const char *key, long long *val)
+{
+	char pat[64];
+	const char *p;
+
+	snprintf(pat, sizeof(pat), "\"%s\"", key);
+	p = strstr(s, pat);
+	if (!p)
+		return false;
+	p = strchr(p + strlen(pat), ':');
+	if (!p)
+		return false;
+	return sscanf(p + 1, " %lld", val) == 1;
+}
+
+static bool json_str(const char *s, const char *key, char *val, size_t len)
+{
+	char pat[64];
+	const char *p, *q;
+
+	snprintf(pat, sizeof(pat), "\"%s\"", key);
+	p = strstr(s, pat);
+	if (!p)
+		return false;
+	p = strchr(p + strlen(pat), '"');
+	if (!p)
+		return false;
+	q = strchr(++p, '"');
+	if (!q || (size_t)(q - p) >= len)
+		return false;
+	memcpy(val, p, q - p);
+	val[q - p] = '\0';
+	return true;
+}
+
+static bool leading_zero_bits(const unsigned char *hash, int bits)
+{
+	int i;
+
+	for (i = 0; i < bits / 8; i++)
+		if (hash[i])
+			return false;
+	if (bits % 8 && (hash[i] >> (8 - bits % 8)))
+		return false;
+
+	return true;
+}
+
+static bool check_share(long long id, const char *randomness)
+{
+	unsigned char buf[HEADER_SIZE], hash[BLAKE3_OUT_LEN];
+	blake3_hasher hasher;
+	struct job *job = &jobs[id % MAX_JOBS];
+
+	if (!job->valid || job->id != id || strlen(randomness) != 16)
+		return false;
+
+	memcpy(buf, job->header, HEADER_SIZE);
+	if (!hex2bin(buf, randomness, 8))
+		return false;
+
+	blake3_hasher_init(&hasher);
+	blake3_hasher_update(&hasher, buf, sizeof(buf));
+	blake3_hasher_finalize(&hasher, hash, sizeof(hash));
+
+	return leading_zero_bits(hash, opt_bits);
+}
+
+static void handle_line(struct client *c, char *line)
+{
+	char method[64], randomness[64], s[256];
+	long long id = 0, mrid = 0;
+	bool valid, result;
+
+	if (!json_str(line, "method", method, sizeof(method)))
+		return;
+	json_int(line, "id", &id);
+
+	if (!strcmp(method, "mining.subscribe")) {
+		snprintf(s, sizeof(s), "{\"id\":%lld,\"method\":\"mining.subscribed\",\"body\":{\"clientId\":%d,\"graffiti\":\"stratum-sim\"}}",
+			id, c->no);
+		send_line(c, s);
+		c->subscribed = true;
+		send_target(c);
+		send_notify(c);
+		return;
+	}
+
+	if (!strcmp(method, "mining.submit")) {
+		if (!json_int(line, "miningRequestId", &mrid) ||
+		    !json_str(line, "randomness", randomness, sizeof(randomness)))
+			return;
+
+		submits++;
+		valid = check_share(mrid, randomness);
+		result = valid && (random() % 100) >= opt_reject_pct;
+		if (!valid)
+			invalid++;
+		if (result)
+			accepted++;
+		else
+			rejected++;
+		log_csv("submit", c->no, mrid, (int)id, randomness,
+			result ? "accepted" : (valid ? "rejected" : "invalid"));
+
+		snprintf(s, sizeof(s), "{\"id\":%lld,\"method\":\"mining.submitted\",\"body\":{\"id\":%lld,\"result\":%s}}",
+			id, id, result ? "true" : "false");
+		send_line(c, s);
+	}
+}
+
+static void client_read(struct client *c)
+{
+	char *nl, *line;
+	ssize_t ret;
+
+	ret = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen - 1, 0);
+	if (ret <= 0) {
+		fprintf(stderr, "client %d disconnected\n", c->no);
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->rlen += ret;
+	c->rbuf[c->rlen] = '\0';
+
+	line = c->rbuf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		if (*line)
+			handle_line(c, line);
+		line = nl + 1;
+	}
+	c->rlen -= line - c->rbuf;
+	memmove(c->rbuf, line, c->rlen);
+
+	// A line that doesn't fit can't be valid
+	if (c->rlen >= sizeof(c->rbuf) - 1)
+		c->rlen = 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -p <port>      Port to listen on (default 3334)\n"
+		"  -i <ms>        Interval between notifies (default 5000)\n"
+		"  -c <n>         Make every n'th notify a clean job, 0 for never (default 10)\n"
+		"  -r <percent>   Percentage of valid shares to reject (default 0)\n"
+		"  -b <bits>      Leading zero hash bits for a valid share (default 32)\n"
+		"  -t <hex>       Target string sent with mining.set_target\n"
+		"  -o <file>      Log a timestamp for every notify and submit to a CSV file\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfds[MAX_CLIENTS + 1];
+	struct sockaddr_in addr;
+	double next_notify, last_stats, now;
+	int c, i, n, lfd, fd, opt, timeout, clients_no = 0;
+	unsigned int count = 0;
+
+	while ((c = getopt(argc, argv, "p:i:c:r:b:t:o:")) != -1) {
+		switch (c) {
+			case 'p':
+				opt_port = atoi(optarg);
+				break;
+			case 'i':
+				opt_notify_ms = atoi(optarg);
+				break;
+			case 'c':
+				opt_clean_every = atoi(optarg);
+				break;
+			case 'r':
+				opt_reject_pct = atoi(optarg);
+				break;
+			case 'b':
+				opt_bits = atoi(optarg);
+				break;
+			case 't':
+				opt_target = optarg;
+				break;
+			case 'o':
+				opt_csv = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (opt_port < 1 || opt_port > 65535 || opt_notify_ms < 1 ||
+	    opt_reject_pct < 0 || opt_reject_pct > 100 || opt_clean_every < 0 ||
+	    opt_bits < 0 || opt_bits > 256 || strlen(opt_target) < 32)
+		usage(argv[0]);
+
+	if (opt_csv) {
+		csv = fopen(opt_csv, "w");
+		if (!csv) {
+			fprintf(stderr, "Failed to open %s\n", opt_csv);
+			return 1;
+		}
+		fprintf(csv, "time,event,client,job,id,randomness,result\n");
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	srandom(time(NULL));
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	opt = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(opt_port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, 16)) {
+		fprintf(stderr, "Failed to listen on port %d: %s\n", opt_port, strerror(errno));
+		return 1;
+	}
+	fprintf(stderr, "Listening on port %d\n", opt_port);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	new_job(true);
+	next_notify = now_secs() + opt_notify_ms / 1000.0;
+	last_stats = now_secs();
+
+	while (42) {
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			pfds[i + 1].fd = clients[i].fd;
+			pfds[i + 1].events = POLLIN;
+		}
+
+		timeout = (int)((next_notify - now_secs()) * 1000.0);
+		if (timeout < 0)
+			timeout = 0;
+		n = poll(pfds, MAX_CLIENTS + 1, timeout);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		if (n > 0 && (pfds[0].revents & POLLIN)) {
+			fd = accept(lfd, NULL, NULL);
+			for (i = 0; fd >= 0 && i < MAX_CLIENTS; i++) {
+				if (clients[i].fd == -1) {
+					opt = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+					clients[i].fd = fd;
+					clients[i].no = clients_no++;
+					clients[i].subscribed = false;
+					clients[i].rlen = 0;
+					fprintf(stderr, "client %d connected\n", clients[i].no);
+					break;
+				}
+			}
+			if (fd >= 0 && i == MAX_CLIENTS)
+				close(fd);
+		}
+
+		for (i = 0; n > 0 && i < MAX_CLIENTS; i++)
+			if (clients[i].fd != -1 && (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				client_read(&clients[i]);
+
+		now = now_secs();
+		if (now >= next_notify) {
+			count++;
+			new_job(opt_clean_every && !(count % opt_clean_every));
+			for (i = 0; i < MAX_CLIENTS; i++)
+				if (clients[i].fd != -1 && clients[i].subscribed)
+					send_notify(&clients[i]);
+			next_notify += opt_notify_ms / 1000.0;
+			if (next_notify < now)
+				next_notify = now + opt_notify_ms / 1000.0;
+		}
+
+		if (now - last_stats >= 10) {
+			fprintf(stderr, "job %lld notifies %llu submits %llu accepted %llu rejected %llu invalid %llu\n",
+				job_id, (unsigned long long)notifies, (unsigned long long)submits,
+				(unsigned long long)accepted, (unsigned long long)rejected,
+				(unsigned long long)invalid);
+			last_stats = now;
+		}
+	}
+
+	return 0;
+}
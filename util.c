@@ -37,6 +37,10 @@
 # include <mmsystem.h>
 #endif
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "miner.h"
 #include "elist.h"
 #include "compat.h"
@@ -574,12 +578,83 @@ char *get_proxy(char *url, struct pool *pool)
 	return url;
 }
 
+static const char hexchars[] = "0123456789abcdef";
+
+#ifdef __SSE2__
+/* 16 bytes to 32 hex characters */
+static inline void hex_encode16(char *s, const unsigned char *p)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+	__m128i v, hi, lo;
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	lo = _mm_and_si128(v, mask);
+	hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+	_mm_storeu_si128((__m128i *)s, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(s + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/* 16 hex characters to the 8 bytes they encode, one in the low byte of each
+ * 16 bit lane, returning false if any isn't a hex digit */
+static inline bool hex_nibbles16(__m128i *out, const char *s)
+{
+	const __m128i neg1 = _mm_set1_epi8(-1);
+	const __m128i ten = _mm_set1_epi8(10);
+	const __m128i six = _mm_set1_epi8(6);
+	__m128i c, d, l, digits, alphas;
+
+	c = _mm_loadu_si128((const __m128i *)s);
+	d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	digits = _mm_and_si128(_mm_cmpgt_epi8(d, neg1), _mm_cmplt_epi8(d, ten));
+	alphas = _mm_and_si128(_mm_cmpgt_epi8(l, neg1), _mm_cmplt_epi8(l, six));
+	if (_mm_movemask_epi8(_mm_or_si128(digits, alphas)) != 0xffff)
+		return false;
+	c = _mm_or_si128(_mm_and_si128(digits, d),
+			 _mm_and_si128(alphas, _mm_add_epi8(l, ten)));
+	/* The first character of each pair is the high nibble */
+	*out = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, _mm_set1_epi16(0xff)), 4),
+			    _mm_srli_epi16(c, 8));
+	return true;
+}
+
+/* 32 hex characters to 16 bytes */
+static inline bool hex_decode16(unsigned char *p, const char *s)
+{
+	__m128i a, b;
+
+	if (!hex_nibbles16(&a, s) || !hex_nibbles16(&b, s + 16))
+		return false;
+	_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(a, b));
+	return true;
+}
+#endif
+
+/* Writes the hex of len bytes and a terminating null to s, which must have
+ * room for len * 2 + 1 characters */
+void __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+#ifdef __SSE2__
+	for (; len >= 16; len -= 16, p += 16, s += 32)
+		hex_encode16(s, p);
+#endif
+	for (; len; len--, p++) {
+		*s++ = hexchars[*p >> 4];
+		*s++ = hexchars[*p & 0xf];
+	}
+	*s = '\0';
+}
+
 /* Returns a malloced array string of a binary value of arbitrary length. The
  * array is rounded up to a 4 byte size to appease architectures that need
  * aligned array  sizes */
 char *bin2hex(const unsigned char *p, size_t len)
 {
-	unsigned int i;
 	ssize_t slen;
 	char *s;
 
@@ -590,36 +665,53 @@ char *bin2hex(const unsigned char *p, size_t len)
 	if (unlikely(!s))
 		quit(1, "Failed to calloc in bin2hex");
 
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	__bin2hex(s, p, len);
 
 	return s;
 }
 
+static inline int hex_nibble(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
 /* Does the reverse of bin2hex but does not allocate any ram */
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
 	bool ret = false;
 
+#ifdef __SSE2__
+	/* Only when the string is exactly the right length, so the loads
+	 * never go past its end and anything else gets the checks below */
+	if (strnlen(hexstr, len * 2 + 1) == len * 2) {
+		for (; len >= 16; len -= 16, p += 16, hexstr += 32) {
+			if (unlikely(!hex_decode16(p, hexstr)))
+				break;
+		}
+	}
+#endif
+
 	while (*hexstr && len) {
-		char hex_byte[4];
-		unsigned int v;
+		int hi, lo;
 
 		if (unlikely(!hexstr[1])) {
 			applog(LOG_ERR, "hex2bin str truncated");
 			return ret;
 		}
 
-		memset(hex_byte, 0, 4);
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-
-		if (unlikely(sscanf(hex_byte, "%x", &v) != 1)) {
-			applog(LOG_ERR, "hex2bin sscanf '%s' failed", hex_byte);
+		hi = hex_nibble(hexstr[0]);
+		lo = hex_nibble(hexstr[1]);
+		if (unlikely(hi < 0 || lo < 0)) {
+			applog(LOG_ERR, "hex2bin invalid hex '%c%c'", hexstr[0], hexstr[1]);
 			return ret;
 		}
 
-		*p = (unsigned char) v;
+		*p = (unsigned char)(hi << 4 | lo);
 
 		p++;
 		hexstr += 2;
@@ -783,6 +875,223 @@ out:
 	return rval;
 }
 
+/* As tq_pop but once anything is queued, take up to max entries at once */
+int tq_pop_many(struct thread_q *tq, void **data, int max, const struct timespec *abstime)
+{
+	struct tq_ent *ent;
+	int rc, count = 0;
+
+	mutex_lock(&tq->mutex);
+	if (!list_empty(&tq->q))
+		goto pop;
+
+	if (abstime)
+		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+	else
+		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+	if (rc)
+		goto out;
+pop:
+	while (count < max && !list_empty(&tq->q)) {
+		ent = list_entry(tq->q.next, struct tq_ent, q_node);
+		data[count++] = ent->data;
+
+		list_del(&ent->q_node);
+		free(ent);
+	}
+out:
+	mutex_unlock(&tq->mutex);
+
+	return count;
+}
+
+/* Size is rounded up to a power of 2 */
+struct lfq *lfq_new(unsigned long size)
+{
+	struct lfq *q;
+	unsigned long i, cells = 2;
+
+	while (cells < size)
+		cells <<= 1;
+
+	q = calloc(1, sizeof(*q));
+	if (unlikely(!q))
+		quit(1, "Failed to calloc lfq in lfq_new");
+	q->cells = calloc(cells, sizeof(*q->cells));
+	if (unlikely(!q->cells))
+		quit(1, "Failed to calloc lfq cells in lfq_new");
+	for (i = 0; i < cells; i++)
+		q->cells[i].seq = i;
+	q->mask = cells - 1;
+
+	return q;
+}
+
+void lfq_free(struct lfq *q)
+{
+	if (!q)
+		return;
+	free(q->cells);
+	free(q);
+}
+
+/* Returns false if the queue is full */
+bool lfq_push(struct lfq *q, void *data)
+{
+	struct lfq_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (42) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* Number of entries queued, only a snapshot if others are pushing or popping */
+unsigned long lfq_count(struct lfq *q)
+{
+	unsigned long head, tail;
+
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	return head - tail;
+}
+
+/* Returns NULL if the queue is empty */
+void *lfq_pop(struct lfq *q)
+{
+	struct lfq_cell *cell;
+	unsigned long pos, seq;
+	void *data;
+	long diff;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while (42) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
+
+/* Microseconds below 4 get a bucket each, above that every power of 2 is
+ * split into HIST_SUB_BUCKETS so a percentile is within 25% of the truth */
+static int hist_bucket(uint64_t us)
+{
+	int bits;
+
+	if (us < HIST_SUB_BUCKETS)
+		return us;
+	bits = 63 - __builtin_clzll(us);
+	return (bits - 1) * HIST_SUB_BUCKETS + ((us >> (bits - 2)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* The middle of a bucket's range, in seconds */
+static double hist_bucket_value(int bucket)
+{
+	uint64_t low, width;
+	int bits;
+
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket / 1000000.0;
+	bits = bucket / HIST_SUB_BUCKETS + 1;
+	low = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (bits - 2);
+	width = 1ULL << (bits - 2);
+	return (low + width / 2.0) / 1000000.0;
+}
+
+/* Safe to call from any thread without a lock */
+void hist_add(struct cg_histogram *hist, double secs)
+{
+	uint64_t us = secs > 0 ? secs * 1000000.0 : 0;
+	int bucket = hist_bucket(us);
+
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	__atomic_add_fetch(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->total_us, us, __ATOMIC_RELAXED);
+}
+
+/* Value in seconds below which pct percent of the samples fall */
+double hist_percentile(struct cg_histogram *hist, double pct)
+{
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!count)
+		return 0;
+	rank = count * pct / 100.0;
+	if (rank >= count)
+		rank = count - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen > rank)
+			break;
+	}
+	if (i == HIST_BUCKETS)
+		i--;
+	return hist_bucket_value(i);
+}
+
+void hist_merge(struct cg_histogram *dest, struct cg_histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dest->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dest->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dest->total_us += __atomic_load_n(&src->total_us, __ATOMIC_RELAXED);
+}
+
+double hist_mean(struct cg_histogram *hist)
+{
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+
+	if (!count)
+		return 0;
+	return __atomic_load_n(&hist->total_us, __ATOMIC_RELAXED) / 1000000.0 / count;
+}
+
+/* Samples of at most secs, to the same resolution as the percentiles */
+uint64_t hist_count_upto(struct cg_histogram *hist, double secs)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS && hist_bucket_value(i) <= secs; i++)
+		count += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+	return count;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	return pthread_create(&thr->pth, attr, start, arg);
@@ -1037,15 +1346,21 @@ static bool socket_full(struct pool *pool, bool wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	bool buffered;
+
+	mutex_lock(&pool->stratum_lock);
+	buffered = pool->sockbuf_tail > pool->sockbuf_head;
+	mutex_unlock(&pool->stratum_lock);
+	if (buffered)
 		return true;
 
 	return (socket_full(pool, false));
 }
 
+/* The sockbuf and its offsets are only changed under stratum_lock */
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_head = pool->sockbuf_tail = pool->sockbuf_scanned = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1056,63 +1371,110 @@ static void clear_sock(struct pool *pool)
 	do {
 		n = recv(pool->sock, pool->sockbuf, RECVSIZE, 0);
 	} while (n > 0);
-	mutex_unlock(&pool->stratum_lock);
-
 	clear_sockbuf(pool);
+	mutex_unlock(&pool->stratum_lock);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure the pool sockbuf has room to recv another RECVSIZE bytes. The
+ * partial line left unconsumed is first moved to the front of the buffer and
+ * only if that isn't enough is it realloced to a large enough size rounded
+ * up to a multiple of RBUFSIZE, to cope with any line length. Must be
+ * called with stratum_lock held. */
+static void recalloc_sock(struct pool *pool)
 {
-	size_t old, new;
+	size_t used, new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_head == pool->sockbuf_tail)
+		clear_sockbuf(pool);
+	if (pool->sockbuf_size - pool->sockbuf_tail > RECVSIZE)
 		return;
+
+	if (pool->sockbuf_head) {
+		used = pool->sockbuf_tail - pool->sockbuf_head;
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, used);
+		pool->sockbuf_scanned -= pool->sockbuf_head;
+		pool->sockbuf_tail = used;
+		pool->sockbuf_head = 0;
+		if (pool->sockbuf_size - pool->sockbuf_tail > RECVSIZE)
+			return;
+	}
+
+	new = pool->sockbuf_tail + RECVSIZE + 1;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
 	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quit(1, "Failed to realloc pool sockbuf in recalloc_sock");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
+/* Find the next complete line in the pool sockbuf, only scanning the bytes
+ * that have arrived since the last look. The line is terminated in place and
+ * consumed from the buffer. Must be called with stratum_lock held. */
+static char *sockbuf_line(struct pool *pool, size_t *len)
+{
+	char *line, *eol;
+
+	while (42) {
+		eol = memchr(pool->sockbuf + pool->sockbuf_scanned, '\n',
+			     pool->sockbuf_tail - pool->sockbuf_scanned);
+		if (!eol) {
+			pool->sockbuf_scanned = pool->sockbuf_tail;
+			return NULL;
+		}
+		line = pool->sockbuf + pool->sockbuf_head;
+		*eol = '\0';
+		*len = eol - line;
+		pool->sockbuf_head = pool->sockbuf_scanned = eol + 1 - pool->sockbuf;
+		/* Skip empty lines */
+		if (*len)
+			return line;
+	}
+}
+
 enum recv_ret {
 	RECV_OK,
 	RECV_CLOSED,
 	RECV_RECVFAIL
 };
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Returns the next \n terminated line from the socket, waiting up to 60
+ * seconds for it to arrive. The line is handed back in place in the pool
+ * sockbuf with the \n replaced by \0 rather than as a copy, so it is only
+ * valid until the next call to recv_line or until the socket is cleared.
+ * The stratum lock is held across each recv and every change to the
+ * sockbuf, never while waiting. */
 char *recv_line(struct pool *pool)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *sret;
+	size_t len;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	mutex_lock(&pool->stratum_lock);
+	sret = sockbuf_line(pool, &len);
+	mutex_unlock(&pool->stratum_lock);
+	if (!sret) {
 		enum recv_ret ret = RECV_OK;
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
-		if (!socket_full(pool, true)) {
-			applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
-			goto out;
-		}
-
-		mutex_lock(&pool->stratum_lock);
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			if (!socket_full(pool, true)) {
+				applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
+				goto out;
+			}
+
+			mutex_lock(&pool->stratum_lock);
+			recalloc_sock(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+				 pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
+			if (n > 0) {
+				pool->sockbuf_tail += n;
+				sret = sockbuf_line(pool, &len);
+			}
+			mutex_unlock(&pool->stratum_lock);
 			if (!n) {
 				ret = RECV_CLOSED;
 				break;
@@ -1122,14 +1484,9 @@ char *recv_line(struct pool *pool)
 					ret = RECV_RECVFAIL;
 					break;
 				}
-			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
 			}
 			cgtime(&now);
-		} while (tdiff(&now, &rstart) < 60 && !strstr(pool->sockbuf, "\n"));
-		mutex_unlock(&pool->stratum_lock);
+		} while (!sret && tdiff(&now, &rstart) < 60);
 
 		switch (ret) {
 			default:
@@ -1142,24 +1499,12 @@ char *recv_line(struct pool *pool)
 				applog(LOG_DEBUG, "Failed to recv sock in recv_line");
 				goto out;
 		}
+		if (!sret) {
+			applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
+			goto out;
+		}
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
 	pool->cgminer_pool_stats.times_received++;
 	pool->cgminer_pool_stats.bytes_received += len;
 	pool->cgminer_pool_stats.net_bytes_received += len;
@@ -1203,42 +1548,64 @@ static char *json_array_string(json_t *val, unsigned int entry)
 
 static bool parse_notify(struct pool *pool, json_t *val)
 {
-	bool clean, ret = false;
-	int merkles, i;
+	struct stratum_template *tmpl = &pool->tmpl;
+	unsigned char data[180];
+	const char *header_hex_str;
 	json_t *job_id_val;
+	char job_id[24];
+	unsigned int job_gen;
+	bool clean;
 
 	job_id_val = json_object_get(val, "miningRequestId");
-
 	if (!json_is_integer(job_id_val))
-		goto out;
+		return false;
+	snprintf(job_id, sizeof(job_id), "%lld", (long long)json_integer_value(job_id_val));
+
+	/* Decode the header once here rather than for every work item */
+	header_hex_str = json_string_value(json_object_get(val, "header"));
+	if (!header_hex_str || strlen(header_hex_str) != sizeof(data) * 2)
+		return false;
+	if (unlikely(!hex2bin(data, header_hex_str, sizeof(data))))
+		return false;
 
 	cg_wlock(&pool->data_lock);
-//	pool->swork.job_id_int = json_integer_value(job_id_val);
-	free(pool->swork.job_id);
-	pool->swork.job_id = malloc(11);
-
-	sprintf(pool->swork.job_id, "%lld", json_integer_value(job_id_val));
-	pool->swork.header_len = 360;
-	json_t *header_val = json_object_get(val, "header");
-	const char *header_hex_str = json_string_value(header_val);
-	if (!header_hex_str)
-	{
-		cg_wunlock(&pool->data_lock);
-		goto out;
-	}
-	strcpy(pool->swork.header, header_hex_str);
+	/* A change to the block sequence and previous hash, the same region
+	 * test_work_current() tracks blocks by, makes this a clean job */
+	clean = memcmp(&tmpl->data[8], &data[8], 18) != 0;
+	if (clean)
+		pool->swork.clean = true;
+	cgtime(&pool->swork.tv_notify);
+
+	/* A job resent on the same session keeps its generation so work
+	 * already made from it stays current */
+	if (clean || strcmp(tmpl->job_id, job_id) || tmpl->job_gen != pool->job_gen) {
+		job_gen = __atomic_add_fetch(&pool->job_gen, 1, __ATOMIC_RELEASE);
+		if (clean)
+			__atomic_store_n(&pool->clean_gen, job_gen, __ATOMIC_RELEASE);
+	} else
+		job_gen = tmpl->job_gen;
+
+	/* Only this thread writes the template so it can read it unlocked */
+	seq_write_begin(&tmpl->seq);
+	memcpy(tmpl->data, data, sizeof(data));
+	/* The final hash block is the same for all work from this job */
+	memset(tmpl->tail, 0, sizeof(tmpl->tail));
+	memcpy(tmpl->tail, &data[HEADER_TAIL_OFFSET], HEADER_TAIL_LEN);
+	strcpy(tmpl->job_id, job_id);
+	tmpl->job_gen = job_gen;
+	tmpl->clean_gen = pool->clean_gen;
+	copy_time(&tmpl->tv_notify, &pool->swork.tv_notify);
+	seq_write_end(&tmpl->seq);
 	cg_wunlock(&pool->data_lock);
 
 	if (opt_protocol) {
-		applog(LOG_DEBUG, "job_id: %s", pool->swork.job_id);
+		applog(LOG_DEBUG, "job_id: %s", job_id);
 	}
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
-	ret = true;
-out:
-	return ret;
+	return true;
 }
 
 static bool parse_target(struct pool *pool, json_t *val)
@@ -1251,6 +1618,9 @@ static bool parse_target(struct pool *pool, json_t *val)
 
 	cg_wlock(&pool->data_lock);
 	memcpy(pool->gbt_target, target, 32);
+	seq_write_begin(&pool->tmpl.seq);
+	memcpy(pool->tmpl.target, target, 32);
+	seq_write_end(&pool->tmpl.seq);
 	cg_wunlock(&pool->data_lock);
 
 	applog(LOG_DEBUG, "Pool %d target set to %s", pool->pool_no, target);
@@ -1297,8 +1667,9 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
-	if (!restart_stratum(pool))
-		return false;
+	/* Restarting here would overwrite the sockbuf the caller's line is
+	 * still in, so leave it to the stratum thread */
+	pool->stratum_reconnect = true;
 
 	return true;
 }
@@ -1429,14 +1800,11 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1514,12 +1882,14 @@ static bool setup_stratum_socket(struct pool *pool)
 	}
 	freeaddrinfo(servinfo);
 
+	mutex_lock(&pool->stratum_lock);
 	if (!pool->sockbuf) {
 		pool->sockbuf = calloc(RBUFSIZE, 1);
 		if (!pool->sockbuf)
 			quit(1, "Failed to calloc pool sockbuf in initiate_stratum");
 		pool->sockbuf_size = RBUFSIZE;
 	}
+	mutex_unlock(&pool->stratum_lock);
 
 	pool->sock = sockd;
 	keep_sockalive(sockd);
@@ -1556,10 +1926,10 @@ out:
 
 void suspend_stratum(struct pool *pool)
 {
-	clear_sockbuf(pool);
 	applog(LOG_INFO, "Closing socket for stratum pool %d", pool->pool_no);
 
 	mutex_lock(&pool->stratum_lock);
+	clear_sockbuf(pool);
 	pool->stratum_active = pool->stratum_notify = false;
 	if (pool->sock)
 		CLOSESOCKET(pool->sock);
@@ -1609,7 +1979,6 @@ resend:
 	recvd = true;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1678,7 +2047,8 @@ out:
 		cg_wlock(&pool->data_lock);
 		if (!pool->stratum_url)
 			pool->stratum_url = pool->sockaddr_url;
-		pool->swork.job_id = NULL;
+		/* Nothing from the old session can be submitted to this one */
+		__atomic_add_fetch(&pool->job_gen, 1, __ATOMIC_RELEASE);
 		pool->stratum_active = true;
 		pool->swork.diff = 1;
 		pool->nonce2 = 0;
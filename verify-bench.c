@@ -0,0 +1,203 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Microbenchmark for nonce verification
+ *
+ * Hashes 180 byte headers that differ only in their 8 byte nonce, the way
+ * the verify thread does, and reports nonces per second for:
+ *   hasher  blake3_hasher over the whole header, as before the verify thread
+ *   split   blake3_hash_chunk_split(), what a single nonce now goes through
+ *   many    blake3_hash_many_chunk_split() in batches, the verify thread's
+ *           path when more than one nonce is pending
+ * All three are checked to give the same hashes before timing starts.
+ *
+ * Compile:
+ *   gcc -O2 verify-bench.c blake3/blake3.c blake3/blake3_dispatch.c \
+ *     blake3/blake3_portable.c blake3/blake3_sse2_x86-64_unix.S \
+ *     blake3/blake3_sse41_x86-64_unix.S blake3/blake3_avx2_x86-64_unix.S \
+ *     blake3/blake3_avx512_x86-64_unix.S -o verify-bench
+ *
+ * Run:
+ *   ./verify-bench -t 3
+ *   ./verify-bench -b 4
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "blake3/blake3.h"
+
+#define HEADER_LEN 180
+/* Offset of the final block, as HEADER_TAIL_OFFSET in miner.h */
+#define TAIL_OFFSET 128
+#define BATCH_MAX 16
+
+static int seconds = 3;
+static int batch;
+
+static unsigned char header[HEADER_LEN];
+static uint8_t tail[BLAKE3_BLOCK_LEN];
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hash_hasher(uint64_t nonce, uint8_t *out)
+{
+	unsigned char buf[HEADER_LEN];
+	blake3_hasher hasher;
+
+	memcpy(buf, header, HEADER_LEN);
+	memcpy(buf, &nonce, sizeof(nonce));
+	blake3_hasher_init(&hasher);
+	blake3_hasher_update(&hasher, buf, HEADER_LEN);
+	blake3_hasher_finalize(&hasher, out, BLAKE3_OUT_LEN);
+}
+
+static void hash_split(uint64_t nonce, uint8_t *out)
+{
+	unsigned char buf[TAIL_OFFSET];
+
+	memcpy(buf, header, TAIL_OFFSET);
+	memcpy(buf, &nonce, sizeof(nonce));
+	blake3_hash_chunk_split(buf, tail, HEADER_LEN, out);
+}
+
+static void hash_many(uint64_t nonce, int count, uint8_t *out)
+{
+	unsigned char bufs[BATCH_MAX][TAIL_OFFSET];
+	const uint8_t *inputs[BATCH_MAX], *tails[BATCH_MAX];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t n = nonce + i;
+
+		memcpy(bufs[i], header, TAIL_OFFSET);
+		memcpy(bufs[i], &n, sizeof(n));
+		inputs[i] = bufs[i];
+		tails[i] = tail;
+	}
+	blake3_hash_many_chunk_split(inputs, tails, count, HEADER_LEN, out);
+}
+
+static void check(void)
+{
+	uint8_t want[BATCH_MAX * BLAKE3_OUT_LEN], got[BLAKE3_OUT_LEN];
+	uint8_t many[BATCH_MAX * BLAKE3_OUT_LEN];
+	int i;
+
+	hash_many(1000, batch, many);
+	for (i = 0; i < batch; i++) {
+		hash_hasher(1000 + i, &want[i * BLAKE3_OUT_LEN]);
+		hash_split(1000 + i, got);
+		if (memcmp(got, &want[i * BLAKE3_OUT_LEN], BLAKE3_OUT_LEN) ||
+		    memcmp(&many[i * BLAKE3_OUT_LEN], &want[i * BLAKE3_OUT_LEN], BLAKE3_OUT_LEN)) {
+			fprintf(stderr, "Hash mismatch for nonce %d\n", 1000 + i);
+			exit(1);
+		}
+	}
+}
+
+static void report(const char *name, uint64_t nonces, uint64_t elapsed, double base)
+{
+	double rate = nonces * 1e6 / elapsed;
+
+	printf("%-7s %12.0f nonces/s  %6.1f ns/nonce", name, rate, elapsed * 1e3 / nonces);
+	if (base)
+		printf("  x%.2f", rate / base);
+	printf("\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-b batch]\n"
+			"  -t  seconds to run each path (default 3)\n"
+			"  -b  nonces per hash_many batch (default the SIMD degree, max %d)\n",
+			prog, BATCH_MAX);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t out[BATCH_MAX * BLAKE3_OUT_LEN];
+	uint64_t nonce, start, elapsed, end;
+	double base;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+		switch (opt) {
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (!batch)
+		batch = blake3_hash_many_degree();
+	if (batch > BATCH_MAX)
+		batch = BATCH_MAX;
+	if (seconds < 1 || batch < 1)
+		usage(argv[0]);
+
+	srandom(1);
+	for (i = 0; i < HEADER_LEN; i++)
+		header[i] = random();
+	memcpy(tail, &header[TAIL_OFFSET], HEADER_LEN - TAIL_OFFSET);
+
+	check();
+	printf("hash_many degree %d, batch %d\n", (int)blake3_hash_many_degree(), batch);
+
+	/* Check the clock only every 1024 nonces so it doesn't get timed */
+	nonce = 0;
+	start = now_us();
+	end = start + seconds * 1000000ULL;
+	do {
+		for (i = 0; i < 1024; i++)
+			hash_hasher(nonce++, out);
+	} while (now_us() < end);
+	elapsed = now_us() - start;
+	base = nonce * 1e6 / elapsed;
+	report("hasher", nonce, elapsed, 0);
+
+	nonce = 0;
+	start = now_us();
+	end = start + seconds * 1000000ULL;
+	do {
+		for (i = 0; i < 1024; i++)
+			hash_split(nonce++, out);
+	} while (now_us() < end);
+	elapsed = now_us() - start;
+	report("split", nonce, elapsed, base);
+
+	nonce = 0;
+	start = now_us();
+	end = start + seconds * 1000000ULL;
+	do {
+		for (i = 0; i < 1024; i++) {
+			hash_many(nonce, batch, out);
+			nonce += batch;
+		}
+	} while (now_us() < end);
+	elapsed = now_us() - start;
+	report("many", nonce, elapsed, base);
+
+	return 0;
+}